@@ -1,22 +1,55 @@
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
 #include <GL/glew.h>
 #include <GL/glut.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glx.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#define WINDOW_WIDTH 364
-#define WINDOW_HEIGHT 364
-#define FBO_WIDTH 364
-#define FBO_HEIGHT 364
-#define NUM_LIGHT 1
-#define WINDOW_ASPECT ((float)WINDOW_WIDTH/(float)WINDOW_HEIGHT)
+#define DEFAULT_WIDTH 364
+#define DEFAULT_HEIGHT 364
+#define DEFAULT_LIGHTS 1
+#define MAX_LIGHTS 64 // FrameDataに確保するライトの数 (実際の数はシェーダの種類ごとに決まる)
+#define MAX_TILED_LIGHTS 4096 // タイル分割のライトカリングで扱えるライトの数
+#define TILE_SIZE 16 // ライトカリングのタイルの大きさ(画素)
+#define MAX_TILE_LIGHTS (TILE_SIZE*TILE_SIZE-1) // 1タイルのライトリストの長さ (先頭は個数)
+#define LIGHT_CUTOFF 0.002 // これより弱い光は影響範囲の外とみなす
+#define FILL_LIGHT_RADIUS 0.6 // 2個目以降のライトの影響範囲
 #define SCREEN_FAR 100.0
 #define SCREEN_NEAR 0.1
-#define NUM_SAMPLE_POINTS 8
+#define NUM_SAMPLE_POINTS 8 // SAMPLE_POINTSの点の数 (既定のカーネル)
+#define MAX_SAMPLE_POINTS 32
 #define MAX_ENV 0.13
+#define HIZ_LOG_OFFSET 2 // Hi-Zでは2^HIZ_LOG_OFFSET画素より遠いサンプルから縮小したmipを読む
+#define AO_DEPTH_TOLERANCE 0.05 // 低解像度AOの補間で同じ面とみなす深度差(距離に対する比率)
+#define AO_TEMPORAL_SAMPLES 4 // temporal AOで1フレームに使うサンプル数
+#define AO_TEMPORAL_ALPHA 0.1 // temporal AOで今のフレームを混ぜる割合の下限
+#define AO_MAX_APRON 16 // compute SSAOで共有メモリに読むタイル周囲の幅の上限(画素)
 #define CAM_POSX 0.0
 #define CAM_POSY 0.0
 #define CAM_POSZ 5.5
+#define MAX_SHADER_VARIANTS 64
+#define MESH_FIT_SIZE 2.5 // 読み込んだメッシュを合わせる大きさ (箱の1辺)
+#define MAX_MESHES 4096
+#define DEFAULT_SHADER_CACHE_DIR ".ssao_shader_cache"
 
 /**
  * ATI constant values. please refer link as well.
@@ -46,22 +79,121 @@ const float SAMPLE_POINTS[NUM_SAMPLE_POINTS*2] = {
     1,-1,
 };
 
+#define STR(str) DOSTR(str)
+#define DOSTR(str) # str
+
+/**
+ * per-frame parameters shared by all programs. one std140 uniform buffer
+ * (struct FrameData) is written once per frame and stays bound to
+ * FRAME_DATA_BINDING.
+ */
+#define FRAME_DATA_BINDING 0
+#define FRAME_DATA_BLOCK \
+    "#extension GL_ARB_uniform_buffer_object : require\n" \
+    "layout(std140) uniform FrameData {\n" \
+    "    mat4 in_Proj;\n" \
+    "    mat4 in_View;\n" \
+    "    mat4 in_Normal_View;\n" /* View行列から平行移動を除いた回転のみの行列 */ \
+    "    vec4 in_light_pos[" STR(MAX_LIGHTS) "];\n" /* xyz: ライトの座標 */ \
+    "    vec4 in_light_power[" STR(MAX_LIGHTS) "];\n" /* xyz: ライトの出力 */ \
+    "    vec4 in_light_dist[" STR(MAX_LIGHTS) "];\n" /* x: スポットライトの減衰開始距離, y: 影響範囲の半径 */ \
+    "    vec4 in_sample_points[" STR(MAX_SAMPLE_POINTS) "];\n" /* xy: サンプリング位置 */ \
+    "    mat4 in_Reproject;\n" /* 今のフレームのView座標 -> 前のフレームのView座標 */ \
+    "    vec4 in_ao_temporal;\n" /* x: 今のフレームを混ぜる割合 (1: 履歴なし), y: 生成したカーネル全体の回転 */ \
+    "    vec4 in_screen;\n" /* xy: 1画素のuv上の大きさ, zw: 解像度 */ \
+    "    vec4 in_cam_pos;\n" /* xyz: カメラの座標 */ \
+    "    ivec4 in_light_count;\n" /* x: ライトの数 */ \
+    "    vec4 in_viewport;\n" /* xy: 描画範囲のuv上の大きさ, zw: 描画解像度 (--frame-budget) */ \
+    "};\n"
+
+/**
+ * G-buffer layouts (selected with --gbuffer, passed to the shaders as GBUFFER_LAYOUT)
+ *  FULL   : position RGBA32F + normal RGBA32F + albedo RGBA8 + depth32F = 40 bytes/pixel
+ *  HALF   : position RGBA32F + normal RGBA16F + albedo RGBA8 + depth32F = 32 bytes/pixel
+ *           (a 16bit position makes the SSAO depth comparison band on flat faces)
+ *  COMPACT: normal RG16F(octahedral) + albedo RGBA8 + depth32F = 12 bytes/pixel,
+ *           view-space position is reconstructed from the depth texture
+ */
+#define GBUFFER_FULL 0
+#define GBUFFER_HALF 1
+#define GBUFFER_COMPACT 2
+
+#define GBUFFER_DEFINES \
+    "#define GBUFFER_FULL " STR(GBUFFER_FULL) "\n" \
+    "#define GBUFFER_HALF " STR(GBUFFER_HALF) "\n" \
+    "#define GBUFFER_COMPACT " STR(GBUFFER_COMPACT) "\n"
+
+/**
+ * octahedral normal encoding into [-1,1]^2
+ */
+#define NORMAL_ENCODING \
+    "vec2 encodeNormal(vec3 n)\n" \
+    "{\n" \
+    "    n /= abs(n.x) + abs(n.y) + abs(n.z);\n" \
+    "    if (n.z < 0.0) {\n" \
+    "        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n" \
+    "    }\n" \
+    "    return n.xy;\n" \
+    "}\n" \
+    "vec3 decodeNormal(vec2 e)\n" \
+    "{\n" \
+    "    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n" \
+    "    float t = max(-n.z, 0.0);\n" \
+    "    n.x += (n.x >= 0.0) ? -t : t;\n" \
+    "    n.y += (n.y >= 0.0) ? -t : t;\n" \
+    "    return normalize(n);\n" \
+    "}\n"
+
+/**
+ * G-buffer access independent of the layout. fetchPosition().w is 0 where
+ * nothing was drawn. samples past the top or right edge of the drawn part of
+ * the targets (in_viewport) read its edge, like the texture clamp at full size.
+ */
+#define GBUFFER_FETCH \
+    NORMAL_ENCODING \
+    "uniform sampler2D in_Position_Img;\n" \
+    "uniform sampler2D in_Normal_Img;\n" \
+    "uniform sampler2D in_Albedo_Img;\n" \
+    "uniform sampler2D in_Depth_Img;\n" \
+    "#if GBUFFER_LAYOUT == GBUFFER_COMPACT\n" \
+    "vec4 fetchPosition(vec2 uv)\n" \
+    "{\n" \
+    "    float depth = texture2D(in_Depth_Img, min(uv, in_viewport.xy - 0.5 * in_screen.xy)).r;\n" \
+    "    if (depth >= 1.0) return vec4(0.0);\n" \
+    "    float z = -in_Proj[3][2] / ((depth * 2.0 - 1.0) + in_Proj[2][2]);\n" /* 射影行列の逆算 */ \
+    "    vec2 ndc = uv / in_viewport.xy * 2.0 - 1.0;\n" \
+    "    return vec4(-z * ndc.x / in_Proj[0][0], -z * ndc.y / in_Proj[1][1], z, 1.0);\n" \
+    "}\n" \
+    "vec3 fetchNormal(vec2 uv)\n" \
+    "{\n" \
+    "    return decodeNormal(texture2D(in_Normal_Img, uv).xy);\n" \
+    "}\n" \
+    "#else\n" \
+    "vec4 fetchPosition(vec2 uv)\n" \
+    "{\n" \
+    "    return texture2D(in_Position_Img, min(uv, in_viewport.xy - 0.5 * in_screen.xy));\n" \
+    "}\n" \
+    "vec3 fetchNormal(vec2 uv)\n" \
+    "{\n" \
+    "    return normalize(texture2D(in_Normal_Img, uv).xyz);\n" \
+    "}\n" \
+    "#endif\n"
+
 const GLchar* PASS1_VERT_SHADER =
     "#version 130\n"
-    "uniform mat4 in_MVP;\n"
-    "uniform mat4 in_MV;\n"
-    "uniform mat4 in_Normal_MV;\n" // ModelView行列から平行移動を除いた回転のみの行列
+    FRAME_DATA_BLOCK
     "attribute vec4 in_Position;\n"
     "attribute vec4 in_Normal;\n"
     "attribute vec2 in_Texture_coord;\n"
+    "attribute mat4 in_Model;\n" // インスタンスごとのモデル行列
     "varying vec4 v_Position;\n"
     "varying vec4 v_Normal;\n"
     "varying vec2 v_texture_coord;\n"
     "void main(void)\n"
     "{\n"
-    "    gl_Position = in_MVP * in_Position;\n"
-    "    v_Position = in_MV * in_Position;\n"
-    "    v_Normal = in_Normal_MV * in_Normal;\n"
+    "    v_Position = in_View * (in_Model * in_Position);\n"
+    "    gl_Position = in_Proj * v_Position;\n"
+    "    v_Normal = in_Normal_View * (in_Model * vec4(in_Normal.xyz, 0.0));\n"
     "    v_texture_coord = in_Texture_coord;\n"
     "}\n";
 
@@ -72,10 +204,15 @@ const GLchar* PASS1_FRAG_SHADER =
     "varying vec4 v_Position;\n"
     "varying vec4 v_Normal;\n"
     "varying vec2 v_texture_coord;\n"
+    NORMAL_ENCODING
     "void main(void)\n"
     "{\n"
+    "#if GBUFFER_LAYOUT == GBUFFER_COMPACT\n"
+    "    gl_FragData[1] = vec4(encodeNormal(normalize(v_Normal.xyz)), 0.0, 0.0);\n" // 位置はデプスから復元するので書き出さない
+    "#else\n"
     "    gl_FragData[0] = v_Position;\n"
     "    gl_FragData[1] = normalize(v_Normal);\n"
+    "#endif\n"
     "    gl_FragData[2] = texture2D(in_Img, v_texture_coord);\n"
     "}\n";
 
@@ -90,753 +227,6885 @@ const GLchar* PASS2_VERT_SHADER =
     "    v_texture_coord = in_Texture_coord;\n"
     "}\n";
 
-#define STR(str) DOSTR(str)
-#define DOSTR(str) # str
+/**
+ * view-space position of an SSAO sample "radius" pixels away from the pixel
+ * being shaded. with HIZ the depth comes from the Hi-Z mip whose texels are
+ * about 2^-HIZ_LOG_OFFSET of the radius, so wide kernels read a small, cache
+ * friendly footprint instead of the full resolution position texture.
+ */
+#define SSAO_SAMPLE_POSITION \
+    "#if HIZ\n" \
+    "uniform sampler2D in_HiZ_Img;\n" \
+    "vec3 samplePosition(vec2 uv, float radius)\n" \
+    "{\n" \
+    "    int level = int(max(0.0, floor(log2(radius)) - " STR(HIZ_LOG_OFFSET) ".0));\n" \
+    "    ivec2 texel = min(ivec2(uv * in_screen.zw) >> level, (ivec2(in_viewport.zw) >> level) - 1);\n" \
+    "    float depth = texelFetch(in_HiZ_Img, max(texel, ivec2(0)), level).r;\n" /* 0: 背景 */ \
+    /* 縮小時に選ばれた元の画素を辿り、その画素の位置として復元する */ \
+    "    for (int l = level - 1; l >= 0; l--) {\n" \
+    "        texel = min(texel * 2 + ivec2(texel.y & 1, texel.x & 1), max((ivec2(in_viewport.zw) >> l) - 1, ivec2(0)));\n" \
+    "    }\n" \
+    "    vec2 ndc = (vec2(texel) + 0.5) * in_screen.xy / in_viewport.xy * 2.0 - 1.0;\n" \
+    "    return vec3(depth * ndc.x / in_Proj[0][0], depth * ndc.y / in_Proj[1][1], -depth);\n" \
+    "}\n" \
+    "#else\n" \
+    "vec3 samplePosition(vec2 uv, float radius)\n" \
+    "{\n" \
+    "    return fetchPosition(uv).xyz;\n" \
+    "}\n" \
+    "#endif\n"
+
+/**
+ * SSAO kernels (--ao-kernel, passed to the shaders as AO_KERNEL)
+ *  FIXED     : SAMPLE_POINTS, or Halton points for other sizes, from FrameData
+ *  STRATIFIED: one pair per angular stratum, the radii stratified by area
+ *  POISSON   : best candidate pairs, as far from each other as possible
+ * the generated kernels are compiled into the shader variant as a fully
+ * unrolled list of AO_TAPS, and can be rotated per pixel (--ao-noise, AO_NOISE)
+ * by a tiled 4x4 texture or by interleaved gradient noise.
+ */
+#define AO_KERNEL_FIXED 0
+#define AO_KERNEL_STRATIFIED 1
+#define AO_KERNEL_POISSON 2
+#define NUM_AO_KERNELS 3
+
+#define AO_NOISE_NONE 0
+#define AO_NOISE_TILED 1
+#define AO_NOISE_IGN 2
+#define NUM_AO_NOISES 3
+#define AO_NOISE_SIZE 4 // タイル状のノイズテクスチャの大きさ
+
+/**
+ * blind-corner SSAO around the G-buffer texel "uv". SSAO_KERNEL needs a
+ * samplePosition() in front of it.
+ */
+#define SSAO_KERNEL \
+    "#if AO_NOISE == " STR(AO_NOISE_TILED) "\n" \
+    "uniform sampler2D in_Ao_Noise_Img;\n" \
+    "#endif\n" \
+    /* 0~1: カーネルを回す角度 (半周) */ \
+    "float aoNoise(vec2 uv)\n" \
+    "{\n" \
+    "    vec2 pixel = floor(uv * in_screen.zw / float(AO_SCALE));\n" \
+    "#if AO_NOISE == " STR(AO_NOISE_TILED) "\n" \
+    "    return texelFetch(in_Ao_Noise_Img, ivec2(pixel) & " STR(AO_NOISE_SIZE) " - 1, 0).r;\n" \
+    "#elif AO_NOISE == " STR(AO_NOISE_IGN) "\n" \
+    "    return fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));\n" \
+    "#else\n" \
+    "    return 0.0;\n" \
+    "#endif\n" \
+    "}\n" \
+    /* offsetと-offsetの両方が手前にあれば1 */ \
+    "int blindCorner(vec2 uv, float base_dist, vec2 offset)\n" \
+    "{\n" \
+    "    vec2 p1_tex = uv + offset*in_screen.xy;\n" \
+    "    vec2 p2_tex = uv + (-offset)*in_screen.xy;\n" \
+    "    float radius = length(offset);\n" \
+    "    vec3 p1_pos = samplePosition(p1_tex, radius);\n" \
+    "    vec3 p2_pos = samplePosition(p2_tex, radius);\n" \
+    "    float p1_dist = length(p1_pos - in_cam_pos.xyz);\n" \
+    "    float p2_dist = length(p2_pos - in_cam_pos.xyz);\n" \
+    "    return (base_dist > p1_dist && base_dist > p2_dist) ? 1 : 0;\n" \
+    "}\n" \
+    "float ssao(vec2 uv, vec4 pos, vec3 normal)\n" \
+    "{\n" \
+    SSAO_BODY \
+    "}\n"
+
+#define SSAO_FUNCTION \
+    SSAO_SAMPLE_POSITION \
+    SSAO_KERNEL
+
+#if 1
+     // Enable SSAO
+#define SSAO_BODY \
+    "    float base_dist = length(pos.xyz - in_cam_pos.xyz);\n" \
+    "    int non_blind_corner = AO_SAMPLES;\n" \
+    "#if AO_KERNEL == " STR(AO_KERNEL_FIXED) "\n" \
+    "    for (int i = 0; i < AO_SAMPLES; i++) {\n" \
+    "        non_blind_corner -= blindCorner(uv, base_dist, in_sample_points[i].xy);\n" \
+    "    }\n" \
+    "#else\n" \
+    "    float rotation = 3.14159265 * aoNoise(uv) + in_ao_temporal.y;\n" \
+    "    mat2 rotate = mat2(cos(rotation), sin(rotation), -sin(rotation), cos(rotation));\n" \
+    /* 回した後で整数画素に丸めて、どのバックエンドでもテクセルの中心を読む */ \
+    "#define AO_TAP(offset) non_blind_corner -= blindCorner(uv, base_dist, round(rotate * (offset)));\n" \
+    "    AO_TAPS\n" \
+    "#endif\n" \
+    "    return (float(non_blind_corner) / float(AO_SAMPLES)) * " STR(MAX_ENV) ";\n"
+#else
+     // Disable SSAO
+#define SSAO_BODY \
+    "    return " STR(MAX_ENV) ";\n"
+#endif
+
+/**
+ * separate SSAO pass (AO_PASS). renders into a 1/AO_SCALE resolution RGBA16F
+ * target: x = AO, y = view-space z (0: background), zw = encoded normal.
+ * every AO texel is computed at the full resolution pixel (x, y) * AO_SCALE.
+ * with AO_TEMPORAL the kernel changes every frame and the result is blended
+ * with the previous frame's target, reprojected through in_Reproject.
+ */
+const GLchar* AO_FRAG_SHADER =
+    "#version 130\n"
+    FRAME_DATA_BLOCK
+    "precision highp float;\n"
+    GBUFFER_FETCH
+    SSAO_FUNCTION
+    "uniform sampler2D in_Ao_History_Img;\n"
+    "void main(void)\n"
+    "{\n"
+    "    vec2 uv = (floor(gl_FragCoord.xy) * float(AO_SCALE) + 0.5) * in_screen.xy;\n"
+    "    vec4 pos4 = fetchPosition(uv);\n"
+    "    if (pos4.w <= 0.0) {\n"
+    "        gl_FragColor = vec4(0.0);\n"
+    "        return;\n"
+    "    }\n"
+    "    vec3 normal = fetchNormal(uv);\n"
+    "    float ao = ssao(uv, pos4, normal);\n"
+    "#if AO_TEMPORAL\n"
+    "    vec4 prev_pos = in_Reproject * vec4(pos4.xyz, 1.0);\n"
+    "    vec4 prev_clip = in_Proj * prev_pos;\n"
+    "    vec2 prev_uv = (prev_clip.xy / prev_clip.w * 0.5 + 0.5) * in_viewport.xy;\n"
+    "    if (in_ao_temporal.x < 1.0 && all(greaterThanEqual(prev_uv, vec2(0.0))) && all(lessThan(prev_uv, in_viewport.xy))) {\n"
+    "        vec4 history = texture2D(in_Ao_History_Img, prev_uv);\n"
+    // 前のフレームで別の面が見えていた場所は履歴を捨てる
+    "        if (history.y != 0.0 && abs(history.y - prev_pos.z) < " STR(AO_DEPTH_TOLERANCE) " * abs(prev_pos.z)) {\n"
+    "            ao = mix(history.x, ao, in_ao_temporal.x);\n"
+    "        }\n"
+    "    }\n"
+    "#endif\n"
+    "    gl_FragColor = vec4(ao, pos4.z, encodeNormal(normal));\n"
+    "}\n";
+
+/**
+ * compute-shader backend of the full resolution AO pass (--ao-compute). every
+ * work group first copies the view-space positions of its TILE_SIZE x TILE_SIZE
+ * tile plus an AO_APRON pixel border into shared memory, then runs the same
+ * SSAO_KERNEL with samplePosition() reading that copy instead of the G-buffer.
+ * the kernel offsets are whole pixels, so the samples land on the texel
+ * centers the fragment path reads. writes the AO_FRAG_SHADER target layout.
+ */
+const GLchar* AO_COMP_SHADER =
+    "#version 430 compatibility\n"
+    FRAME_DATA_BLOCK
+    "precision highp float;\n"
+    GBUFFER_FETCH
+    "layout(local_size_x = " STR(TILE_SIZE) ", local_size_y = " STR(TILE_SIZE) ") in;\n"
+    "layout(rgba16f) writeonly uniform image2D out_Ao;\n"
+    "#define TILE_WIDTH (" STR(TILE_SIZE) " + 2 * AO_APRON)\n"
+    // vec3の配列より共有メモリの使用量が少ない
+    "shared float tile_x[TILE_WIDTH * TILE_WIDTH];\n"
+    "shared float tile_y[TILE_WIDTH * TILE_WIDTH];\n"
+    "shared float tile_z[TILE_WIDTH * TILE_WIDTH];\n"
+    "ivec2 tile_origin;\n"
+    "vec3 samplePosition(vec2 uv, float radius)\n"
+    "{\n"
+    "    ivec2 p = ivec2(floor(uv * in_screen.zw)) - tile_origin;\n"
+    "    int i = p.y * TILE_WIDTH + p.x;\n"
+    "    return vec3(tile_x[i], tile_y[i], tile_z[i]);\n"
+    "}\n"
+    SSAO_KERNEL
+    "void main(void)\n"
+    "{\n"
+    "    tile_origin = ivec2(gl_WorkGroupID.xy) * " STR(TILE_SIZE) " - AO_APRON;\n"
+    // 画面外の画素もフラグメント版と同じく端のテクセルから読む
+    "    for (int i = int(gl_LocalInvocationIndex); i < TILE_WIDTH * TILE_WIDTH; i += " STR(TILE_SIZE) " * " STR(TILE_SIZE) ") {\n"
+    "        vec2 p = vec2(tile_origin + ivec2(i % TILE_WIDTH, i / TILE_WIDTH)) + 0.5;\n"
+    "        vec3 pos = fetchPosition(p * in_screen.xy).xyz;\n"
+    "        tile_x[i] = pos.x;\n"
+    "        tile_y[i] = pos.y;\n"
+    "        tile_z[i] = pos.z;\n"
+    "    }\n"
+    "    barrier();\n"
+    "    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);\n"
+    "    if (any(greaterThanEqual(pixel, ivec2(in_viewport.zw)))) return;\n"
+    "    vec2 uv = (vec2(pixel) + 0.5) * in_screen.xy;\n"
+    "    vec4 pos4 = fetchPosition(uv);\n"
+    "    if (pos4.w <= 0.0) {\n"
+    "        imageStore(out_Ao, pixel, vec4(0.0));\n"
+    "        return;\n"
+    "    }\n"
+    "    vec3 normal = fetchNormal(uv);\n"
+    "    imageStore(out_Ao, pixel, vec4(ssao(uv, pos4, normal), pos4.z, encodeNormal(normal)));\n"
+    "}\n";
+
+/**
+ * Hi-Z pyramid of linear depth (-z in view space, 0: background). level 0 is
+ * converted from the depth buffer, every further level keeps one texel of its
+ * 2x2 source block on a rotated grid (x + (y & 1), y + (x & 1)). a min/max
+ * reduction would move the samples off the surface, which the blind-corner
+ * test turns into occlusion on flat faces; a subsample stays a real surface
+ * point that samplePosition() can place exactly.
+ */
+const GLchar* HIZ_FRAG_SHADER =
+    "#version 130\n"
+    FRAME_DATA_BLOCK
+    "precision highp float;\n"
+    "uniform sampler2D in_Depth_Img;\n"
+    "uniform sampler2D in_HiZ_Img;\n"
+    "uniform int in_HiZ_Level;\n"
+    "void main(void)\n"
+    "{\n"
+    "    ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "    if (in_HiZ_Level == 0) {\n"
+    "        float depth = texelFetch(in_Depth_Img, pixel, 0).r;\n"
+    "        gl_FragColor = vec4(depth >= 1.0 ? 0.0 : in_Proj[3][2] / ((depth * 2.0 - 1.0) + in_Proj[2][2]));\n"
+    "        return;\n"
+    "    }\n"
+    "    int src_level = in_HiZ_Level - 1;\n"
+    "    ivec2 last = max((ivec2(in_viewport.zw) >> src_level) - 1, ivec2(0));\n"
+    "    ivec2 src = min(pixel * 2 + ivec2(pixel.y & 1, pixel.x & 1), last);\n"
+    /* BASE_LEVELをsrc_levelに絞っているので、lodはそこからの相対値 */
+    "    gl_FragColor = vec4(texelFetch(in_HiZ_Img, src, 0).r);\n"
+    "}\n";
+
+/**
+ * diffuse term of one point light. the inverse square falloff is windowed to
+ * reach 0 at the radius of influence (dist.y), so culled lights do not leave
+ * visible edges.
+ */
+#define POINT_LIGHT \
+    "vec3 pointLight(vec3 albedo, vec3 pos, vec3 normal, vec3 light_pos, vec3 power, vec2 dist)\n" \
+    "{\n" \
+    "    vec3 d = light_pos - pos;\n" \
+    "    float len = length(d);\n" \
+    "    float dir_power = min(1.0, max(0.0, dot(d / len, normal)));\n" /* 角度に対する光の減衰率 */ \
+    "    float len_power = 1.0 / pow(max(1.0, len / dist.x), 2.0);\n" /* 距離に対する光の減衰率(逆2乗) */ \
+    "    float r = len / dist.y;\n" \
+    "    float window = clamp(1.0 - r * r * r * r, 0.0, 1.0);\n" \
+    "    return (albedo * power) * (dir_power * len_power * window * window);\n" /* 拡散反射のみ計算 */ \
+    "}\n"
+
+/**
+ * tiled light culling. one work group per TILE_SIZE x TILE_SIZE tile finds the
+ * depth bounds of the tile and collects the lights whose sphere of influence
+ * touches the view-space box of the tile. the list is written into the tile's
+ * own TILE_SIZE x TILE_SIZE block of out_Tile_Lights: slot 0 is the count and
+ * slot s (at (s % TILE_SIZE, s / TILE_SIZE)) the (s-1)th light index.
+ */
+const GLchar* TILE_CULL_COMP_SHADER =
+    "#version 430\n"
+    FRAME_DATA_BLOCK
+    "layout(local_size_x = " STR(TILE_SIZE) ", local_size_y = " STR(TILE_SIZE) ") in;\n"
+    "uniform sampler2D in_Depth_Img;\n"
+    "uniform sampler2D in_Light_Img;\n"
+    "layout(r32ui) writeonly uniform uimage2D out_Tile_Lights;\n"
+    "shared uint tile_min_depth;\n"
+    "shared uint tile_max_depth;\n"
+    "shared uint tile_count;\n"
+    "shared uint tile_lights[" STR(MAX_TILE_LIGHTS) "];\n"
+    "float viewZ(float depth)\n"
+    "{\n"
+    "    return -in_Proj[3][2] / ((depth * 2.0 - 1.0) + in_Proj[2][2]);\n"
+    "}\n"
+    "void main(void)\n"
+    "{\n"
+    "    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);\n"
+    "    uint local = gl_LocalInvocationIndex;\n"
+    "    if (local == 0u) {\n"
+    "        tile_min_depth = 0xffffffffu;\n"
+    "        tile_max_depth = 0u;\n"
+    "        tile_count = 0u;\n"
+    "    }\n"
+    "    barrier();\n"
+    "    if (all(lessThan(pixel, ivec2(in_viewport.zw)))) {\n"
+    "        float depth = texelFetch(in_Depth_Img, pixel, 0).r;\n"
+    "        if (depth < 1.0) {\n" // 背景は除く
+    // 0以上のfloatはビット列のまま大小を比較できる
+    "            atomicMin(tile_min_depth, floatBitsToUint(depth));\n"
+    "            atomicMax(tile_max_depth, floatBitsToUint(depth));\n"
+    "        }\n"
+    "    }\n"
+    "    barrier();\n"
+    "    ivec2 base = ivec2(gl_WorkGroupID.xy) * " STR(TILE_SIZE) ";\n"
+    "    if (tile_min_depth <= tile_max_depth) {\n"
+    "        float z_near = viewZ(uintBitsToFloat(tile_min_depth));\n"
+    "        float z_far = viewZ(uintBitsToFloat(tile_max_depth));\n"
+    // タイルの視錐台を深度の範囲で切り取り、View座標のAABBで近似する
+    "        vec2 ndc_min = vec2(base) * in_screen.xy / in_viewport.xy * 2.0 - 1.0;\n"
+    "        vec2 ndc_max = vec2(base + " STR(TILE_SIZE) ") * in_screen.xy / in_viewport.xy * 2.0 - 1.0;\n"
+    "        vec2 scale = vec2(in_Proj[0][0], in_Proj[1][1]);\n"
+    "        vec3 box_min = vec3(min(-z_near * ndc_min, -z_far * ndc_min) / scale, z_far);\n"
+    "        vec3 box_max = vec3(max(-z_near * ndc_max, -z_far * ndc_max) / scale, z_near);\n"
+    "        for (int i = int(local); i < in_light_count.x; i += " STR(TILE_SIZE) " * " STR(TILE_SIZE) ") {\n"
+    "            vec3 light_pos = texelFetch(in_Light_Img, ivec2(i, 0), 0).xyz;\n"
+    "            float radius = texelFetch(in_Light_Img, ivec2(i, 2), 0).y;\n"
+    "            vec3 d = light_pos - clamp(light_pos, box_min, box_max);\n"
+    "            if (dot(d, d) < radius * radius) {\n"
+    "                uint slot = atomicAdd(tile_count, 1u);\n"
+    "                if (slot < uint(" STR(MAX_TILE_LIGHTS) ")) tile_lights[slot] = uint(i);\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    barrier();\n"
+    "    uint count = min(tile_count, uint(" STR(MAX_TILE_LIGHTS) "));\n"
+    "    ivec2 slot_pos = base + ivec2(gl_LocalInvocationID.xy);\n"
+    "    if (local == 0u) {\n"
+    "        imageStore(out_Tile_Lights, slot_pos, uvec4(count));\n"
+    "    } else if (local <= count) {\n"
+    "        imageStore(out_Tile_Lights, slot_pos, uvec4(tile_lights[local - 1u]));\n"
+    "    }\n"
+    "}\n";
+
 const GLchar* PASS2_FRAG_SHADER =
     "#version 130\n"
+    FRAME_DATA_BLOCK
     "precision highp float;\n"
-    "const vec2 fragment_size = vec2(1.0/" STR(FBO_WIDTH) ".0, 1.0/" STR(FBO_HEIGHT) ".0);\n"
-    "const vec3 cam_pos = vec3(" STR(CAM_POSX) "," STR(CAM_POSY) "," STR(CAM_POSZ) ");\n"
-    "uniform sampler2D in_Position_Img;\n"
-    "uniform sampler2D in_Normal_Img;\n"
-    "uniform sampler2D in_Albedo_Img;\n"
-    "uniform vec3 in_light_pos[" STR(NUM_LIGHT) "];\n" // ライトの座標
-    "uniform vec3 in_light_power[" STR(NUM_LIGHT) "];\n" // ライトの出力
-    "uniform float in_light_dist[" STR(NUM_LIGHT) "];\n" // スポットライトの減衰開始距離
-    "uniform vec2 in_sample_points[" STR(NUM_SAMPLE_POINTS) "];\n"
+    GBUFFER_FETCH
     "varying vec2 v_texture_coord;\n"
-
-    "float ssao(vec4 pos, vec3 normal)\n"
+    "#if AO_PASS\n"
+    "uniform sampler2D in_Ao_Img;\n"
+    // 低解像度のAOを深度と法線の近いテクセルだけで補間する (bilateral upsampling)
+    "float ssao(vec2 uv, vec4 pos, vec3 normal)\n"
     "{\n"
-#if 1
-         // Enable SSAO
-    "    float base_dist = length(pos.xyz - cam_pos);\n"
-    "    int non_blind_corner = " STR(NUM_SAMPLE_POINTS) ";\n"
-    "    for (int i = 0; i < " STR(NUM_SAMPLE_POINTS) "; i++) {\n"
-    "        vec2 p1_tex = v_texture_coord + in_sample_points[i]*fragment_size;\n"
-    "        vec2 p2_tex = v_texture_coord + (-in_sample_points[i])*fragment_size;\n"
-    "        vec3 p1_pos = texture2D(in_Position_Img, p1_tex).xyz;\n"
-    "        vec3 p2_pos = texture2D(in_Position_Img, p2_tex).xyz;\n"
-    "        float p1_dist = length(p1_pos - cam_pos);\n"
-    "        float p2_dist = length(p2_pos - cam_pos);\n"
-    "        if (base_dist > p1_dist && base_dist > p2_dist) {\n"
-    "            non_blind_corner--;\n"
+    "#if AO_SCALE == 1\n"
+    "    return texelFetch(in_Ao_Img, ivec2(uv * in_screen.zw), 0).x;\n"
+    "#endif\n"
+    "    vec2 c = (uv * in_screen.zw - 0.5) / float(AO_SCALE);\n"
+    "    vec2 base = floor(c);\n"
+    "    vec2 f = c - base;\n"
+    "    ivec2 last = (ivec2(in_viewport.zw) + AO_SCALE - 1) / AO_SCALE - 1;\n"
+    "    float sum = 0.0;\n"
+    "    float weight = 0.0;\n"
+    "    float nearest = " STR(MAX_ENV) ";\n"
+    "    float nearest_dz = 1e30;\n"
+    "    for (int j = 0; j < 2; j++) {\n"
+    "        for (int i = 0; i < 2; i++) {\n"
+    "            vec4 s = texelFetch(in_Ao_Img, clamp(ivec2(base) + ivec2(i, j), ivec2(0), last), 0);\n"
+    "            if (s.y == 0.0) continue;\n" // 背景
+    "            float dz = abs(s.y - pos.z);\n"
+    "            float w = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);\n"
+    "            w *= max(0.0, 1.0 - dz / (" STR(AO_DEPTH_TOLERANCE) " * abs(pos.z)));\n"
+    "            float nd = max(0.0, dot(decodeNormal(s.zw), normal));\n"
+    "            nd *= nd;\n"
+    "            nd *= nd;\n"
+    "            w *= nd * nd;\n" // 法線の差による重み (cos^8)
+    "            sum += s.x * w;\n"
+    "            weight += w;\n"
+    "            if (dz < nearest_dz) {\n"
+    "                nearest_dz = dz;\n"
+    "                nearest = s.x;\n"
+    "            }\n"
     "        }\n"
     "    }\n"
-    "    return (float(non_blind_corner) / float(" STR(NUM_SAMPLE_POINTS) ")) * " STR(MAX_ENV) ";\n"
-#else
-         // Disable SSAO
-    "    return "STR(MAX_ENV)";"
-#endif
+    "    return (weight > 1e-4) ? sum / weight : nearest;\n" // 合う点がなければ深度が最も近い点
     "}\n"
+    "#else\n"
+    SSAO_FUNCTION
+    "#endif\n"
+    POINT_LIGHT
+    "#if TILED_LIGHTS\n"
+    "uniform sampler2D in_Light_Img;\n" // x: ライトの番号, y: 0 座標, 1 出力, 2 減衰距離と影響範囲
+    "uniform usampler2D in_Tile_Lights_Img;\n"
+    "#endif\n"
 
     "void main(void)\n"
     "{\n"
-    "    vec4 pos4 = texture2D(in_Position_Img, v_texture_coord);\n"
+    "    vec2 uv = v_texture_coord * in_viewport.xy;\n" // G-bufferの描いた範囲
+    "    vec4 pos4 = fetchPosition(uv);\n"
     "    if (pos4.w <= 0.0) discard;\n" // glClearで塗りつぶされただけの場所は描画しない
-    "    vec3 normal = normalize(texture2D(in_Normal_Img, v_texture_coord).xyz);\n"
-    "    float ssao_rate = ssao(pos4, normal);\n"
-    "    vec3 albedo = texture2D(in_Albedo_Img, v_texture_coord).xyz;\n"
+    "    vec3 normal = fetchNormal(uv);\n"
+    "    float ssao_rate = ssao(uv, pos4, normal);\n"
+    "    vec3 albedo = texture2D(in_Albedo_Img, uv).xyz;\n"
     "    vec3 frag_color = albedo * ssao_rate;\n" // 環境光の計算
 #if 1
          // Enable Direct Lighting
-    "    for (int i = 0; i < " STR(NUM_LIGHT) "; i++) {\n"
-    "        vec3 dist = (in_light_pos[i] - pos4.xyz);\n"
-    "        vec3 dir = normalize(dist);\n"
-    "        float dir_power = min(1.0, max(0.0, dot(dir, normal)));\n" // 角度に対する光の減衰率
-    "        float len_power = 1.0 / pow(max(1.0, length(dist) / in_light_dist[i]),2.0);\n" // 距離に対する光の減衰率(逆2乗)
-    "        frag_color += (albedo*in_light_power[i])*(dir_power*len_power);\n" // 拡散反射のみ計算
+    "#if TILED_LIGHTS\n"
+    // この画素のタイルに影響するライトだけを計算する
+    "    ivec2 tile = (ivec2(uv * in_screen.zw) / " STR(TILE_SIZE) ") * " STR(TILE_SIZE) ";\n"
+    "    int count = int(texelFetch(in_Tile_Lights_Img, tile, 0).x);\n"
+    "    for (int s = 1; s <= count; s++) {\n"
+    "        int i = int(texelFetch(in_Tile_Lights_Img, tile + ivec2(s % " STR(TILE_SIZE) ", s / " STR(TILE_SIZE) "), 0).x);\n"
+    "        frag_color += pointLight(albedo, pos4.xyz, normal,\n"
+    "            texelFetch(in_Light_Img, ivec2(i, 0), 0).xyz,\n"
+    "            texelFetch(in_Light_Img, ivec2(i, 1), 0).xyz,\n"
+    "            texelFetch(in_Light_Img, ivec2(i, 2), 0).xy);\n"
+    "    }\n"
+    "#else\n"
+    "    for (int i = 0; i < NUM_LIGHTS; i++) {\n"
+    "        frag_color += pointLight(albedo, pos4.xyz, normal,\n"
+    "            in_light_pos[i].xyz, in_light_power[i].xyz, in_light_dist[i].xy);\n"
     "    }\n"
+    "#endif\n"
 #endif
     "    gl_FragColor = vec4(frag_color, 1.0);\n"
     "}\n";
 
-static GLuint gPass1Program;
-static GLuint gPass2Program;
+/**
+ * uniforms that are not part of FrameData. their locations are looked up
+ * once in loadShader() and cached in Program::uniforms (-1 if unused).
+ */
+enum UniformId {
+    U_IMG,
+    U_POSITION_IMG,
+    U_NORMAL_IMG,
+    U_ALBEDO_IMG,
+    U_DEPTH_IMG,
+    U_AO_IMG,
+    U_AO_HISTORY_IMG,
+    U_LIGHT_IMG,
+    U_TILE_LIGHTS_IMG,
+    U_TILE_LIGHTS_OUT,
+    U_HIZ_IMG,
+    U_HIZ_LEVEL,
+    U_AO_OUT,
+    U_AO_NOISE_IMG,
+    NUM_UNIFORMS
+};
+
+static const char* UNIFORM_NAMES[NUM_UNIFORMS] = {
+    "in_Img",
+    "in_Position_Img",
+    "in_Normal_Img",
+    "in_Albedo_Img",
+    "in_Depth_Img",
+    "in_Ao_Img",
+    "in_Ao_History_Img",
+    "in_Light_Img",
+    "in_Tile_Lights_Img",
+    "out_Tile_Lights",
+    "in_HiZ_Img",
+    "in_HiZ_Level",
+    "out_Ao",
+    "in_Ao_Noise_Img",
+};
+
+struct Program {
+    GLuint id;
+    GLint uniforms[NUM_UNIFORMS];
+};
+
+/**
+ * pass2 / AO programs of one (sample count, light count, AO backend) set.
+ * variants are compiled once and kept in gShaderVariants, so switching
+ * between them later is only a glUseProgram.
+ */
+struct ShaderVariant {
+    int samples;
+    int lights; // TILED_LIGHTSでは0
+    bool tiled;
+    bool ao_compute; // aoはcompute shader
+    int kernel; // AO_KERNEL_*
+    int noise; // AO_NOISE_*
+    bool hiz;
+    Program pass2;
+    Program ao;
+};
+
+static Program gPass1Program;
+static Program gPass2Program;
+static Program gAoProgram;
+static Program gCullProgram;
+static Program gHiZProgram;
+static ShaderVariant gShaderVariants[MAX_SHADER_VARIANTS];
+static int gNumShaderVariants = 0;
+static GLuint gFrameDataBuffer;
 static GLuint gPositionTexture;
 static GLuint gNormalTexture;
 static GLuint gAlbedoTexture; // "albedo" means texture color
+static GLuint gDepthTexture;
 static GLuint gImg;
 static GLuint gFrameBufferObject;
+static GLuint gAoTexture[2]; // temporal AOでは交互に履歴として使う
+static GLuint gAoFrameBuffer[2];
+static int gAoCurrent = 0; // 最新のAOが入っているgAoTexture
+static GLuint gOutputTexture;
+static GLuint gScaledTexture; // 内部解像度で照らした結果 (--frame-budget, RGBA16F)
+static GLuint gScaledFrameBuffer;
+static GLuint gLightTexture; // タイル分割のライトカリング用のライト情報 (MAX_TILED_LIGHTS x 3)
+static GLuint gTileLightTexture; // タイルごとのライトリスト (R32UI, 画面と同じ大きさ)
+static GLuint gHiZTexture; // 線形深度のmipmap (R32F)
+static GLuint gHiZFrameBuffer;
+static GLuint gAoNoiseTexture; // SSAOのカーネルを回す角度 (AO_NOISE_SIZE x AO_NOISE_SIZE, R32F)
+static int gHiZLevels = 0;
+static GLuint gMeshVao; // 全てのメッシュの頂点とインデックスをまとめたバッファ
+static GLuint gInstanceBuffer;
+static GLuint gIndirectBuffer;
+static GLenum gMeshIndexType; // GL_UNSIGNED_SHORT / GL_UNSIGNED_INT
+static GLuint gMeshIndexSize; // 2 / 4 bytes
+static GLuint gOutputFrameBuffer = 0; // 0: ウィンドウに描画, それ以外: ヘッドレス用のオフスクリーンFBO
+
+static bool gHeadless = false;
+static const char* gMeshPaths[MAX_MESHES]; // なし: 箱
+static int gNumMeshPaths = 0;
+static int gBoxVariants = 1; // 縦横比の違う箱の数 (--meshがない時)
+static const char* gConvertObjPath = NULL;
+static const char* gConvertMeshPath = NULL;
+static int gBenchFrames = 100;
+static const char* gOutputPath = NULL;
+static const char* gRecordPath = NULL; // --record: 毎フレームの画像の書き出し先
+static int gReadbackBuffers = 3; // --readback-buffers, 0: 同期読み出し
+static bool gReadbackSweep = false;
+static const char* gBatchPath = NULL; // --batch: ジョブの一覧
+static int gBatchWorkers = 1;
+static int gBatchWorker = 0; // このプロセスのワーカー番号
+static bool gDoubleBuffer = true; // ウィンドウをダブルバッファにする (--single-buffer: false)
+static int gSwapInterval = 1; // --swap-interval (垂直同期を待つ回数)
+static int gFrameRateCap = 0; // --fps-cap, 0: 制限しない
+static bool gOnDemand = false; // 変化があったフレームだけを描画・表示する
+static int gGBufferLayout = GBUFFER_FULL;
+static int gWidth = DEFAULT_WIDTH; // 出力の解像度 (G-bufferなどの確保する大きさ)
+static int gHeight = DEFAULT_HEIGHT;
+static float gFrameBudget = 0.f; // --frame-budget (ms), 0: 常にgWidth x gHeightで描く
+static float gMinRenderScale = 0.5f; // --min-scale
+static float gRenderScale = 1.f; // gWidth x gHeightに対する内部解像度の割合
+static int gRenderWidth = DEFAULT_WIDTH; // pass1 / Hi-Z / AOを描く範囲 (左下から)
+static int gRenderHeight = DEFAULT_HEIGHT;
+static const char* gResolutionLogPath = NULL;
+static int gNumSamples = NUM_SAMPLE_POINTS;
+static int gNumLights = DEFAULT_LIGHTS;
+static bool gTiledLights = false;
+static bool gHiZ = false;
+static float gAoRadius = 1.f; // SSAOのカーネルの拡大率
+static bool gLightSweep = false;
+static float gCamPos[3] = {CAM_POSX, CAM_POSY, CAM_POSZ};
+static int gAoScale = 1; // 1: pass2の中でSSAO, 2/4: 1/2, 1/4解像度の別パスでSSAO
+static bool gAoTemporal = false;
+static bool gAoCompute = false; // AOパスをcompute shaderで計算する
+static bool gAoSweep = false;
+static int gAoFrame = 0; // temporal AOのカーネルを選ぶHaltonの添字
+static int gAoKernel = AO_KERNEL_FIXED;
+static int gAoNoise = AO_NOISE_NONE;
+static float gAoKernelRotation = 0.f; // 生成したカーネル全体を回す角度 (--ao-tier-sweepの基準画像)
+static bool gAoTierSweep = false;
+static bool gHiZCheck = false;
+static bool gIncremental = false; // 変化した範囲だけを描き直す (ウィンドウでは常に有効)
+static bool gGBufferValid = false; // false: 次のフレームでG-buffer全体を描き直す
+static bool gLightingValid = false; // false: 次のフレームで画面全体を照らし直す
+// 描き直したした範囲の統計 (timerReset()で消す)
+static int gPass1Frames = 0;
+static int gPass2Frames = 0;
+static double gPass1Coverage = 0; // 画面に対する割合の和
+static double gPass2Coverage = 0;
+static int gAoHistoryFrames = 0; // 履歴に積もっているフレーム数
+static float gPrevView[16];
 
-struct Lights {
-    float pos[3*NUM_LIGHT];
-    float power[3*NUM_LIGHT];
-    float dist[NUM_LIGHT];
-};
-
-static Lights gLights;
-
-static void multiplyMatrix(float* out, const float* src1, const float* src2);
-static void getPerspectiveMatrix(float* proj, float aspect,
-        int fovy, float near, float far);
-static void getModelviewMatrix(float* modelview, float* normalview,
-        float ex, float ey, float ez,
-        float ax, float ay, float az,
-        float ux, float uy, float uz);
+/**
+ * whether SSAO is rendered in its own pass (low resolution, temporal or compute)
+ */
+static bool useAoPass() {
+    return gAoScale > 1 || gAoTemporal || gAoCompute;
+}
 
+/**
+ * border around a compute SSAO tile that covers the widest kernel offset
+ * (3 pixels before --ao-radius)
+ */
+static int aoApron() {
+    return (int)roundf(3.f * gAoRadius);
+}
 
-void drawBox(float width, float height, float depth) {
-    const float box_vertexes[] = {
-        // front plane
-         width/2.f, height/2.f, depth/2.f,
-        -width/2.f, height/2.f, depth/2.f,
-         width/2.f,-height/2.f, depth/2.f,
-        -width/2.f,-height/2.f, depth/2.f,
+static char gShaderDefines[256]; // 全てのシェーダに共通のdefine
+static const char* gShaderCacheDir = DEFAULT_SHADER_CACHE_DIR; // NULL: プログラムバイナリのキャッシュなし
+static int gShaderCacheHits = 0;
+static int gShaderCacheMisses = 0;
 
-        // back plane
-        -width/2.f, height/2.f,-depth/2.f,
-         width/2.f, height/2.f,-depth/2.f,
-        -width/2.f,-height/2.f,-depth/2.f,
-         width/2.f,-height/2.f,-depth/2.f,
+// 品質の段階ごとのSSAOのサンプル数 (ウィンドウでは1~4キーで切り替え)
+static constexpr int QUALITY_TIER_SAMPLES[] = {4, 8, 16, 32};
+#define NUM_QUALITY_TIERS 4
 
-        // left plane
-        -width/2.f, height/2.f, depth/2.f,
-        -width/2.f, height/2.f,-depth/2.f,
-        -width/2.f,-height/2.f, depth/2.f,
-        -width/2.f,-height/2.f,-depth/2.f,
+static const char* AO_KERNEL_NAMES[] = {"fixed", "stratified", "poisson"};
+static const char* AO_NOISE_NAMES[] = {"none", "tiled", "ign"};
 
-        // right plane
-         width/2.f, height/2.f,-depth/2.f,
-         width/2.f, height/2.f, depth/2.f,
-         width/2.f,-height/2.f,-depth/2.f,
-         width/2.f,-height/2.f, depth/2.f,
+static const char* GBUFFER_LAYOUT_NAMES[] = {"full", "half", "compact"};
 
-        // top plane
-         width/2.f, height/2.f,-depth/2.f,
-        -width/2.f, height/2.f,-depth/2.f,
-         width/2.f, height/2.f, depth/2.f,
-        -width/2.f, height/2.f, depth/2.f,
+#define BASE_INSTANCES 32
+#define MAX_INSTANCES 1000000
+static int gNumInstances = BASE_INSTANCES;
+static float* gInstanceMatrices; // インスタンスごとのモデル行列 (16*gNumInstances, 視錐台カリングなし)
 
-        // bottom plane
-        -width/2.f,-height/2.f,-depth/2.f,
-         width/2.f,-height/2.f,-depth/2.f,
-        -width/2.f,-height/2.f, depth/2.f,
-         width/2.f,-height/2.f, depth/2.f,
-    };
+/**
+ * how draw_pass1() submits the instances (--draw-mode)
+ *  LOOP     : one glDrawElementsInstancedBaseVertexBaseInstance per instance
+ *  INSTANCED: one instanced draw per mesh
+ *  INDIRECT : one glMultiDrawElementsIndirect, one command per mesh
+ */
+enum DrawMode {
+    DRAW_LOOP,
+    DRAW_INSTANCED,
+    DRAW_INDIRECT,
+    NUM_DRAW_MODES
+};
 
-    const float box_normals[] = {
-        // front plane
-         0, 0, 1,
-         0, 0, 1,
-         0, 0, 1,
-         0, 0, 1,
+static const char* DRAW_MODE_NAMES[] = {"loop", "instanced", "indirect"};
+static int gDrawMode = DRAW_INSTANCED;
+static int gDrawCalls = 0; // 最後のpass1で発行した描画コマンドの数
+static bool gDrawSweep = false;
+static bool gTransformBench = false;
+
+// glMultiDrawElementsIndirectのコマンド (GL 4.3で決まっている並び)
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+};
 
-        // back plane
-         0, 0,-1,
-         0, 0,-1,
-         0, 0,-1,
-         0, 0,-1,
+static DrawElementsIndirectCommand gDrawCommands[MAX_MESHES]; // メッシュごと
 
-        // left plane
-        -1, 0, 0,
-        -1, 0, 0,
-        -1, 0, 0,
-        -1, 0, 0,
+struct Lights {
+    float pos[3*MAX_TILED_LIGHTS];
+    float power[3*MAX_TILED_LIGHTS];
+    float dist[MAX_TILED_LIGHTS];
+    float radius[MAX_TILED_LIGHTS]; // 光がLIGHT_CUTOFFまで弱まる距離
+};
 
-        // right plane
-         1, 0, 0,
-         1, 0, 0,
-         1, 0, 0,
-         1, 0, 0,
+static Lights gLights;
 
-        // top plane
-         0, 1, 0,
-         0, 1, 0,
-         0, 1, 0,
-         0, 1, 0,
+// FrameDataブロックとstd140で同じ並び
+struct FrameData {
+    float proj[16];
+    float view[16];
+    float normal_view[16];
+    float light_pos[4*MAX_LIGHTS];
+    float light_power[4*MAX_LIGHTS];
+    float light_dist[4*MAX_LIGHTS];
+    float sample_points[4*MAX_SAMPLE_POINTS];
+    float reproject[16];
+    float ao_temporal[4];
+    float screen[4];
+    float cam_pos[4];
+    int light_count[4];
+    float viewport[4];
+};
 
-        // bottom plane
-         0,-1, 0,
-         0,-1, 0,
-         0,-1, 0,
-         0,-1, 0,
-    };
+static FrameData gFrameData;
+static float gLightTexels[4*3*MAX_TILED_LIGHTS]; // gLightTextureに送る内容
 
-    const float box_texcoords[] = {
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0,
+static double nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0,
+/**
+ * event tracing (--trace FILE): CPU spans, GL passes and per-frame GL
+ * counters written as Chrome trace_event JSON (chrome://tracing, Perfetto).
+ * every thread appends to its own ring of TRACE_RING_EVENTS events without
+ * locks and only the newest events are kept. the file is written at exit, on
+ * SIGUSR1 (and the program goes on) or on SIGINT / SIGTERM, which still end
+ * the process by the signal. inside a frame loop both wait for the end of
+ * the current frame. without --trace every hook is a branch on
+ * gTraceEnabled.
+ */
+#define TRACE_RING_EVENTS (1 << 16)
+#define MAX_TRACE_THREADS 128
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+enum TraceCounter {
+    TRACE_DRAW_CALLS, // glDispatchComputeを含む
+    TRACE_UNIFORM_UPLOADS, // glUniform*とFrameDataブロックの更新
+    TRACE_TEXTURE_BINDS, // glBindTextureとglBindImageTexture
+    TRACE_UPLOAD_BYTES,
+    TRACE_TRIANGLES,
+    TRACE_STATE_ELIDED, // 状態のキャッシュが省いた呼び出し
+    NUM_TRACE_COUNTERS
+};
 
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0,
+static const char* const TRACE_COUNTER_NAMES[NUM_TRACE_COUNTERS] = {
+    "draw calls", "uniform uploads", "texture binds", "bytes uploaded", "triangles", "state calls elided",
+};
 
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0,
+struct TraceEvent {
+    const char* name; // 文字列リテラルのみ (書き出すまで残る)
+    double ts_ms;
+    double value; // X: 長さ(ms), C: カウンタの値, G: GPU時間(ms)
+    char phase; // X: span, C: counter, G: GPUタイマーの結果
+};
 
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0,
+struct TraceRing {
+    int tid;
+    const char* thread_name;
+    uint64_t head; // 書いたイベントの数. 書くのは持ち主のスレッドだけ (__atomicで公開する)
+    TraceEvent events[TRACE_RING_EVENTS];
+};
 
-             0,  1,
-             1,  1,
-             0,  0,
-             1,  0
-        };
+static bool gTraceEnabled = false;
+static const char* gTracePath = NULL;
+static double gTraceStart = 0;
+static pid_t gTracePid = 0; // --batch-workersの子は別のファイルに書く
+static TraceRing* gTraceRings[MAX_TRACE_THREADS];
+static int gTraceThreads = 0; // __atomicで増やす
+static __thread TraceRing* tTraceRing = NULL;
+static __thread bool tTraceDropped = false; // リングを持てなかったスレッド
+static __thread const char* tTraceThreadName = "thread";
+static double gTraceCounters[NUM_TRACE_COUNTERS]; // GLのスレッドだけが数える
+static volatile sig_atomic_t gTraceSignal = 0;
+static volatile sig_atomic_t gTraceInFrameLoop = 0; // シグナルをフレームの終わりまで待たせる
 
-    const uint16_t box_indexes[] = {
-             0, 1, 2,
-             2, 1, 3,
+/**
+ * the ring of the calling thread, allocated by its first event. NULL once
+ * MAX_TRACE_THREADS threads have traced.
+ */
+static TraceRing* traceRing() {
+    if (tTraceRing != NULL || tTraceDropped) return tTraceRing;
+    tTraceDropped = true;
+    const int index = __atomic_fetch_add(&gTraceThreads, 1, __ATOMIC_ACQ_REL);
+    if (index >= MAX_TRACE_THREADS) return NULL;
+    TraceRing* ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+    if (ring == NULL) return NULL;
+    tTraceDropped = false;
+    ring->tid = index + 1;
+    ring->thread_name = tTraceThreadName;
+    __atomic_store_n(&gTraceRings[index], ring, __ATOMIC_RELEASE);
+    tTraceRing = ring;
+    return ring;
+}
 
-             4, 5, 6,
-             6, 5, 7,
+static void traceEmit(char phase, const char* name, double ts_ms, double value) {
+    TraceRing* ring = traceRing();
+    if (ring == NULL) return;
+    const uint64_t head = ring->head;
+    TraceEvent& event = ring->events[head % TRACE_RING_EVENTS];
+    event.name = name;
+    event.ts_ms = ts_ms;
+    event.value = value;
+    event.phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-             8, 9,10,
-            10, 9,11,
+/**
+ * name of the calling thread in the trace. call it before its first event.
+ */
+static void traceThreadName(const char* name) {
+    tTraceThreadName = name;
+}
 
-            12,13,14,
-            14,13,15,
+static inline void traceCount(TraceCounter counter, double amount) {
+    if (gTraceEnabled) gTraceCounters[counter] += amount;
+}
 
-            16,17,18,
-            18,17,19,
+/**
+ * the scope from construction to destruction as one span of the thread
+ */
+struct TraceSpan {
+    const char* name;
+    double start;
 
-            20,21,22,
-            22,21,23
-        };
+    explicit TraceSpan(const char* name) : name(name), start(gTraceEnabled ? nowMs() : 0) {}
+    ~TraceSpan() {
+        if (gTraceEnabled) traceEmit('X', name, start, nowMs() - start);
+    }
+};
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, 0, sizeof (GLfloat) * 3, box_vertexes);
-    glVertexAttribPointer(1, 3, GL_FLOAT, 0, sizeof (GLfloat) * 3, box_normals);
-    glVertexAttribPointer(2, 2, GL_FLOAT, 0, sizeof (GLfloat) * 2, box_texcoords);
+/**
+ * write every event still in the rings to gTracePath. events that a thread
+ * overwrites while they are copied are dropped.
+ */
+static void traceWrite() {
+    if (!gTraceEnabled) return;
+    char path[1024];
+    if (getpid() == gTracePid) {
+        snprintf(path, sizeof(path), "%s", gTracePath);
+    } else {
+        snprintf(path, sizeof(path), "%s.%d", gTracePath, (int)getpid());
+    }
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return;
+    }
 
-    glDrawElements(GL_TRIANGLES, sizeof(box_indexes)/sizeof(uint16_t),
-            GL_UNSIGNED_SHORT, box_indexes);
+    TraceEvent* events = (TraceEvent*)malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+    const int pid = (int)getpid();
+    const int threads = __atomic_load_n(&gTraceThreads, __ATOMIC_ACQUIRE);
+    long written = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < threads && i < MAX_TRACE_THREADS && events; i++) {
+        const TraceRing* ring = __atomic_load_n(&gTraceRings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL) continue;
+        const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+        for (uint64_t k = first; k < head; k++) {
+            events[k - first] = ring->events[k % TRACE_RING_EVENTS];
+        }
+        // コピーの間に上書きされたかもしれない古いイベントを捨てる
+        const uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const uint64_t valid = (after >= TRACE_RING_EVENTS) ? after - TRACE_RING_EVENTS + 1 : 0;
+        const uint64_t skip = (valid > first) ? valid - first : 0;
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            written++ ? ",\n" : "", pid, ring->tid, ring->thread_name);
+        for (uint64_t k = first + skip; k < head; k++) {
+            const TraceEvent& e = events[k - first];
+            const double ts = (e.ts_ms - gTraceStart) * 1000.0;
+            if (e.phase == 'X') {
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e.name, pid, ring->tid, ts, e.value * 1000.0);
+            } else {
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"%s\":%.6g}}",
+                    e.name, pid, ring->tid, ts, e.phase == 'G' ? "gpu ms" : "value", e.value);
+            }
+            written++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    free(events);
+    if (fclose(fp) == 0) {
+        printf("trace: %ld events to %s\n", written, path);
+    } else {
+        fprintf(stderr, "Could not write %s\n", path);
+    }
 }
 
-const int PRIMES[] = {
-    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43,
-    47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103,
-    107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163,
-    167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227,
-    229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281,
-    283, 293, 307, 311, 313, 317, 331, 337, 347, 349, 353,
-    359, 367, 373, 379, 383, 389, 397, 401, 409, 419, 421,
-    431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487,
-    491, 499, 503, 509, 521, 523, 541, 547, 557, 563, 569,
-    571, 577, 587, 593, 599, 601, 607, 613, 617, 619, 631,
-    641, 643, 647, 653, 659, 661, 673, 677, 683, 691, 701,
-    709, 719, 727, 733, 739, 743, 751, 757, 761, 769, 773,
-    787, 797, 809, 811, 821, 823, 827, 829, 839, 853, 857,
-    859, 863, 877, 881, 883, 887, 907, 911, 919, 929, 937,
-    941, 947, 953, 967, 971, 977, 983, 991, 997
-};
-
-const int SIZE_OF_PRIMES = sizeof(PRIMES) / sizeof(int);
+/**
+ * write the trace and end the process by "sig" as if it was not caught
+ */
+static void traceDie(int sig) {
+    traceWrite();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-float halton(int base, int index) {
-    const int p = PRIMES[base % SIZE_OF_PRIMES];
-    const float half = 1.f / (float)p;
-    float sum = 0;
-    float k = half;
-    while (index > 0) {
-        int val = (index % p);
-        sum += val * k;
-        index = (index - val) / p;
-        k *= half;
+static void traceSignal(int sig) {
+    if (gTraceInFrameLoop || sig == SIGUSR1) {
+        gTraceSignal = sig;
+    } else {
+        traceDie(sig); // フレームのループの外では終わりを待てない
     }
-    return sum;
 }
 
-static int gRandIndex = 0;
-static void getRandamRoteMat(float* mat) {
-    float theta= M_PI * halton(0, gRandIndex);
-    float phy  = 2.f * M_PI*halton(1, gRandIndex++);
-    float sPhy = sin(theta);
-    float at_vec[] = {sPhy*cos(phy), cos(theta), sPhy*sin(phy)};
-    float n = sqrt(at_vec[0]*at_vec[0] + at_vec[1]*at_vec[1] + at_vec[2]*at_vec[2]);
-    at_vec[0] /= n;
-    at_vec[1] /= n;
-    at_vec[2] /= n;
+static void traceInit() {
+    gTraceEnabled = true;
+    gTraceStart = nowMs();
+    gTracePid = getpid();
+    traceThreadName("main");
+    atexit(traceWrite);
+    signal(SIGUSR1, traceSignal);
+    signal(SIGINT, traceSignal);
+    signal(SIGTERM, traceSignal);
+}
 
-    float up[] = {0, 1, 0};
-    if ((at_vec[0]*up[0]+at_vec[1]*up[1]+at_vec[2]*up[2]) >= 0.98) {
-        up[0] = 0;
-        up[1] = 0;
-        up[2] = 1;
+/**
+ * defer SIGINT / SIGTERM to the end of the frame while a frame loop runs.
+ * a signal still pending when the loop ends is handled at once.
+ */
+static void traceFrameLoop(bool running) {
+    if (!gTraceEnabled) return;
+    gTraceInFrameLoop = running;
+    const int sig = gTraceSignal;
+    if (!running && sig != 0 && sig != SIGUSR1) {
+        traceDie(sig);
     }
+}
 
-    float vec_x[] = {
-            at_vec[1] * up[2] - up[1] * at_vec[2],
-            at_vec[2] * up[0] - up[2] * at_vec[0],
-            at_vec[0] * up[1] - up[0] * at_vec[1],
-        };
-
-    n = sqrt(vec_x[0]*vec_x[0] + vec_x[1]*vec_x[1] + vec_x[2]*vec_x[2]);
-    vec_x[0] /= n;
-    vec_x[1] /= n;
-    vec_x[2] /= n;
+/**
+ * per-frame counters of the GL thread, and the signals received during the
+ * frame
+ */
+static void traceFrameEnd() {
+    if (!gTraceEnabled) return;
+    const double now = nowMs();
+    for (int i = 0; i < NUM_TRACE_COUNTERS; i++) {
+        traceEmit('C', TRACE_COUNTER_NAMES[i], now, gTraceCounters[i]);
+        gTraceCounters[i] = 0;
+    }
+    if (gTraceSignal != 0) {
+        const int sig = gTraceSignal;
+        gTraceSignal = 0;
+        if (sig == SIGUSR1) {
+            traceWrite();
+        } else {
+            traceDie(sig);
+        }
+    }
+}
 
-    float vec_y[] = {
-            vec_x[1] * at_vec[2] - at_vec[1] * vec_x[2],
-            vec_x[2] * at_vec[0] - at_vec[2] * vec_x[0],
-            vec_x[0] * at_vec[1] - at_vec[0] * vec_x[1],
-        };
-    n = sqrt(vec_y[0]*vec_y[0] + vec_y[1]*vec_y[1] + vec_y[2]*vec_y[2]);
-    vec_y[0] /= n;
-    vec_y[1] /= n;
-    vec_y[2] /= n;
+/**
+ * GL state cache. every program, texture, vertex array, framebuffer, draw
+ * buffer, capability and clear color change goes through the state*()
+ * functions below, which shadow the current state and drop the calls that
+ * would not change it. a shadowed value of GL_STATE_UNKNOWN is always
+ * issued. textures for glTex* calls are bound on their own unit
+ * (stateEditTexture()) so that uploads never disturb the sampler bindings.
+ */
+#define GL_STATE_UNKNOWN 0xffffffffu
+#define GL_STATE_TEXTURE_UNITS 16
+#define GL_STATE_EDIT_UNIT (GL_TEXTURE0 + GL_STATE_TEXTURE_UNITS - 1)
+#define GL_STATE_ATTRIBS 8
+#define GL_STATE_FRAMEBUFFERS 16
+#define GL_STATE_CAPS 4
+
+enum StateCall {
+    STATE_PROGRAM,
+    STATE_ACTIVE_TEXTURE,
+    STATE_TEXTURE,
+    STATE_VERTEX_ARRAY,
+    STATE_ATTRIB_ARRAY,
+    STATE_FRAMEBUFFER,
+    STATE_DRAW_BUFFERS,
+    STATE_CAPABILITY,
+    STATE_CLEAR_COLOR,
+    NUM_STATE_CALLS
+};
 
-    mat[0] = vec_x[0];
-    mat[1] = vec_y[0];
-    mat[2] = at_vec[0];
-    mat[3] = 0;
+static const char* const STATE_CALL_NAMES[NUM_STATE_CALLS] = {
+    "program", "active texture", "texture", "vertex array", "attrib array", "framebuffer", "draw buffers",
+    "capability", "clear color",
+};
 
-    mat[4] = vec_x[1];
-    mat[5] = vec_y[1];
-    mat[6] = at_vec[1];
-    mat[7] = 0;
+struct GLState {
+    GLuint program;
+    GLuint active_texture; // GL_TEXTURE0 + unit
+    GLuint textures[GL_STATE_TEXTURE_UNITS]; // GL_TEXTURE_2D
+    GLuint vertex_array;
+    GLuint attrib_arrays[GL_STATE_ATTRIBS]; // vertex array 0のもの (他のVAOは作る時に設定するだけ)
+    GLuint draw_framebuffer;
+    GLuint read_framebuffer;
+    // 描画先のバッファはFBOごとの状態
+    int framebuffer_count;
+    GLuint framebuffers[GL_STATE_FRAMEBUFFERS];
+    int draw_buffer_counts[GL_STATE_FRAMEBUFFERS];
+    GLenum draw_buffers[GL_STATE_FRAMEBUFFERS][4];
+    GLenum caps[GL_STATE_CAPS];
+    GLuint cap_values[GL_STATE_CAPS];
+    bool clear_color_known;
+    GLfloat clear_color[4];
+    long issued[NUM_STATE_CALLS];
+    long elided[NUM_STATE_CALLS];
+    long report_issued; // 前回の報告までの合計
+    long report_elided;
+    int report_frame;
+};
 
-    mat[8] = vec_x[2];
-    mat[9] = vec_y[2];
-    mat[10] = at_vec[2];
-    mat[11] = 0;
+static GLState gGlState;
 
-    mat[12] = 0;
-    mat[13] = 0;
-    mat[14] = 0;
-    mat[15] = 1;
+/**
+ * forget the shadowed state (a new context, or state changed behind the
+ * cache)
+ */
+static void stateReset() {
+    gGlState.program = GL_STATE_UNKNOWN;
+    gGlState.active_texture = GL_STATE_UNKNOWN;
+    for (int i = 0; i < GL_STATE_TEXTURE_UNITS; i++) {
+        gGlState.textures[i] = GL_STATE_UNKNOWN;
+    }
+    gGlState.vertex_array = GL_STATE_UNKNOWN;
+    for (int i = 0; i < GL_STATE_ATTRIBS; i++) {
+        gGlState.attrib_arrays[i] = GL_STATE_UNKNOWN;
+    }
+    gGlState.draw_framebuffer = GL_STATE_UNKNOWN;
+    gGlState.read_framebuffer = GL_STATE_UNKNOWN;
+    gGlState.framebuffer_count = 0;
+    for (int i = 0; i < GL_STATE_CAPS; i++) {
+        gGlState.caps[i] = 0;
+    }
+    gGlState.clear_color_known = false;
 }
 
 /**
- * geometory to texture
+ * count a state call, and return true if it has to be issued
  */
-static void draw_pass1() {
-    glUseProgram(gPass1Program);
-
-    glViewport(0,0,FBO_WIDTH,FBO_HEIGHT);
-    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, gFrameBufferObject);
-
-    float mvp[16];
-    float proj[16];
-
-    float camera_world[16];
-    float camera_world_nr[16];
-    
-    float obj_rote[16];
-    
-    float modelview[16];
-    float modelview_nr[16];
+static bool stateChange(StateCall call, GLuint* shadow, GLuint value) {
+    if (*shadow == value) {
+        gGlState.elided[call]++;
+        traceCount(TRACE_STATE_ELIDED, 1);
+        return false;
+    }
+    *shadow = value;
+    gGlState.issued[call]++;
+    if (call == STATE_TEXTURE) traceCount(TRACE_TEXTURE_BINDS, 1);
+    return true;
+}
 
-    getPerspectiveMatrix(proj, 1.f, 60, SCREEN_NEAR, SCREEN_FAR);
-    getModelviewMatrix(camera_world, camera_world_nr, CAM_POSX, CAM_POSY, CAM_POSZ, 0,0,0, 0,1,0);
+static void stateUseProgram(GLuint program) {
+    if (stateChange(STATE_PROGRAM, &gGlState.program, program)) glUseProgram(program);
+}
 
-    static const GLenum bufs[] = {
-      GL_COLOR_ATTACHMENT0_EXT,
-      GL_COLOR_ATTACHMENT1_EXT,
-      GL_COLOR_ATTACHMENT2_EXT,
-    };
-    glDrawBuffers(3, bufs);
+static void stateActiveTexture(GLenum unit) {
+    if (stateChange(STATE_ACTIVE_TEXTURE, &gGlState.active_texture, unit)) glActiveTexture(unit);
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glClearColor(0,0,0,0); // シェーダで背景画像とポリゴンを識別するため、意図的にalpha値を0にしておく
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+/**
+ * bind "texture" to the texture unit "unit" (GL_TEXTUREi) for sampling. the
+ * active unit is only switched if the binding changes.
+ */
+static void stateBindTexture(GLenum unit, GLuint texture) {
+    const int index = unit - GL_TEXTURE0;
+    if (index >= GL_STATE_TEXTURE_UNITS - 1) {
+        stateActiveTexture(unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        gGlState.issued[STATE_TEXTURE]++;
+        traceCount(TRACE_TEXTURE_BINDS, 1);
+        return;
+    }
+    if (gGlState.textures[index] == texture) {
+        stateChange(STATE_TEXTURE, &gGlState.textures[index], texture);
+        return;
+    }
+    stateActiveTexture(unit);
+    stateChange(STATE_TEXTURE, &gGlState.textures[index], texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glUniform1i(glGetUniformLocation(gPass1Program, "in_Img"), 0);
-    glBindTexture(GL_TEXTURE_2D, gImg);
+/**
+ * bind "texture" for the following glTex* / glGetTexImage calls
+ */
+static void stateEditTexture(GLuint texture) {
+    stateActiveTexture(GL_STATE_EDIT_UNIT);
+    if (stateChange(STATE_TEXTURE, &gGlState.textures[GL_STATE_TEXTURE_UNITS - 1], texture)) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+    }
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
+static void stateBindVertexArray(GLuint vertex_array) {
+    if (stateChange(STATE_VERTEX_ARRAY, &gGlState.vertex_array, vertex_array)) glBindVertexArray(vertex_array);
+}
 
-    for (int i=0; i < 32; i++) {
-        getRandamRoteMat(obj_rote);
-        multiplyMatrix(modelview, obj_rote, camera_world);
-        multiplyMatrix(modelview_nr, obj_rote, camera_world_nr);
-        multiplyMatrix(mvp, modelview, proj);
-        glUniformMatrix4fv(glGetUniformLocation(gPass1Program, "in_MVP"), 1, GL_FALSE, mvp);
-        glUniformMatrix4fv(glGetUniformLocation(gPass1Program, "in_MV"), 1, GL_FALSE, modelview);
-        glUniformMatrix4fv(glGetUniformLocation(gPass1Program, "in_Normal_MV"), 1, GL_FALSE, modelview_nr);
+static void stateVertexAttribArray(GLuint index, bool enabled) {
+    if (gGlState.vertex_array == 0 && index < GL_STATE_ATTRIBS) {
+        if (!stateChange(STATE_ATTRIB_ARRAY, &gGlState.attrib_arrays[index], enabled)) return;
+    } else {
+        gGlState.issued[STATE_ATTRIB_ARRAY]++;
+    }
+    if (enabled) {
+        glEnableVertexAttribArray(index);
+    } else {
+        glDisableVertexAttribArray(index);
+    }
+}
 
-        drawBox(2.5,2.5,2.5);
+/**
+ * GL_FRAMEBUFFER_EXT binds both the draw and the read framebuffer
+ */
+static void stateBindFramebuffer(GLenum target, GLuint framebuffer) {
+    const bool draw = target != GL_READ_FRAMEBUFFER_EXT;
+    const bool read = target != GL_DRAW_FRAMEBUFFER_EXT;
+    if ((!draw || gGlState.draw_framebuffer == framebuffer) && (!read || gGlState.read_framebuffer == framebuffer)) {
+        gGlState.elided[STATE_FRAMEBUFFER]++;
+        traceCount(TRACE_STATE_ELIDED, 1);
+        return;
     }
+    if (draw) gGlState.draw_framebuffer = framebuffer;
+    if (read) gGlState.read_framebuffer = framebuffer;
+    gGlState.issued[STATE_FRAMEBUFFER]++;
+    glBindFramebufferEXT(target, framebuffer);
+}
 
-    glFlush();
+/**
+ * draw buffers of the bound draw framebuffer
+ */
+static void stateDrawBuffers(int count, const GLenum* buffers) {
+    const GLuint fbo = gGlState.draw_framebuffer;
+    int slot = -1;
+    for (int i = 0; i < gGlState.framebuffer_count && fbo != GL_STATE_UNKNOWN; i++) {
+        if (gGlState.framebuffers[i] == fbo) slot = i;
+    }
+    if (slot >= 0 && gGlState.draw_buffer_counts[slot] == count
+            && memcmp(gGlState.draw_buffers[slot], buffers, sizeof(GLenum) * count) == 0) {
+        gGlState.elided[STATE_DRAW_BUFFERS]++;
+        traceCount(TRACE_STATE_ELIDED, 1);
+        return;
+    }
+    if (slot < 0 && fbo != GL_STATE_UNKNOWN && gGlState.framebuffer_count < GL_STATE_FRAMEBUFFERS) {
+        slot = gGlState.framebuffer_count++;
+        gGlState.framebuffers[slot] = fbo;
+    }
+    if (slot >= 0 && count <= 4) {
+        gGlState.draw_buffer_counts[slot] = count;
+        memcpy(gGlState.draw_buffers[slot], buffers, sizeof(GLenum) * count);
+    }
+    gGlState.issued[STATE_DRAW_BUFFERS]++;
+    if (count == 1) {
+        glDrawBuffer(buffers[0]); // ウィンドウのGL_BACK / GL_FRONTはglDrawBuffersでは指定できない
+    } else {
+        glDrawBuffers(count, buffers);
+    }
+}
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(2);
+static void stateDrawBuffer(GLenum buffer) {
+    stateDrawBuffers(1, &buffer);
+}
 
-    glUseProgram(0);
-    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
-    glDrawBuffer(GL_FRONT);
+static void stateEnable(GLenum cap, bool enabled) {
+    int slot = 0;
+    while (slot < GL_STATE_CAPS - 1 && gGlState.caps[slot] != cap && gGlState.caps[slot] != 0) slot++;
+    if (gGlState.caps[slot] != cap) {
+        gGlState.caps[slot] = cap;
+        gGlState.cap_values[slot] = GL_STATE_UNKNOWN;
+    }
+    if (!stateChange(STATE_CAPABILITY, &gGlState.cap_values[slot], enabled)) return;
+    if (enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+}
 
-    int err = glGetError();
-    if (GL_NO_ERROR != err) {
-        printf("Check GL Error in pass1: %d\n", err);
+static void stateClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+    const GLfloat color[4] = {r, g, b, a};
+    if (gGlState.clear_color_known && memcmp(gGlState.clear_color, color, sizeof(color)) == 0) {
+        gGlState.elided[STATE_CLEAR_COLOR]++;
+        traceCount(TRACE_STATE_ELIDED, 1);
+        return;
     }
+    memcpy(gGlState.clear_color, color, sizeof(color));
+    gGlState.clear_color_known = true;
+    gGlState.issued[STATE_CLEAR_COLOR]++;
+    glClearColor(r, g, b, a);
 }
 
 /**
- * extract geometory from texture. and render using it.
+ * per-pass timing. GPU time is measured with GL_TIME_ELAPSED queries that are
+ * double-buffered, so the result of frame N is read while frame N+2 is recorded
+ * and never stalls the pipeline. CPU time is the wall time between begin/end.
  */
-static void draw_pass2() {
-    glUseProgram(gPass2Program);
-    glViewport(0,0,WINDOW_WIDTH,WINDOW_HEIGHT);
-
-    glDisable(GL_DEPTH_TEST);
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    glUniform1i(glGetUniformLocation(gPass2Program, "in_Position_Img"), 0);
-    glUniform1i(glGetUniformLocation(gPass2Program, "in_Normal_Img"), 1);
-    glUniform1i(glGetUniformLocation(gPass2Program, "in_Albedo_Img"), 2);
+#define TIMER_LATENCY 2
+#define TIMER_HISTORY 256
+
+enum TimerId {
+    TIMER_PASS1,
+    TIMER_PASS2,
+    TIMER_AO,
+    TIMER_CULL,
+    TIMER_HIZ,
+    TIMER_MATRIX, // CPU only: 行列計算の合計時間
+    TIMER_FRUSTUM, // CPU only: 視錐台カリング (BVHの更新を含む, --jobsではシーンのスレッドの時間)
+    TIMER_SUBMIT, // CPU only: pass1のインスタンスの転送と描画コマンドの発行
+    TIMER_WAIT, // CPU only: シーンのスレッド (--jobs) を待った時間
+    TIMER_READBACK, // CPU only: --recordの読み出しでGLのスレッドが使った時間
+    NUM_TIMERS
+};
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gPositionTexture);
+static const char* const TIMER_NAMES[NUM_TIMERS] = {
+    "pass1", "pass2", "ao", "cull", "hiz", "matrix", "frustum", "submit", "wait", "readback",
+};
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gNormalTexture);
+struct PassTimer {
+    GLuint queries[TIMER_LATENCY];
+    bool pending[TIMER_LATENCY];
+    int pending_frame[TIMER_LATENCY];
+    double pending_cpu_ms[TIMER_LATENCY];
+    double cpu_start;
+    double cpu_ms[TIMER_HISTORY];
+    double gpu_ms[TIMER_HISTORY]; // 負値はGPU時間なし
+    int count;
+};
 
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, gAlbedoTexture);
+static PassTimer gTimers[NUM_TIMERS];
+static bool gTimerQueries = false;
+static int gTimerFrame = 0;
+static FILE* gTimingCsv = NULL;
+static const char* gTimingCsvPath = NULL;
 
-    glUniform3fv(glGetUniformLocation(gPass2Program, "in_light_pos"),
-        NUM_LIGHT, gLights.pos);
-    glUniform3fv(glGetUniformLocation(gPass2Program, "in_light_power"),
-        NUM_LIGHT, gLights.power);
-    glUniform1fv(glGetUniformLocation(gPass2Program, "in_light_dist"),
-        NUM_LIGHT, gLights.dist);
-    glUniform2fv(glGetUniformLocation(gPass2Program, "in_sample_points"),
-        NUM_SAMPLE_POINTS, SAMPLE_POINTS);
+/**
+ * forget the recorded samples (e.g. between the runs of a sweep)
+ */
+static void timerReset() {
+    gTimerFrame = 0;
+    gPass1Frames = gPass2Frames = 0;
+    gPass1Coverage = gPass2Coverage = 0;
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        gTimers[i].count = 0;
+    }
+    memset(gGlState.issued, 0, sizeof(gGlState.issued));
+    memset(gGlState.elided, 0, sizeof(gGlState.elided));
+    gGlState.report_issued = gGlState.report_elided = 0;
+    gGlState.report_frame = 0;
+}
 
-    const float vertexPointer[] = {
-            -1.0,  1.0,
-             1.0,  1.0,
-            -1.0, -1.0,
-             1.0, -1.0
-        };
+static void timerInit() {
+    gTimerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    timerReset();
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        if (gTimerQueries && i != TIMER_MATRIX && i != TIMER_FRUSTUM && i != TIMER_SUBMIT
+                && i != TIMER_WAIT && i != TIMER_READBACK) {
+            glGenQueries(TIMER_LATENCY, gTimers[i].queries);
+        }
+    }
+    if (gTimingCsvPath) {
+        gTimingCsv = fopen(gTimingCsvPath, "w");
+        if (gTimingCsv == NULL) {
+            fprintf(stderr, "Could not open %s\n", gTimingCsvPath);
+        } else {
+            fprintf(gTimingCsv, "frame,pass,cpu_ms,gpu_ms\n");
+        }
+    }
+}
 
-    const float texturePointer[] = {
-            0.0,  1.0,
-            1.0,  1.0,
-            0.0,  0.0,
-            1.0,  0.0
-        };
+static void timerRecord(TimerId id, int frame, double cpu_ms, double gpu_ms) {
+    PassTimer& t = gTimers[id];
+    const int slot = t.count % TIMER_HISTORY;
+    t.cpu_ms[slot] = cpu_ms;
+    t.gpu_ms[slot] = gpu_ms;
+    t.count++;
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(2);
+    if (gTimingCsv) {
+        if (gpu_ms < 0) {
+            fprintf(gTimingCsv, "%d,%s,%.4f,\n", frame, TIMER_NAMES[id], cpu_ms);
+        } else {
+            fprintf(gTimingCsv, "%d,%s,%.4f,%.4f\n", frame, TIMER_NAMES[id], cpu_ms, gpu_ms);
+        }
+    }
+}
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, 0, sizeof (GLfloat) * 2, vertexPointer);
-    glVertexAttribPointer(2, 2, GL_FLOAT, 0, sizeof (GLfloat) * 2, texturePointer);
+static void timerResolve(TimerId id, int slot) {
+    PassTimer& t = gTimers[id];
+    if (!t.pending[slot]) return;
 
-    glDrawArrays(GL_TRIANGLE_STRIP,0,4);
-    glFlush();
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(t.queries[slot], GL_QUERY_RESULT, &ns);
+    timerRecord(id, t.pending_frame[slot], t.pending_cpu_ms[slot], ns / 1000000.0);
+    t.pending[slot] = false;
+    if (gTraceEnabled) traceEmit('G', TIMER_NAMES[id], nowMs(), ns / 1000000.0);
+}
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(2);
+static void timerBegin(TimerId id) {
+    PassTimer& t = gTimers[id];
+    const int slot = gTimerFrame % TIMER_LATENCY;
+    if (gTimerQueries) {
+        timerResolve(id, slot); // TIMER_LATENCYフレーム前の結果なので待たされない
+        glBeginQuery(GL_TIME_ELAPSED, t.queries[slot]);
+    }
+    t.cpu_start = nowMs();
+}
 
-    int err = glGetError();
-    if (GL_NO_ERROR != err) {
-        printf("Check GL Error in pass2: %d\n", err);
+static void timerEnd(TimerId id) {
+    PassTimer& t = gTimers[id];
+    const double cpu_ms = nowMs() - t.cpu_start;
+    if (gTraceEnabled) traceEmit('X', TIMER_NAMES[id], t.cpu_start, cpu_ms);
+    if (gTimerQueries) {
+        const int slot = gTimerFrame % TIMER_LATENCY;
+        glEndQuery(GL_TIME_ELAPSED);
+        t.pending[slot] = true;
+        t.pending_frame[slot] = gTimerFrame;
+        t.pending_cpu_ms[slot] = cpu_ms;
+    } else {
+        timerRecord(id, gTimerFrame, cpu_ms, -1);
     }
 }
 
-static float angle = 0;
-static bool once_pass1 = false;
-static void display(void) {
-    angle += 0.1f;
-    const float radius = 2;
-    gLights.pos[0] = radius * cos((((int)angle)%360)*M_PI/180.f);
+static void timerCpu(TimerId id, double cpu_ms) {
+    timerRecord(id, gTimerFrame, cpu_ms, -1);
+}
 
-    if (!once_pass1) {
-        draw_pass1();
-        once_pass1 = true;
-    }
+static void timerFrameEnd() {
+    traceFrameEnd();
+    gTimerFrame++;
+}
 
-    draw_pass2();
+/**
+ * read back all outstanding queries (blocks). call before the final report.
+ */
+static void timerFlush() {
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        // 古いフレームから順に記録する
+        for (int k = 0; k < TIMER_LATENCY; k++) {
+            timerResolve((TimerId)i, (gTimerFrame + k) % TIMER_LATENCY);
+        }
+    }
+    if (gTimingCsv) fflush(gTimingCsv);
+}
 
-    glFlush();
+static int compareDouble(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
 
-    int err = glGetError();
-    if (GL_NO_ERROR != err) {
-        printf("Check GL Error in display(): %d\n", err);
+static void timerStats(const double* history, int n, double* min, double* avg, double* p99) {
+    double sorted[TIMER_HISTORY];
+    int valid = 0;
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        if (history[i] < 0) continue;
+        sorted[valid++] = history[i];
+        sum += history[i];
+    }
+    if (valid == 0) {
+        *min = *avg = *p99 = -1;
+        return;
     }
+    qsort(sorted, valid, sizeof(double), compareDouble);
+    *min = sorted[0];
+    *avg = sum / valid;
+    *p99 = sorted[(int)ceil(valid * 0.99) - 1];
 }
 
-static void idle(void) {
-    glutPostRedisplay();
+/**
+ * rolling average of a pass in ms. GPU time if available, otherwise CPU time.
+ */
+static double timerAverage(TimerId id) {
+    const PassTimer& t = gTimers[id];
+    const int n = t.count < TIMER_HISTORY ? t.count : TIMER_HISTORY;
+    double min, avg, p99;
+    timerStats(t.gpu_ms, n, &min, &avg, &p99);
+    if (avg < 0) {
+        timerStats(t.cpu_ms, n, &min, &avg, &p99);
+    }
+    return avg;
 }
 
-static void printShaderInfoLog(GLuint shader) {
-    GLsizei bufSize;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH , &bufSize);
-    if (bufSize > 1) {
-        GLchar *infoLog;
-        infoLog = (GLchar *)malloc(bufSize);
-        if (infoLog != NULL) {
-            GLsizei length;
-            glGetShaderInfoLog(shader, bufSize, &length, infoLog);
-            fprintf(stderr, "InfoLog:\n%s\n\n", infoLog);
-            free(infoLog);
-        } else {
-            fprintf(stderr, "Could not allocate InfoLog buffer.\n");
+/**
+ * print rolling min/avg/p99 over the last TIMER_HISTORY samples of each pass
+ */
+static void timerReport() {
+    printf("%-8s %-4s %8s %10s %10s %10s\n", "pass", "", "samples", "min(ms)", "avg(ms)", "p99(ms)");
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        const PassTimer& t = gTimers[i];
+        const int n = t.count < TIMER_HISTORY ? t.count : TIMER_HISTORY;
+        if (n == 0) continue;
+        double min, avg, p99;
+        timerStats(t.cpu_ms, n, &min, &avg, &p99);
+        printf("%-8s %-4s %8d %10.3f %10.3f %10.3f\n", TIMER_NAMES[i], "cpu", n, min, avg, p99);
+        timerStats(t.gpu_ms, n, &min, &avg, &p99);
+        if (avg >= 0) {
+            printf("%-8s %-4s %8d %10.3f %10.3f %10.3f\n", TIMER_NAMES[i], "gpu", n, min, avg, p99);
         }
     }
 }
 
-static void printProgramInfoLog(GLuint program) {
-    GLsizei bufSize;
-    glGetProgramiv(program, GL_INFO_LOG_LENGTH , &bufSize);
-    if (bufSize > 1) {
-        GLchar *infoLog = (GLchar *)malloc(bufSize);
-        if (infoLog != NULL) {
-            GLsizei length;
-            glGetProgramInfoLog(program, bufSize, &length, infoLog);
-            fprintf(stderr, "InfoLog:\n%s\n\n", infoLog);
-            free(infoLog);
-        } else {
-            fprintf(stderr, "Could not allocate InfoLog buffer.\n");
-        }
+/**
+ * state calls per frame since the last report, issued and elided by the cache
+ */
+static void reportGlState() {
+    const int frames = gTimerFrame - gGlState.report_frame;
+    long issued = 0;
+    long elided = 0;
+    for (int i = 0; i < NUM_STATE_CALLS; i++) {
+        issued += gGlState.issued[i];
+        elided += gGlState.elided[i];
+    }
+    if (frames > 0 && issued + elided > gGlState.report_issued + gGlState.report_elided) {
+        const double frame_issued = (double)(issued - gGlState.report_issued) / frames;
+        const double frame_elided = (double)(elided - gGlState.report_elided) / frames;
+        printf("gl state: %.1f calls/frame issued, %.1f elided (%.0f%%)\n", frame_issued, frame_elided,
+            100.0 * frame_elided / (frame_issued + frame_elided));
     }
+    gGlState.report_issued = issued;
+    gGlState.report_elided = elided;
+    gGlState.report_frame = gTimerFrame;
 }
 
-static GLuint loadShader(const GLchar* vertSource, const GLchar* fragSource, int pass) {
-    GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+static void multiplyMatrix(float* out, const float* src1, const float* src2);
+static void getPerspectiveMatrix(float* proj, float aspect,
+        int fovy, float near, float far);
+static void getModelviewMatrix(float* modelview, float* normalview,
+        float ex, float ey, float ez,
+        float ax, float ay, float az,
+        float ux, float uy, float uz);
+static void invertRigidMatrix(float* out, const float* src);
+float halton(int base, int index);
+static void initLights();
+static void allocateRenderTargets();
+static void setRenderScale(float scale);
+static void selectShaderVariant();
+static bool renderFrame();
 
-    int length = strlen(vertSource)+1;
-    glShaderSource(vert, 1, &vertSource, &length);
 
-    length = strlen(fragSource)+1;
-    glShaderSource(frag, 1, &fragSource, &length);
+/**
+ * binary mesh file (*.mesh, written by --convert-obj): a MeshHeader followed by
+ * vertex_count interleaved MeshVertex and index_count indices of index_size
+ * bytes, all little endian. the layout matches the vertex buffers, so a file
+ * is uploaded straight from its mapping without parsing; max_index in the
+ * header lets the loader reject out of range indices without reading them.
+ */
+#define MESH_MAGIC "SMSH"
+#define MESH_VERSION 2 // 1: max_indexがない
+
+struct MeshHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t index_size; // 2: uint16, 4: uint32
+    uint32_t max_index; // 一番大きいインデックス (vertex_countより小さい)
+    float bounds_min[3];
+    float bounds_max[3];
+};
 
+struct MeshVertex {
+    float pos[3];
+    float normal[3];
+    float uv[2];
+};
+
+/**
+ * one mesh inside the shared vertex / index buffers behind gMeshVao
+ */
+struct MeshInfo {
+    GLint base_vertex;
+    GLuint first_index;
+    GLsizei index_count;
+    float bounds_min[3]; // メッシュ自体の座標でのAABB
+    float bounds_max[3];
+    float scale; // 原点中心のMESH_FIT_SIZEの大きさに合わせる
+    float center[3];
+};
+
+static MeshInfo gMeshes[MAX_MESHES];
+static int gNumMeshes = 0;
+
+/**
+ * mesh data waiting for uploadMeshes(): a validated file mapping or malloc()ed
+ * arrays
+ */
+struct MeshSource {
+    MeshHeader header;
+    const char* vertices;
+    const char* indices;
+    void* map; // NULL: vertices / indicesはmalloc()した領域
+    size_t map_size;
+};
+
+/**
+ * glBufferSubData() of "size" bytes at "offset". data from a read-only file
+ * mapping goes in MESH_UPLOAD_CHUNK pieces whose pages are dropped once
+ * uploaded, so at most one chunk of the file is resident at a time.
+ */
+#define MESH_UPLOAD_CHUNK (8 << 20)
+static void bufferSubData(GLenum target, GLintptr offset, const char* data, GLsizeiptr size, bool mapped) {
+    if (!mapped) {
+        glBufferSubData(target, offset, size, data);
+        return;
+    }
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    for (GLsizeiptr done = 0; done < size; done += MESH_UPLOAD_CHUNK) {
+        const GLsizeiptr length = (size - done < MESH_UPLOAD_CHUNK) ? size - done : MESH_UPLOAD_CHUNK;
+        glBufferSubData(target, offset + done, length, data + done);
+        // 変更していないMAP_PRIVATEのページなので捨てても再び読める
+        const uintptr_t begin = ((uintptr_t)(data + done) + page - 1) & ~(page - 1);
+        const uintptr_t end = ((uintptr_t)(data + done + length)) & ~(page - 1);
+        if (begin < end) madvise((void*)begin, end - begin, MADV_DONTNEED);
+    }
+}
+
+/**
+ * pack "sources" into one vertex and one index buffer behind gMeshVao (drawn
+ * with a base vertex per mesh) and release them. the indices stay 16 bit if
+ * every mesh has 16 bit indices. attribute 3-6 hold the per-instance model
+ * matrix from gInstanceBuffer.
+ */
+static void uploadMeshes(MeshSource* sources, int count) {
+    uint64_t total_vertices = 0;
+    uint64_t total_indices = 0;
+    gMeshIndexSize = sizeof(uint16_t);
+    for (int i = 0; i < count; i++) {
+        total_vertices += sources[i].header.vertex_count;
+        total_indices += sources[i].header.index_count;
+        if (sources[i].header.index_size != sizeof(uint16_t)) gMeshIndexSize = sizeof(uint32_t);
+    }
+    if (total_vertices > 0x7fffffff || total_indices * gMeshIndexSize > 0x7fffffff) {
+        fprintf(stderr, "The meshes do not fit into one buffer\n");
+        exit(1);
+    }
+    gMeshIndexType = (gMeshIndexSize == sizeof(uint16_t)) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+    glGenVertexArrays(1, &gMeshVao);
+    stateBindVertexArray(gMeshVao);
+
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * total_vertices, NULL, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, 0, sizeof(MeshVertex), (const GLvoid*)offsetof(MeshVertex, pos));
+    stateVertexAttribArray(0, true);
+    glVertexAttribPointer(1, 3, GL_FLOAT, 0, sizeof(MeshVertex), (const GLvoid*)offsetof(MeshVertex, normal));
+    stateVertexAttribArray(1, true);
+    glVertexAttribPointer(2, 2, GL_FLOAT, 0, sizeof(MeshVertex), (const GLvoid*)offsetof(MeshVertex, uv));
+    stateVertexAttribArray(2, true);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, gMeshIndexSize * total_indices, NULL, GL_STATIC_DRAW);
+
+    GLint base_vertex = 0;
+    GLuint first_index = 0;
+    for (int i = 0; i < count; i++) {
+        const MeshHeader* header = &sources[i].header;
+        const bool mapped = sources[i].map != NULL;
+        bufferSubData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * base_vertex, sources[i].vertices,
+            sizeof(MeshVertex) * header->vertex_count, mapped);
+        if (header->index_size == gMeshIndexSize) {
+            bufferSubData(GL_ELEMENT_ARRAY_BUFFER, gMeshIndexSize * first_index, sources[i].indices,
+                (GLsizeiptr)header->index_size * header->index_count, mapped);
+        } else {
+            // 32bitのメッシュと混ざる16bitのメッシュは広げてから送る
+            uint32_t* indices = (uint32_t*)malloc(sizeof(uint32_t) * header->index_count);
+            for (uint32_t k = 0; k < header->index_count; k++) {
+                indices[k] = ((const uint16_t*)sources[i].indices)[k];
+            }
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * first_index,
+                sizeof(uint32_t) * header->index_count, indices);
+            free(indices);
+        }
+
+        MeshInfo* mesh = &gMeshes[i];
+        mesh->base_vertex = base_vertex;
+        mesh->first_index = first_index;
+        mesh->index_count = header->index_count;
+        memcpy(mesh->bounds_min, header->bounds_min, sizeof(mesh->bounds_min));
+        memcpy(mesh->bounds_max, header->bounds_max, sizeof(mesh->bounds_max));
+        float extent = 0.f;
+        for (int k = 0; k < 3; k++) {
+            mesh->center[k] = (header->bounds_min[k] + header->bounds_max[k]) / 2.f;
+            extent = fmaxf(extent, header->bounds_max[k] - header->bounds_min[k]);
+        }
+        mesh->scale = (extent > 0.f) ? MESH_FIT_SIZE / extent : 1.f;
+        base_vertex += header->vertex_count;
+        first_index += header->index_count;
+
+        if (mapped) {
+            munmap(sources[i].map, sources[i].map_size);
+        } else {
+            free((void*)sources[i].vertices);
+            free((void*)sources[i].indices);
+        }
+    }
+    gNumMeshes = count;
+
+    // mat4の属性は列ごとに4つのvec4属性として渡す
+    glGenBuffers(1, &gInstanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 16 * gNumInstances, NULL, GL_STREAM_DRAW);
+    for (int i = 0; i < 4; i++) {
+        glVertexAttribPointer(3 + i, 4, GL_FLOAT, 0, sizeof (GLfloat) * 16,
+                (const GLvoid*)(sizeof (GLfloat) * 4 * i));
+        glVertexAttribDivisor(3 + i, 1);
+        stateVertexAttribArray(3 + i, true);
+    }
+
+    stateBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    gInstanceMatrices = (float*)malloc(sizeof(float) * 16 * gNumInstances);
+    if (gInstanceMatrices == NULL) {
+        fprintf(stderr, "Could not allocate instance matrices.\n");
+        exit(1);
+    }
+}
+
+/**
+ * map a *.mesh file into "source". uploadMeshes() copies the vertex and index
+ * data from the page cache to the GL buffers without an intermediate copy.
+ */
+static bool loadMeshFile(const char* path, MeshSource* source) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshHeader)) {
+        fprintf(stderr, "Invalid mesh file: %s\n", path);
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const MeshHeader* header = (const MeshHeader*)map;
+    const uint64_t vertex_bytes = (uint64_t)sizeof(MeshVertex) * header->vertex_count;
+    const uint64_t index_bytes = (uint64_t)header->index_size * header->index_count;
+    if (memcmp(header->magic, MESH_MAGIC, 4) != 0 || header->version != MESH_VERSION
+            || (header->index_size != 2 && header->index_size != 4)
+            || header->max_index >= header->vertex_count
+            || sizeof(MeshHeader) + vertex_bytes + index_bytes != (uint64_t)st.st_size) {
+        fprintf(stderr, "Invalid mesh file: %s\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    source->header = *header;
+    source->vertices = (const char*)map + sizeof(MeshHeader);
+    source->indices = source->vertices + vertex_bytes;
+    source->map = map;
+    source->map_size = st.st_size;
+    return true;
+}
+
+/**
+ * mesh parsed from a Wavefront OBJ file (32 bit indices)
+ */
+struct ObjMesh {
+    MeshHeader header;
+    MeshVertex* vertices;
+    uint32_t* indices;
+};
+
+/**
+ * make room for "count" + "extra" elements in a malloc()ed array
+ */
+static void* growArray(void* array, int* capacity, int count, int extra, size_t size) {
+    if (count + extra <= *capacity) return array;
+    while (count + extra > *capacity) {
+        *capacity = (*capacity < 1024) ? 1024 : *capacity * 2;
+    }
+    array = realloc(array, size * *capacity);
+    if (array == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+/**
+ * OBJ face corner ("v", "v/t", "v//n" or "v/t/n") as 0 based v/t/n indices.
+ * negative (relative) indices are resolved against "counts", missing ones
+ * are -1.
+ */
+static const char* parseObjCorner(const char* s, const int* counts, int* corner) {
+    for (int k = 0; k < 3; k++) {
+        corner[k] = -1;
+        if (k > 0) {
+            if (*s != '/') continue;
+            s++;
+        }
+        char* end;
+        const long value = strtol(s, &end, 10);
+        if (end == s) continue;
+        s = end;
+        corner[k] = (value < 0) ? counts[k] + (int)value : (int)value - 1;
+        if (corner[k] < 0 || corner[k] >= counts[k]) corner[k] = -1;
+    }
+    return s;
+}
+
+static unsigned int hashObjCorner(const int* corner) {
+    return (corner[0] * 73856093u) ^ (corner[1] * 19349663u) ^ (corner[2] * 83492791u);
+}
+
+/**
+ * parse the v / vt / vn / f lines of "path". polygons are split into fans,
+ * face corners with the same v/t/n share one vertex, and corners without a
+ * normal get the average normal of the faces around their position.
+ */
+static bool parseObj(const char* path, ObjMesh* mesh) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    memset(mesh, 0, sizeof(*mesh));
+
+    const int widths[3] = {3, 2, 3};
+    float* attribs[3] = {NULL, NULL, NULL}; // v, vt, vn
+    int counts[3] = {0, 0, 0};
+    int capacities[3] = {0, 0, 0};
+    int* corners = NULL; // 頂点ごとの v/t/n
+    int vertex_count = 0;
+    int vertex_capacity = 0;
+    int corner_capacity = 0;
+    int index_count = 0;
+    int index_capacity = 0;
+
+    // v/t/nから頂点を引くハッシュ表 (開番地法, -1: 空き)
+    int table_size = 1 << 16;
+    int* table = (int*)malloc(sizeof(int) * table_size);
+    memset(table, 0xff, sizeof(int) * table_size);
+
+    bool ok = true;
+    char line[4096];
+    while (ok && fgets(line, sizeof(line), fp)) {
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            // 途中で切ると面の番号を間違えて読む
+            fprintf(stderr, "Line too long in %s: %.40s...\n", path, line);
+            ok = false;
+            break;
+        }
+        const char* s = line + 2;
+        int type = -1;
+        if (line[0] == 'v' && line[1] == ' ') {
+            type = 0;
+        } else if (line[0] == 'v' && line[1] == 't' && line[2] == ' ') {
+            type = 1;
+            s++;
+        } else if (line[0] == 'v' && line[1] == 'n' && line[2] == ' ') {
+            type = 2;
+            s++;
+        }
+        if (type >= 0) {
+            attribs[type] = (float*)growArray(attribs[type], &capacities[type], counts[type], 1,
+                sizeof(float) * widths[type]);
+            for (int k = 0; k < widths[type]; k++) {
+                char* end;
+                attribs[type][counts[type] * widths[type] + k] = strtof(s, &end);
+                s = end;
+            }
+            counts[type]++;
+            continue;
+        }
+        if (line[0] != 'f' || line[1] != ' ') continue;
+
+        int first = -1;
+        int prev = -1;
+        while (true) {
+            while (*s == ' ' || *s == '\t') s++;
+            if (*s == '\0' || *s == '\n' || *s == '\r') break;
+            int corner[3];
+            s = parseObjCorner(s, counts, corner);
+            while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r') s++;
+            if (corner[0] < 0) {
+                fprintf(stderr, "Invalid face in %s: %s", path, line);
+                ok = false;
+                break;
+            }
+
+            int slot = hashObjCorner(corner) & (table_size - 1);
+            while (table[slot] >= 0 && memcmp(&corners[table[slot] * 3], corner, sizeof(corner)) != 0) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            int vertex = table[slot];
+            if (vertex < 0) {
+                vertex = vertex_count++;
+                table[slot] = vertex;
+                corners = (int*)growArray(corners, &corner_capacity, vertex, 1, sizeof(int) * 3);
+                memcpy(&corners[vertex * 3], corner, sizeof(corner));
+                mesh->vertices = (MeshVertex*)growArray(mesh->vertices, &vertex_capacity, vertex, 1,
+                    sizeof(MeshVertex));
+                MeshVertex* v = &mesh->vertices[vertex];
+                memset(v, 0, sizeof(*v));
+                memcpy(v->pos, &attribs[0][corner[0] * 3], sizeof(v->pos));
+                if (corner[1] >= 0) memcpy(v->uv, &attribs[1][corner[1] * 2], sizeof(v->uv));
+                if (corner[2] >= 0) memcpy(v->normal, &attribs[2][corner[2] * 3], sizeof(v->normal));
+
+                if (vertex_count * 2 > table_size) {
+                    // 半分埋まったら倍の大きさで作り直す
+                    table_size *= 2;
+                    table = (int*)realloc(table, sizeof(int) * table_size);
+                    memset(table, 0xff, sizeof(int) * table_size);
+                    for (int i = 0; i < vertex_count; i++) {
+                        int j = hashObjCorner(&corners[i * 3]) & (table_size - 1);
+                        while (table[j] >= 0) j = (j + 1) & (table_size - 1);
+                        table[j] = i;
+                    }
+                }
+            }
+
+            if (first < 0) {
+                first = vertex;
+            } else if (prev != first) {
+                mesh->indices = (uint32_t*)growArray(mesh->indices, &index_capacity, index_count, 3,
+                    sizeof(uint32_t));
+                mesh->indices[index_count++] = first;
+                mesh->indices[index_count++] = prev;
+                mesh->indices[index_count++] = vertex;
+            }
+            prev = vertex;
+        }
+    }
+    fclose(fp);
+    free(table);
+
+    if (ok && vertex_count == 0) {
+        fprintf(stderr, "No faces in %s\n", path);
+        ok = false;
+    }
+    if (ok) {
+        // 法線のない頂点には、同じ位置を共有する面の法線の平均を使う
+        float* face_normals = NULL;
+        for (int i = 0; i < index_count; i += 3) {
+            const MeshVertex* t[3];
+            bool needed = false;
+            for (int k = 0; k < 3; k++) {
+                t[k] = &mesh->vertices[mesh->indices[i + k]];
+                needed |= corners[mesh->indices[i + k] * 3 + 2] < 0;
+            }
+            if (!needed) continue;
+            if (face_normals == NULL) {
+                face_normals = (float*)calloc(counts[0] * 3, sizeof(float));
+            }
+            float e1[3], e2[3];
+            for (int k = 0; k < 3; k++) {
+                e1[k] = t[1]->pos[k] - t[0]->pos[k];
+                e2[k] = t[2]->pos[k] - t[0]->pos[k];
+            }
+            const float n[3] = {
+                e1[1] * e2[2] - e1[2] * e2[1],
+                e1[2] * e2[0] - e1[0] * e2[2],
+                e1[0] * e2[1] - e1[1] * e2[0],
+            }; // 面積で重み付けされる
+            for (int k = 0; k < 3; k++) {
+                float* sum = &face_normals[corners[mesh->indices[i + k] * 3] * 3];
+                sum[0] += n[0];
+                sum[1] += n[1];
+                sum[2] += n[2];
+            }
+        }
+        if (face_normals) {
+            for (int i = 0; i < vertex_count; i++) {
+                if (corners[i * 3 + 2] >= 0) continue;
+                const float* sum = &face_normals[corners[i * 3] * 3];
+                const float len = sqrtf(sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2]);
+                for (int k = 0; k < 3; k++) {
+                    mesh->vertices[i].normal[k] = (len > 0.f) ? sum[k] / len : 0.f;
+                }
+            }
+            free(face_normals);
+        }
+
+        MeshHeader* header = &mesh->header;
+        memcpy(header->magic, MESH_MAGIC, 4);
+        header->version = MESH_VERSION;
+        header->vertex_count = vertex_count;
+        header->index_count = index_count;
+        header->index_size = sizeof(uint32_t);
+        header->max_index = vertex_count - 1; // 頂点は面の角から作るので全て参照される
+        for (int k = 0; k < 3; k++) {
+            header->bounds_min[k] = header->bounds_max[k] = mesh->vertices[0].pos[k];
+        }
+        for (int i = 1; i < vertex_count; i++) {
+            for (int k = 0; k < 3; k++) {
+                header->bounds_min[k] = fminf(header->bounds_min[k], mesh->vertices[i].pos[k]);
+                header->bounds_max[k] = fmaxf(header->bounds_max[k], mesh->vertices[i].pos[k]);
+            }
+        }
+    }
+
+    for (int k = 0; k < 3; k++) {
+        free(attribs[k]);
+    }
+    free(corners);
+    if (!ok) {
+        free(mesh->vertices);
+        free(mesh->indices);
+        memset(mesh, 0, sizeof(*mesh));
+    }
+    return ok;
+}
+
+/**
+ * parse "path" into "source" at load time (the slow path that *.mesh avoids)
+ */
+static bool loadObjFile(const char* path, MeshSource* source) {
+    ObjMesh mesh;
+    if (!parseObj(path, &mesh)) return false;
+    source->header = mesh.header;
+    source->vertices = (const char*)mesh.vertices;
+    source->indices = (const char*)mesh.indices;
+    source->map = NULL;
+    return true;
+}
+
+/**
+ * --convert-obj: write "obj_path" as a *.mesh file. meshes with up to 65536
+ * vertices get 16 bit indices.
+ */
+static bool convertObj(const char* obj_path, const char* mesh_path) {
+    const double start = nowMs();
+    ObjMesh mesh;
+    if (!parseObj(obj_path, &mesh)) return false;
+
+    MeshHeader* header = &mesh.header;
+    if (header->vertex_count <= 65536) {
+        uint16_t* indices16 = (uint16_t*)mesh.indices; // 前から詰めるので同じ領域で変換できる
+        for (uint32_t i = 0; i < header->index_count; i++) {
+            indices16[i] = (uint16_t)mesh.indices[i];
+        }
+        header->index_size = sizeof(uint16_t);
+    }
+
+    FILE* fp = fopen(mesh_path, "wb");
+    bool ok = fp != NULL;
+    if (ok) {
+        ok = fwrite(header, sizeof(*header), 1, fp) == 1
+            && fwrite(mesh.vertices, sizeof(MeshVertex), header->vertex_count, fp) == header->vertex_count
+            && fwrite(mesh.indices, header->index_size, header->index_count, fp) == header->index_count;
+        ok = (fclose(fp) == 0) && ok;
+    }
+    if (ok) {
+        printf("%s: %u vertices, %u triangles, %u bit indices (%.1f ms)\n", mesh_path,
+            header->vertex_count, header->index_count / 3, header->index_size * 8, nowMs() - start);
+    } else {
+        fprintf(stderr, "Could not write %s\n", mesh_path);
+    }
+    free(mesh.vertices);
+    free(mesh.indices);
+    return ok;
+}
+
+/**
+ * peak resident set size of the process in MB
+ */
+static double peakRssMb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // Linuxではキロバイト単位
+}
+
+/**
+ * the built-in box, "width" x "height" x "depth" around the origin
+ */
+static void initBoxGeometry(float width, float height, float depth, MeshSource* source) {
+    const float box_vertexes[] = {
+        // front plane
+         width/2.f, height/2.f, depth/2.f,
+        -width/2.f, height/2.f, depth/2.f,
+         width/2.f,-height/2.f, depth/2.f,
+        -width/2.f,-height/2.f, depth/2.f,
+
+        // back plane
+        -width/2.f, height/2.f,-depth/2.f,
+         width/2.f, height/2.f,-depth/2.f,
+        -width/2.f,-height/2.f,-depth/2.f,
+         width/2.f,-height/2.f,-depth/2.f,
+
+        // left plane
+        -width/2.f, height/2.f, depth/2.f,
+        -width/2.f, height/2.f,-depth/2.f,
+        -width/2.f,-height/2.f, depth/2.f,
+        -width/2.f,-height/2.f,-depth/2.f,
+
+        // right plane
+         width/2.f, height/2.f,-depth/2.f,
+         width/2.f, height/2.f, depth/2.f,
+         width/2.f,-height/2.f,-depth/2.f,
+         width/2.f,-height/2.f, depth/2.f,
+
+        // top plane
+         width/2.f, height/2.f,-depth/2.f,
+        -width/2.f, height/2.f,-depth/2.f,
+         width/2.f, height/2.f, depth/2.f,
+        -width/2.f, height/2.f, depth/2.f,
+
+        // bottom plane
+        -width/2.f,-height/2.f,-depth/2.f,
+         width/2.f,-height/2.f,-depth/2.f,
+        -width/2.f,-height/2.f, depth/2.f,
+         width/2.f,-height/2.f, depth/2.f,
+    };
+
+    const float box_normals[] = {
+        // front plane
+         0, 0, 1,
+         0, 0, 1,
+         0, 0, 1,
+         0, 0, 1,
+
+        // back plane
+         0, 0,-1,
+         0, 0,-1,
+         0, 0,-1,
+         0, 0,-1,
+
+        // left plane
+        -1, 0, 0,
+        -1, 0, 0,
+        -1, 0, 0,
+        -1, 0, 0,
+
+        // right plane
+         1, 0, 0,
+         1, 0, 0,
+         1, 0, 0,
+         1, 0, 0,
+
+        // top plane
+         0, 1, 0,
+         0, 1, 0,
+         0, 1, 0,
+         0, 1, 0,
+
+        // bottom plane
+         0,-1, 0,
+         0,-1, 0,
+         0,-1, 0,
+         0,-1, 0,
+    };
+
+    const float box_texcoords[] = {
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0,
+
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0,
+
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0,
+
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0,
+
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0,
+
+             0,  1,
+             1,  1,
+             0,  0,
+             1,  0
+        };
+
+    const uint16_t box_indexes[] = {
+             0, 1, 2,
+             2, 1, 3,
+
+             4, 5, 6,
+             6, 5, 7,
+
+             8, 9,10,
+            10, 9,11,
+
+            12,13,14,
+            14,13,15,
+
+            16,17,18,
+            18,17,19,
+
+            20,21,22,
+            22,21,23
+        };
+
+    MeshHeader& header = source->header;
+    memset(source, 0, sizeof(*source));
+    header.vertex_count = sizeof(box_vertexes) / (sizeof(float) * 3);
+    header.index_count = sizeof(box_indexes) / sizeof(uint16_t);
+    header.index_size = sizeof(uint16_t);
+    header.max_index = header.vertex_count - 1;
+    header.bounds_min[0] = -width/2.f;
+    header.bounds_min[1] = -height/2.f;
+    header.bounds_min[2] = -depth/2.f;
+    header.bounds_max[0] = width/2.f;
+    header.bounds_max[1] = height/2.f;
+    header.bounds_max[2] = depth/2.f;
+
+    MeshVertex* vertices = (MeshVertex*)malloc(sizeof(MeshVertex) * header.vertex_count);
+    for (uint32_t i = 0; i < header.vertex_count; i++) {
+        memcpy(vertices[i].pos, &box_vertexes[i*3], sizeof(float) * 3);
+        memcpy(vertices[i].normal, &box_normals[i*3], sizeof(float) * 3);
+        memcpy(vertices[i].uv, &box_texcoords[i*2], sizeof(float) * 2);
+    }
+    uint16_t* indices = (uint16_t*)malloc(sizeof(box_indexes));
+    memcpy(indices, box_indexes, sizeof(box_indexes));
+    source->vertices = (const char*)vertices;
+    source->indices = (const char*)indices;
+}
+
+/**
+ * geometry of pass1: the --mesh files (*.obj is parsed, anything else mapped as
+ * *.mesh) or --box-variants boxes, packed by uploadMeshes(). instance i draws
+ * mesh i % gNumMeshes.
+ */
+static void initGeometry() {
+    MeshSource* sources = (MeshSource*)calloc(MAX_MESHES, sizeof(MeshSource));
+    if (gNumMeshPaths == 0) {
+        initBoxGeometry(2.5,2.5,2.5, &sources[0]);
+        for (int i = 1; i < gBoxVariants; i++) {
+            // 1辺2.5の箱から縦横比だけを変える
+            initBoxGeometry(2.5f * (0.3f + 0.7f * halton(2, i)), 2.5f * (0.3f + 0.7f * halton(3, i)),
+                2.5f * (0.3f + 0.7f * halton(5, i)), &sources[i]);
+        }
+        uploadMeshes(sources, gBoxVariants);
+        free(sources);
+        return;
+    }
+
+    const double start = nowMs();
+    const double start_rss = peakRssMb();
+    uint64_t triangles = 0;
+    int parsed = 0;
+    for (int i = 0; i < gNumMeshPaths; i++) {
+        const char* path = gMeshPaths[i];
+        const size_t length = strlen(path);
+        const bool obj = length >= 4 && strcmp(path + length - 4, ".obj") == 0;
+        if (!(obj ? loadObjFile(path, &sources[i]) : loadMeshFile(path, &sources[i]))) {
+            exit(1);
+        }
+        triangles += sources[i].header.index_count / 3;
+        parsed += obj ? 1 : 0;
+    }
+    uploadMeshes(sources, gNumMeshPaths);
+    free(sources);
+    glFinish();
+    printf("meshes: %d (%d OBJ parsed, %d mapped), %llu triangles, loaded in %.1f ms, peak RSS %.1f MB (+%.1f MB)\n",
+        gNumMeshPaths, parsed, gNumMeshPaths - parsed, (unsigned long long)triangles, nowMs() - start,
+        peakRssMb(), peakRssMb() - start_rss);
+}
+
+constexpr int PRIMES[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43,
+    47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103,
+    107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163,
+    167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227,
+    229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281,
+    283, 293, 307, 311, 313, 317, 331, 337, 347, 349, 353,
+    359, 367, 373, 379, 383, 389, 397, 401, 409, 419, 421,
+    431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487,
+    491, 499, 503, 509, 521, 523, 541, 547, 557, 563, 569,
+    571, 577, 587, 593, 599, 601, 607, 613, 617, 619, 631,
+    641, 643, 647, 653, 659, 661, 673, 677, 683, 691, 701,
+    709, 719, 727, 733, 739, 743, 751, 757, 761, 769, 773,
+    787, 797, 809, 811, 821, 823, 827, 829, 839, 853, 857,
+    859, 863, 877, 881, 883, 887, 907, 911, 919, 929, 937,
+    941, 947, 953, 967, 971, 977, 983, 991, 997
+};
+
+const int SIZE_OF_PRIMES = sizeof(PRIMES) / sizeof(int);
+
+/**
+ * radical inverse of "index" in base "p", the "index"-th point of a Halton
+ * sequence
+ */
+static constexpr float radicalInverse(int p, int index) {
+    const float half = 1.f / (float)p;
+    float sum = 0;
+    float k = half;
+    while (index > 0) {
+        const int val = (index % p);
+        sum += val * k;
+        index = (index - val) / p;
+        k *= half;
+    }
+    return sum;
+}
+
+/**
+ * the first HALTON_TABLE_SIZE points of the first HALTON_TABLE_BASES bases,
+ * computed at compile time. this covers the instance rotations and positions
+ * up to 4096 instances, the SSAO kernels and the fill lights.
+ */
+#define HALTON_TABLE_SIZE 4096
+#define HALTON_TABLE_BASES 8
+
+struct HaltonTable {
+    float values[HALTON_TABLE_BASES][HALTON_TABLE_SIZE];
+};
+
+static constexpr HaltonTable makeHaltonTable() {
+    HaltonTable table = {};
+    for (int b = 0; b < HALTON_TABLE_BASES; b++) {
+        for (int i = 0; i < HALTON_TABLE_SIZE; i++) {
+            table.values[b][i] = radicalInverse(PRIMES[b], i);
+        }
+    }
+    return table;
+}
+
+static constexpr HaltonTable HALTON_TABLE = makeHaltonTable();
+
+float halton(int base, int index) {
+    if (base < HALTON_TABLE_BASES && index < HALTON_TABLE_SIZE) {
+        return HALTON_TABLE.values[base][index];
+    }
+    return radicalInverse(PRIMES[base % SIZE_OF_PRIMES], index);
+}
+
+static int gRandIndex = 0;
+static void getRandamRoteMat(float* mat) {
+    float theta= M_PI * halton(0, gRandIndex);
+    float phy  = 2.f * M_PI*halton(1, gRandIndex++);
+    float sPhy = sin(theta);
+    float at_vec[] = {sPhy*cos(phy), cos(theta), sPhy*sin(phy)};
+    float n = sqrt(at_vec[0]*at_vec[0] + at_vec[1]*at_vec[1] + at_vec[2]*at_vec[2]);
+    at_vec[0] /= n;
+    at_vec[1] /= n;
+    at_vec[2] /= n;
+
+    float up[] = {0, 1, 0};
+    if ((at_vec[0]*up[0]+at_vec[1]*up[1]+at_vec[2]*up[2]) >= 0.98) {
+        up[0] = 0;
+        up[1] = 0;
+        up[2] = 1;
+    }
+
+    float vec_x[] = {
+            at_vec[1] * up[2] - up[1] * at_vec[2],
+            at_vec[2] * up[0] - up[2] * at_vec[0],
+            at_vec[0] * up[1] - up[0] * at_vec[1],
+        };
+
+    n = sqrt(vec_x[0]*vec_x[0] + vec_x[1]*vec_x[1] + vec_x[2]*vec_x[2]);
+    vec_x[0] /= n;
+    vec_x[1] /= n;
+    vec_x[2] /= n;
+
+    float vec_y[] = {
+            vec_x[1] * at_vec[2] - at_vec[1] * vec_x[2],
+            vec_x[2] * at_vec[0] - at_vec[2] * vec_x[0],
+            vec_x[0] * at_vec[1] - at_vec[0] * vec_x[1],
+        };
+    n = sqrt(vec_y[0]*vec_y[0] + vec_y[1]*vec_y[1] + vec_y[2]*vec_y[2]);
+    vec_y[0] /= n;
+    vec_y[1] /= n;
+    vec_y[2] /= n;
+
+    mat[0] = vec_x[0];
+    mat[1] = vec_y[0];
+    mat[2] = at_vec[0];
+    mat[3] = 0;
+
+    mat[4] = vec_x[1];
+    mat[5] = vec_y[1];
+    mat[6] = at_vec[1];
+    mat[7] = 0;
+
+    mat[8] = vec_x[2];
+    mat[9] = vec_y[2];
+    mat[10] = at_vec[2];
+    mat[11] = 0;
+
+    mat[12] = 0;
+    mat[13] = 0;
+    mat[14] = 0;
+    mat[15] = 1;
+}
+
+/**
+ * model matrix of instance "index". up to BASE_INSTANCES boxes are only rotated
+ * around the origin. beyond that they are shrunk and scattered in a cube so that
+ * the covered volume (and the overdraw) stays about the same as the scene grows.
+ */
+static void getInstanceMat(float* mat, int index) {
+    getRandamRoteMat(mat);
+    if (gNumInstances > BASE_INSTANCES) {
+        const float scale = cbrtf((float)BASE_INSTANCES / (float)gNumInstances);
+        for (int i = 0; i < 12; i++) {
+            mat[i] *= scale;
+        }
+        mat[12] = 3.f * (halton(2, index) - 0.5f);
+        mat[13] = 3.f * (halton(3, index) - 0.5f);
+        mat[14] = 3.f * (halton(4, index) - 0.5f);
+    }
+
+    // mat * (scale * (x - center)) : 1辺2.5の箱ではscale 1, center 0なので変わらない
+    const MeshInfo& mesh = gMeshes[index % gNumMeshes];
+    for (int i = 0; i < 3; i++) {
+        mat[12+i] -= mesh.scale * (mat[i]*mesh.center[0] + mat[4+i]*mesh.center[1] + mat[8+i]*mesh.center[2]);
+    }
+    for (int i = 0; i < 12; i++) {
+        mat[i] *= mesh.scale;
+    }
+}
+
+/**
+ * scene container for frustum culling (--frustum-cull). every instance keeps
+ * its model matrix and world-space AABB, and a BVH over the AABBs is stored
+ * in depth-first order: the left child of an internal node is the next node,
+ * the right child is "right", so children always follow their parent. moved
+ * instances mark their leaf and its ancestors, and bvhRefit() recomputes only
+ * the marked nodes; once the summed node surface area has grown by
+ * BVH_REBUILD_RATIO since the last build the tree is rebuilt.
+ */
+#define BVH_LEAF_SIZE 4
+#define BVH_REBUILD_RATIO 1.5f
+
+struct BvhNode {
+    float min[3];
+    float max[3];
+    int parent; // -1: ルート
+    int right; // 内部ノードの右の子
+    int first; // 葉: gScene.orderの先頭
+    int count; // 葉: 物体の数, 0: 内部ノード
+    bool dirty; // 子孫の物体が動いたので範囲を計算し直す
+};
+
+struct Scene {
+    int count;
+    float* matrices; // 16 * count
+    float* base_matrices; // 動かす前の行列 (--moving-instances)
+    float* bounds; // 6 * count (min xyz, max xyz)
+    int* order; // 葉ごとに並べた物体の番号
+    int* leaf_of; // 物体が入っている葉
+    unsigned char* moved; // updateScene()で動かした物体
+    BvhNode* nodes;
+    int node_count;
+    float area; // 全ノードの表面積の和
+    float build_area; // 構築した時のarea
+    int rebuilds;
+};
+
+static Scene gScene;
+static bool gFrustumCulling = false;
+static int gMovingInstances = 0; // 毎フレーム動かすインスタンスの数
+static int gDrawCounts[TIMER_HISTORY]; // フレームごとに描画したインスタンスの数
+
+/**
+ * world AABB of the bounds of "mesh" transformed by "mat"
+ */
+static void transformBounds(float* bounds, const float* mat, const MeshInfo& mesh) {
+    for (int r = 0; r < 3; r++) {
+        float center = mat[12+r];
+        float extent = 0.f;
+        for (int c = 0; c < 3; c++) {
+            const float local_center = (mesh.bounds_min[c] + mesh.bounds_max[c]) / 2.f;
+            const float local_extent = (mesh.bounds_max[c] - mesh.bounds_min[c]) / 2.f;
+            center += mat[c*4+r] * local_center;
+            extent += fabsf(mat[c*4+r]) * local_extent;
+        }
+        bounds[r] = center - extent;
+        bounds[3+r] = center + extent;
+    }
+}
+
+static float surfaceArea(const float* min, const float* max) {
+    const float x = max[0] - min[0];
+    const float y = max[1] - min[1];
+    const float z = max[2] - min[2];
+    return 2.f * (x*y + y*z + z*x);
+}
+
+/**
+ * bounds of a leaf from its objects, or of an internal node from its children
+ */
+static void bvhUpdateBounds(int index) {
+    BvhNode* node = &gScene.nodes[index];
+    for (int k = 0; k < 3; k++) {
+        node->min[k] = INFINITY;
+        node->max[k] = -INFINITY;
+    }
+    if (node->count > 0) {
+        for (int i = node->first; i < node->first + node->count; i++) {
+            const float* b = &gScene.bounds[gScene.order[i] * 6];
+            for (int k = 0; k < 3; k++) {
+                node->min[k] = fminf(node->min[k], b[k]);
+                node->max[k] = fmaxf(node->max[k], b[3+k]);
+            }
+        }
+    } else {
+        const BvhNode* children[2] = {&gScene.nodes[index + 1], &gScene.nodes[node->right]};
+        for (int c = 0; c < 2; c++) {
+            for (int k = 0; k < 3; k++) {
+                node->min[k] = fminf(node->min[k], children[c]->min[k]);
+                node->max[k] = fmaxf(node->max[k], children[c]->max[k]);
+            }
+        }
+    }
+}
+
+static float bvhCentroid(int object, int axis) {
+    return gScene.bounds[object * 6 + axis] + gScene.bounds[object * 6 + 3 + axis];
+}
+
+/**
+ * reorder order[begin, end) so that the object at "nth" has the median
+ * centroid along "axis" (quickselect)
+ */
+static void bvhSelect(int begin, int end, int nth, int axis) {
+    int* order = gScene.order;
+    while (end - begin > 1) {
+        const float pivot = bvhCentroid(order[(begin + end) / 2], axis);
+        int i = begin;
+        int j = end - 1;
+        while (i <= j) {
+            while (bvhCentroid(order[i], axis) < pivot) i++;
+            while (bvhCentroid(order[j], axis) > pivot) j--;
+            if (i <= j) {
+                const int tmp = order[i];
+                order[i++] = order[j];
+                order[j--] = tmp;
+            }
+        }
+        if (nth <= j) {
+            end = j + 1;
+        } else if (nth >= i) {
+            begin = i;
+        } else {
+            return;
+        }
+    }
+}
+
+/**
+ * build the subtree over order[begin, end) by median splits on the longest
+ * axis of the centroids, and return its root node
+ */
+static int bvhBuild(int begin, int end, int parent) {
+    const int index = gScene.node_count++;
+    BvhNode* node = &gScene.nodes[index];
+    node->parent = parent;
+    node->dirty = false;
+    node->first = begin;
+    node->count = end - begin;
+
+    if (end - begin > BVH_LEAF_SIZE) {
+        float cmin[3] = {INFINITY, INFINITY, INFINITY};
+        float cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (int i = begin; i < end; i++) {
+            for (int k = 0; k < 3; k++) {
+                cmin[k] = fminf(cmin[k], bvhCentroid(gScene.order[i], k));
+                cmax[k] = fmaxf(cmax[k], bvhCentroid(gScene.order[i], k));
+            }
+        }
+        int axis = 0;
+        for (int k = 1; k < 3; k++) {
+            if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) axis = k;
+        }
+        const int mid = (begin + end) / 2;
+        bvhSelect(begin, end, mid, axis);
+
+        node->count = 0;
+        bvhBuild(begin, mid, index);
+        node->right = bvhBuild(mid, end, index);
+    } else {
+        for (int i = begin; i < end; i++) {
+            gScene.leaf_of[gScene.order[i]] = index;
+        }
+    }
+    bvhUpdateBounds(index);
+    return index;
+}
+
+static void bvhRebuild() {
+    for (int i = 0; i < gScene.count; i++) {
+        gScene.order[i] = i;
+    }
+    gScene.node_count = 0;
+    bvhBuild(0, gScene.count, -1);
+
+    gScene.area = 0.f;
+    for (int i = 0; i < gScene.node_count; i++) {
+        gScene.area += surfaceArea(gScene.nodes[i].min, gScene.nodes[i].max);
+    }
+    gScene.build_area = gScene.area;
+}
+
+/**
+ * place instance "object" at "mat". safe to call for different objects in
+ * parallel; sceneMarkMoved() then marks the nodes above it for bvhRefit()
+ */
+static void sceneMoveObject(int object, const float* mat) {
+    memcpy(&gScene.matrices[object * 16], mat, sizeof(float) * 16);
+    transformBounds(&gScene.bounds[object * 6], mat, gMeshes[object % gNumMeshes]);
+}
+
+/**
+ * mark the leaf of a moved instance and its ancestors for bvhRefit()
+ */
+static void sceneMarkMoved(int object) {
+    for (int index = gScene.leaf_of[object]; index >= 0 && !gScene.nodes[index].dirty;
+            index = gScene.nodes[index].parent) {
+        gScene.nodes[index].dirty = true; // 上は既に印が付いている
+    }
+}
+
+/**
+ * recompute the bounds of the marked nodes, children before their parents
+ */
+static void bvhRefit() {
+    for (int index = gScene.node_count - 1; index >= 0; index--) {
+        BvhNode* node = &gScene.nodes[index];
+        if (!node->dirty) continue;
+        const float old_area = surfaceArea(node->min, node->max);
+        bvhUpdateBounds(index);
+        gScene.area += surfaceArea(node->min, node->max) - old_area;
+        node->dirty = false;
+    }
+}
+
+/**
+ * fill gScene with the gNumInstances instances of getInstanceMat() and build
+ * the BVH
+ */
+static void initScene() {
+    gScene.count = gNumInstances;
+    gScene.matrices = (float*)malloc(sizeof(float) * 16 * gNumInstances);
+    gScene.base_matrices = (float*)malloc(sizeof(float) * 16 * gNumInstances);
+    gScene.bounds = (float*)malloc(sizeof(float) * 6 * gNumInstances);
+    gScene.order = (int*)malloc(sizeof(int) * gNumInstances);
+    gScene.leaf_of = (int*)malloc(sizeof(int) * gNumInstances);
+    gScene.moved = (unsigned char*)calloc(gNumInstances, 1);
+    gScene.nodes = (BvhNode*)malloc(sizeof(BvhNode) * 2 * gNumInstances);
+    if (!gScene.matrices || !gScene.base_matrices || !gScene.bounds || !gScene.order || !gScene.leaf_of
+            || !gScene.moved || !gScene.nodes) {
+        fprintf(stderr, "Could not allocate the scene.\n");
+        exit(1);
+    }
+
+    gRandIndex = 0;
+    for (int i = 0; i < gNumInstances; i++) {
+        getInstanceMat(&gScene.base_matrices[i * 16], i);
+        transformBounds(&gScene.bounds[i * 6], &gScene.base_matrices[i * 16], gMeshes[i % gNumMeshes]);
+    }
+    memcpy(gScene.matrices, gScene.base_matrices, sizeof(float) * 16 * gNumInstances);
+
+    const double t = nowMs();
+    bvhRebuild();
+    printf("scene: %d instances, BVH of %d nodes built in %.1f ms\n", gNumInstances, gScene.node_count,
+        nowMs() - t);
+}
+
+/**
+ * frustum planes (ax + by + cz + d >= 0 inside) of the projection * view matrix
+ */
+static void getFrustumPlanes(float* planes, const float* proj, const float* view) {
+    float m[16];
+    multiplyMatrix(m, view, proj);
+    for (int i = 0; i < 6; i++) {
+        const int row = i / 2;
+        const float sign = (i % 2 == 0) ? 1.f : -1.f;
+        for (int c = 0; c < 4; c++) {
+            planes[i*4+c] = m[c*4+3] + sign * m[c*4+row];
+        }
+    }
+}
+
+/**
+ * 0: outside, 1: intersecting, 2: inside all planes
+ */
+static int testFrustum(const float* planes, const float* min, const float* max) {
+    int result = 2;
+    for (int i = 0; i < 6; i++) {
+        const float* p = &planes[i*4];
+        // 平面の法線の方向で最も遠い頂点と最も近い頂点
+        const float far_dist = p[0] * (p[0] >= 0 ? max[0] : min[0]) + p[1] * (p[1] >= 0 ? max[1] : min[1])
+            + p[2] * (p[2] >= 0 ? max[2] : min[2]) + p[3];
+        if (far_dist < 0) return 0;
+        const float near_dist = p[0] * (p[0] >= 0 ? min[0] : max[0]) + p[1] * (p[1] >= 0 ? min[1] : max[1])
+            + p[2] * (p[2] >= 0 ? min[2] : max[2]) + p[3];
+        if (near_dist < 0) result = 1;
+    }
+    return result;
+}
+
+/**
+ * work-stealing thread pool for the per-frame scene update (--jobs N).
+ * parallelFor() spreads its chunks evenly over the threads (the caller and
+ * N-1 workers); a thread that runs out of chunks steals the upper half of
+ * what another thread has left. one thread at a time may call parallelFor(),
+ * and with a single thread it runs inline.
+ */
+#define MAX_JOB_THREADS 64
+
+typedef void (*JobFunc)(void* data, int begin, int end, int chunk);
+
+struct JobRange {
+    pthread_mutex_t lock;
+    int generation; // どのparallelFor()の範囲か
+    int begin; // 次に実行するチャンク
+    int end;
+};
+
+struct JobPool {
+    int threads; // parallelFor()を実行するスレッドの数 (呼び出し元を含む)
+    int workers; // 起動したワーカースレッドの数
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int generation; // parallelFor()ごとに増える
+    JobFunc func;
+    void* data;
+    int count;
+    int grain; // 1チャンクの要素の数
+    int pending; // 終わっていないチャンクの数 (__atomicで読み書きする)
+    JobRange ranges[MAX_JOB_THREADS];
+};
+
+static JobPool gJobPool; // threadsが0と1: parallelFor()は呼び出し元だけで実行する
+static int gJobThreads = 0; // --jobs, 0: シーンの更新もGLのスレッドで行う
+static bool gJobSweep = false;
+
+/**
+ * the next chunk of parallelFor() "generation" for the thread in "slot":
+ * from its own range, or stolen from the others
+ */
+static bool jobTake(int slot, int generation, int* chunk) {
+    JobRange* own = &gJobPool.ranges[slot];
+    pthread_mutex_lock(&own->lock);
+    const bool found = own->generation == generation && own->begin < own->end;
+    if (found) *chunk = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (found) return true;
+
+    for (int k = 1; k < gJobPool.threads; k++) {
+        JobRange* victim = &gJobPool.ranges[(slot + k) % gJobPool.threads];
+        pthread_mutex_lock(&victim->lock);
+        const int left = (victim->generation == generation) ? victim->end - victim->begin : 0;
+        const int stolen = (left + 1) / 2;
+        victim->end -= stolen;
+        const int first = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen == 0) continue;
+
+        // 盗んだ残りは自分の範囲として他のスレッドにも盗ませる
+        pthread_mutex_lock(&own->lock);
+        own->generation = generation;
+        own->begin = first + 1;
+        own->end = first + stolen;
+        pthread_mutex_unlock(&own->lock);
+        *chunk = first;
+        return true;
+    }
+    return false;
+}
+
+static void jobRun(int slot, int generation, JobFunc func, void* data, int count, int grain) {
+    TRACE_SPAN("jobs");
+    int chunk;
+    while (jobTake(slot, generation, &chunk)) {
+        const int begin = chunk * grain;
+        func(data, begin, (count - begin < grain) ? count : begin + grain, chunk);
+        __atomic_sub_fetch(&gJobPool.pending, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void* jobWorker(void* arg) {
+    const int slot = (int)(intptr_t)arg;
+    int seen = 0;
+    traceThreadName("job");
+    pthread_mutex_lock(&gJobPool.lock);
+    for (;;) {
+        while (gJobPool.generation == seen) {
+            pthread_cond_wait(&gJobPool.wake, &gJobPool.lock);
+        }
+        seen = gJobPool.generation;
+        const bool active = slot < gJobPool.threads;
+        const JobFunc func = gJobPool.func;
+        void* data = gJobPool.data;
+        const int count = gJobPool.count;
+        const int grain = gJobPool.grain;
+        pthread_mutex_unlock(&gJobPool.lock);
+        if (active) jobRun(slot, seen, func, data, count, grain);
+        pthread_mutex_lock(&gJobPool.lock);
+    }
+    return NULL;
+}
+
+/**
+ * run the following parallelFor() calls on "threads" threads (including the
+ * caller). workers are started on demand and idle when not needed.
+ */
+static void setJobThreads(int threads) {
+    if (gJobPool.workers == 0) {
+        pthread_mutex_init(&gJobPool.lock, NULL);
+        pthread_cond_init(&gJobPool.wake, NULL);
+        for (int i = 0; i < MAX_JOB_THREADS; i++) {
+            pthread_mutex_init(&gJobPool.ranges[i].lock, NULL);
+        }
+    }
+    pthread_mutex_lock(&gJobPool.lock);
+    while (gJobPool.workers < threads - 1) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, jobWorker, (void*)(intptr_t)(gJobPool.workers + 1)) != 0) {
+            fprintf(stderr, "Could not start a job thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+        gJobPool.workers++;
+    }
+    gJobPool.threads = threads;
+    pthread_mutex_unlock(&gJobPool.lock);
+}
+
+/**
+ * func(data, begin, end, chunk) for the chunks of "grain" elements of
+ * [0, count). returns when all of them are done.
+ */
+static void parallelFor(int count, int grain, JobFunc func, void* data) {
+    const int chunks = (count + grain - 1) / grain;
+    if (gJobPool.threads <= 1 || chunks <= 1) {
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            const int begin = chunk * grain;
+            func(data, begin, (count - begin < grain) ? count : begin + grain, chunk);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&gJobPool.lock);
+    const int generation = ++gJobPool.generation;
+    const int threads = gJobPool.threads;
+    gJobPool.func = func;
+    gJobPool.data = data;
+    gJobPool.count = count;
+    gJobPool.grain = grain;
+    __atomic_store_n(&gJobPool.pending, chunks, __ATOMIC_RELEASE);
+    for (int slot = 0; slot < threads; slot++) {
+        JobRange* range = &gJobPool.ranges[slot];
+        pthread_mutex_lock(&range->lock);
+        range->generation = generation;
+        range->begin = chunks * slot / threads;
+        range->end = chunks * (slot + 1) / threads;
+        pthread_mutex_unlock(&range->lock);
+    }
+    pthread_cond_broadcast(&gJobPool.wake);
+    pthread_mutex_unlock(&gJobPool.lock);
+
+    jobRun(0, generation, func, data, count, grain);
+    // 他のスレッドが実行中のチャンクを待つ
+    while (__atomic_load_n(&gJobPool.pending, __ATOMIC_ACQUIRE) > 0) {
+        sched_yield();
+    }
+}
+
+/**
+ * incremental rendering (always in the window, --incremental in headless
+ * mode). pass1 redraws only the screen rectangle that moved instances left
+ * and entered, or everything after a camera change or a resize. the SSAO and
+ * lighting passes are scissored to that rectangle grown by the reach of the
+ * SSAO kernel, plus the screen bounds of the sphere of influence
+ * (in_light_dist.y) of every light that changed, before and after the change.
+ */
+struct ScreenRect {
+    int x0, y0, x1, y1; // [x0, x1) x [y0, y1) の画素, x0 >= x1: 空
+};
+
+static float gRenderedView[16]; // G-bufferを描いた時のカメラ
+static float gRenderedProj[16];
+static Lights gLitLights; // 最後に照らした時のライト
+static int gLitNumLights = 0;
+
+static const ScreenRect EMPTY_RECT = {0, 0, 0, 0};
+
+static ScreenRect fullRect() {
+    const ScreenRect rect = {0, 0, gWidth, gHeight};
+    return rect;
+}
+
+static bool rectEmpty(const ScreenRect& rect) {
+    return rect.x0 >= rect.x1 || rect.y0 >= rect.y1;
+}
+
+static bool rectFull(const ScreenRect& rect) {
+    return rect.x0 <= 0 && rect.y0 <= 0 && rect.x1 >= gWidth && rect.y1 >= gHeight;
+}
+
+/**
+ * whether "outer" covers "inner" (an empty rectangle is covered by any)
+ */
+static bool rectContains(const ScreenRect& outer, const ScreenRect& inner) {
+    return rectEmpty(inner) || (!rectEmpty(outer) && outer.x0 <= inner.x0 && outer.y0 <= inner.y0
+        && outer.x1 >= inner.x1 && outer.y1 >= inner.y1);
+}
+
+static double rectCoverage(const ScreenRect& rect) {
+    return rectEmpty(rect) ? 0.0 : (double)(rect.x1 - rect.x0) * (rect.y1 - rect.y0) / ((double)gWidth * gHeight);
+}
+
+static void rectUnion(ScreenRect* rect, const ScreenRect& other) {
+    if (rectEmpty(other)) return;
+    if (rectEmpty(*rect)) {
+        *rect = other;
+        return;
+    }
+    if (other.x0 < rect->x0) rect->x0 = other.x0;
+    if (other.y0 < rect->y0) rect->y0 = other.y0;
+    if (other.x1 > rect->x1) rect->x1 = other.x1;
+    if (other.y1 > rect->y1) rect->y1 = other.y1;
+}
+
+/**
+ * "rect" grown by "pixels" on every side and clipped to a width x height
+ * screen
+ */
+static ScreenRect rectGrow(const ScreenRect& rect, int pixels, int width, int height) {
+    if (rectEmpty(rect)) return EMPTY_RECT;
+    ScreenRect grown = {rect.x0 - pixels, rect.y0 - pixels, rect.x1 + pixels, rect.y1 + pixels};
+    if (grown.x0 < 0) grown.x0 = 0;
+    if (grown.y0 < 0) grown.y0 = 0;
+    if (grown.x1 > width) grown.x1 = width;
+    if (grown.y1 > height) grown.y1 = height;
+    return grown;
+}
+
+static ScreenRect rectGrow(const ScreenRect& rect, int pixels) {
+    return rectGrow(rect, pixels, gWidth, gHeight);
+}
+
+/**
+ * the camera and screen a render list is prepared for. the scene thread
+ * keeps its own copy while the GL thread goes on with the next frame.
+ */
+struct SceneView {
+    float view[16];
+    float proj[16];
+    float cam_pos[3];
+    int width;
+    int height;
+};
+
+static SceneView currentSceneView() {
+    SceneView view;
+    memcpy(view.view, gFrameData.view, sizeof(view.view));
+    memcpy(view.proj, gFrameData.proj, sizeof(view.proj));
+    memcpy(view.cam_pos, gCamPos, sizeof(view.cam_pos));
+    view.width = gWidth;
+    view.height = gHeight;
+    return view;
+}
+
+static bool sameSceneView(const SceneView& a, const SceneView& b) {
+    return memcmp(a.view, b.view, sizeof(a.view)) == 0 && memcmp(a.proj, b.proj, sizeof(a.proj)) == 0
+        && memcmp(a.cam_pos, b.cam_pos, sizeof(a.cam_pos)) == 0 && a.width == b.width && a.height == b.height;
+}
+
+/**
+ * screen rectangle covered by the world AABB min-max (the whole screen if the
+ * box reaches behind the near plane)
+ */
+static ScreenRect projectBounds(const SceneView& view, const float* min, const float* max) {
+    float m[16];
+    multiplyMatrix(m, view.view, view.proj);
+    float ndc_min[2] = {INFINITY, INFINITY};
+    float ndc_max[2] = {-INFINITY, -INFINITY};
+    for (int i = 0; i < 8; i++) {
+        const float p[3] = {(i & 1) ? max[0] : min[0], (i & 2) ? max[1] : min[1], (i & 4) ? max[2] : min[2]};
+        float clip[4];
+        for (int r = 0; r < 4; r++) {
+            clip[r] = m[r] * p[0] + m[4+r] * p[1] + m[8+r] * p[2] + m[12+r];
+        }
+        if (clip[3] < SCREEN_NEAR) {
+            const ScreenRect full = {0, 0, view.width, view.height};
+            return full;
+        }
+        for (int k = 0; k < 2; k++) {
+            ndc_min[k] = fminf(ndc_min[k], clip[k] / clip[3]);
+            ndc_max[k] = fmaxf(ndc_max[k], clip[k] / clip[3]);
+        }
+    }
+    // ラスタライズの丸めの分だけ1画素広げる
+    const ScreenRect rect = {
+        (int)floorf((ndc_min[0] * 0.5f + 0.5f) * view.width) - 1,
+        (int)floorf((ndc_min[1] * 0.5f + 0.5f) * view.height) - 1,
+        (int)ceilf((ndc_max[0] * 0.5f + 0.5f) * view.width) + 1,
+        (int)ceilf((ndc_max[1] * 0.5f + 0.5f) * view.height) + 1};
+    return rectGrow(rect, 0, view.width, view.height);
+}
+
+/**
+ * screen rectangle lit by light "index" of "lights"
+ */
+static ScreenRect projectLight(const Lights& lights, int index) {
+    float min[3], max[3];
+    for (int k = 0; k < 3; k++) {
+        min[k] = lights.pos[index*3+k] - lights.radius[index];
+        max[k] = lights.pos[index*3+k] + lights.radius[index];
+    }
+    return projectBounds(currentSceneView(), min, max);
+}
+
+/**
+ * the projection of "view" followed by the mapping of "rect" onto the whole
+ * clip space, so that its frustum only covers the rectangle
+ */
+static void cropProjection(float* out, const SceneView& view, const ScreenRect& rect) {
+    const float x0 = 2.f * rect.x0 / view.width - 1.f;
+    const float x1 = 2.f * rect.x1 / view.width - 1.f;
+    const float y0 = 2.f * rect.y0 / view.height - 1.f;
+    const float y1 = 2.f * rect.y1 / view.height - 1.f;
+    float crop[16] = {0};
+    crop[0] = 2.f / (x1 - x0);
+    crop[5] = 2.f / (y1 - y0);
+    crop[10] = 1.f;
+    crop[12] = -(x0 + x1) / (x1 - x0);
+    crop[13] = -(y0 + y1) / (y1 - y0);
+    crop[15] = 1.f;
+    multiplyMatrix(out, view.proj, crop);
+}
+
+/**
+ * the instances pass1 draws in one frame, with their model matrices grouped
+ * by mesh. there are two of them: with --jobs the scene thread moves, culls
+ * and groups the instances of frame N+1 into one while the GL thread submits
+ * frame N from the other, which it only reads.
+ */
+#define MOVE_CHUNKS 256
+#define MIN_MOVE_GRAIN 256
+#define GROUP_CHUNKS 64
+#define MIN_GROUP_GRAIN 1024
+#define MAX_CULL_LEVELS 10 // 並列にカリングする部分木は最大2^10個
+
+struct CullTask {
+    int node; // この部分木の物体はgScene.order[first, ...)に並んでいる
+    bool inside; // 視錐台の内側にあると分かっている
+    int count; // 見えた物体の数
+    int offset; // objectsでの位置
+};
+
+struct RenderList {
+    float* matrices; // 16 * count, メッシュごとにまとめたモデル行列
+    int* objects; // 描画するインスタンスの番号 (手前から)
+    int* visible; // 部分木ごとのカリングの結果 (部分木のorderの位置に書く)
+    int* chunk_offsets; // GROUP_CHUNKS * gNumMeshes, チャンクがメッシュごとに書き込む位置
+    int count;
+    GLuint mesh_first[MAX_MESHES];
+    GLuint mesh_count[MAX_MESHES];
+    CullTask tasks[1 << MAX_CULL_LEVELS];
+    int task_count;
+    ScreenRect move_rects[MOVE_CHUNKS];
+    float planes[24];
+    const float* source; // objectsの行列 (gScene.matricesかgInstanceMatrices)
+    SceneView view;
+    int frame; // 動かしたフレーム (-1: まだ)
+    ScreenRect moved; // 動いたインスタンスが元いた範囲と移った範囲
+    ScreenRect cull_rect; // この範囲に見えるインスタンスは全て入っている
+    int rebuilds; // それまでのBVHの再構築の回数
+    double prepare_ms; // 動かしてからまとめるまでの時間
+};
+
+static RenderList gRenderLists[2];
+static int gRenderListNext = 0; // 次のフレームで描画するリスト
+static int gBvhRebuilds = 0; // 最後に描画したリストのrebuilds
+
+static void initRenderList(RenderList* list) {
+    list->matrices = (float*)malloc(sizeof(float) * 16 * gNumInstances);
+    list->objects = (int*)malloc(sizeof(int) * gNumInstances);
+    list->visible = (int*)malloc(sizeof(int) * gNumInstances);
+    list->chunk_offsets = (int*)malloc(sizeof(int) * GROUP_CHUNKS * gNumMeshes);
+    if (!list->matrices || !list->objects || !list->visible || !list->chunk_offsets) {
+        fprintf(stderr, "Could not allocate the render list.\n");
+        exit(1);
+    }
+    list->count = 0;
+    list->frame = -1;
+    list->moved = EMPTY_RECT;
+    list->cull_rect = EMPTY_RECT;
+}
+
+static void moveChunk(void* data, int begin, int end, int chunk) {
+    RenderList* list = (RenderList*)data;
+    ScreenRect dirty = EMPTY_RECT;
+    for (int i = begin; i < end; i++) {
+        float mat[16];
+        memcpy(mat, &gScene.base_matrices[i * 16], sizeof(mat));
+        mat[13] += 0.5f * sinf(list->frame * 0.05f + i);
+        gScene.moved[i] = memcmp(mat, &gScene.matrices[i * 16], sizeof(mat)) != 0;
+        if (!gScene.moved[i]) continue;
+        rectUnion(&dirty, projectBounds(list->view, &gScene.bounds[i * 6], &gScene.bounds[i * 6 + 3]));
+        sceneMoveObject(i, mat);
+        rectUnion(&dirty, projectBounds(list->view, &gScene.bounds[i * 6], &gScene.bounds[i * 6 + 3]));
+    }
+    list->move_rects[chunk] = dirty;
+}
+
+/**
+ * move the --moving-instances instances to their place in "frame", refit the
+ * BVH and record in list->moved the screen rectangles they left and entered
+ */
+static void updateScene(RenderList* list, int frame, const SceneView& view) {
+    list->frame = frame;
+    list->view = view;
+    list->moved = EMPTY_RECT;
+    list->cull_rect = EMPTY_RECT;
+
+    const int moving = (gMovingInstances < gScene.count) ? gMovingInstances : gScene.count;
+    if (moving > 0) {
+        int grain = (moving + MOVE_CHUNKS - 1) / MOVE_CHUNKS;
+        if (grain < MIN_MOVE_GRAIN) grain = MIN_MOVE_GRAIN;
+        parallelFor(moving, grain, moveChunk, list);
+        for (int chunk = 0; chunk * grain < moving; chunk++) {
+            rectUnion(&list->moved, list->move_rects[chunk]);
+        }
+        // 祖先のノードは共有されているので、印付けと更新は1つのスレッドで行う
+        for (int i = 0; i < moving; i++) {
+            if (gScene.moved[i]) sceneMarkMoved(i);
+        }
+        bvhRefit();
+        if (gScene.area > BVH_REBUILD_RATIO * gScene.build_area) {
+            bvhRebuild();
+            gScene.rebuilds++;
+        }
+    }
+    list->rebuilds = gScene.rebuilds;
+}
+
+/**
+ * push the children of internal node "index" so that the one nearer to
+ * "cam_pos" is popped first (drawn front to back, more fragments fail the
+ * depth test)
+ */
+static int pushChildren(int* stack, int depth, int index, const float* cam_pos) {
+    const BvhNode* node = &gScene.nodes[index];
+    const BvhNode* left = &gScene.nodes[index + 1];
+    const BvhNode* right = &gScene.nodes[node->right];
+    float left_dist = 0.f;
+    float right_dist = 0.f;
+    for (int k = 0; k < 3; k++) {
+        const float l = (left->min[k] + left->max[k]) / 2.f - cam_pos[k];
+        const float r = (right->min[k] + right->max[k]) / 2.f - cam_pos[k];
+        left_dist += l * l;
+        right_dist += r * r;
+    }
+    const bool left_first = left_dist <= right_dist;
+    stack[depth++] = left_first ? node->right : index + 1;
+    stack[depth++] = left_first ? index + 1 : node->right;
+    return depth;
+}
+
+/**
+ * the top levels of the BVH, culled on one thread, into list->tasks in the
+ * order of a depth-first traversal, so that the concatenated results of the
+ * tasks are in the same order as culling the whole tree at once
+ */
+static void collectCullTasks(RenderList* list) {
+    int levels = 0;
+    while (levels < MAX_CULL_LEVELS && (1 << levels) < 8 * gJobPool.threads) levels++;
+
+    list->task_count = 0;
+    int stack[64];
+    bool stack_inside[64];
+    int stack_level[64];
+    int depth = 0;
+    stack[depth] = 0;
+    stack_inside[depth] = false;
+    stack_level[depth++] = 0;
+    while (depth > 0) {
+        const int index = stack[--depth];
+        const bool parent_inside = stack_inside[depth];
+        const int level = stack_level[depth];
+        const BvhNode* node = &gScene.nodes[index];
+        if (node->count > 0 || level == levels) {
+            CullTask* task = &list->tasks[list->task_count++];
+            task->node = index;
+            task->inside = parent_inside;
+            continue;
+        }
+        bool inside = parent_inside;
+        if (!inside) {
+            const int result = testFrustum(list->planes, node->min, node->max);
+            if (result == 0) continue;
+            inside = (result == 2);
+        }
+        const int pushed = pushChildren(stack, depth, index, list->view.cam_pos);
+        for (; depth < pushed; depth++) {
+            stack_inside[depth] = inside;
+            stack_level[depth] = level + 1;
+        }
+    }
+}
+
+static void cullChunk(void* data, int begin, int end, int /*chunk*/) {
+    RenderList* list = (RenderList*)data;
+    for (int t = begin; t < end; t++) {
+        CullTask* task = &list->tasks[t];
+        int* out = &list->visible[gScene.nodes[task->node].first];
+        int visible = 0;
+        int stack[64];
+        bool stack_inside[64];
+        int depth = 0;
+        stack[depth] = task->node;
+        stack_inside[depth++] = task->inside;
+        while (depth > 0) {
+            const int index = stack[--depth];
+            const BvhNode* node = &gScene.nodes[index];
+            bool inside = stack_inside[depth];
+            if (!inside) {
+                const int result = testFrustum(list->planes, node->min, node->max);
+                if (result == 0) continue;
+                inside = (result == 2); // 内側なら子孫は調べない
+            }
+            if (node->count == 0) {
+                const int pushed = pushChildren(stack, depth, index, list->view.cam_pos);
+                for (; depth < pushed; depth++) {
+                    stack_inside[depth] = inside;
+                }
+                continue;
+            }
+            for (int i = node->first; i < node->first + node->count; i++) {
+                const int object = gScene.order[i];
+                const float* b = &gScene.bounds[object * 6];
+                if (inside || testFrustum(list->planes, b, b + 3) != 0) {
+                    out[visible++] = object;
+                }
+            }
+        }
+        task->count = visible;
+    }
+}
+
+static void compactChunk(void* data, int begin, int end, int /*chunk*/) {
+    RenderList* list = (RenderList*)data;
+    for (int t = begin; t < end; t++) {
+        const CullTask* task = &list->tasks[t];
+        memcpy(&list->objects[task->offset], &list->visible[gScene.nodes[task->node].first],
+            sizeof(int) * task->count);
+    }
+}
+
+static void countChunk(void* data, int begin, int end, int chunk) {
+    RenderList* list = (RenderList*)data;
+    int* counts = &list->chunk_offsets[chunk * gNumMeshes];
+    for (int m = 0; m < gNumMeshes; m++) {
+        counts[m] = 0;
+    }
+    for (int i = begin; i < end; i++) {
+        counts[list->objects[i] % gNumMeshes]++;
+    }
+}
+
+static void scatterChunk(void* data, int begin, int end, int chunk) {
+    RenderList* list = (RenderList*)data;
+    int* offsets = &list->chunk_offsets[chunk * gNumMeshes];
+    for (int i = begin; i < end; i++) {
+        const int object = list->objects[i];
+        memcpy(&list->matrices[offsets[object % gNumMeshes]++ * 16], &list->source[object * 16],
+            sizeof(float) * 16);
+    }
+}
+
+/**
+ * copy the matrices of list->objects into list->matrices, grouped by mesh
+ * (instance i uses mesh i % gNumMeshes) with a counting sort whose chunks
+ * keep the order of the instances within every mesh
+ */
+static void groupByMesh(RenderList* list) {
+    int grain = (list->count + GROUP_CHUNKS - 1) / GROUP_CHUNKS;
+    if (grain < MIN_GROUP_GRAIN) grain = MIN_GROUP_GRAIN;
+    const int chunks = (list->count + grain - 1) / grain;
+    parallelFor(list->count, grain, countChunk, list);
+    GLuint first = 0;
+    for (int m = 0; m < gNumMeshes; m++) {
+        list->mesh_first[m] = first;
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            const int count = list->chunk_offsets[chunk * gNumMeshes + m];
+            list->chunk_offsets[chunk * gNumMeshes + m] = first;
+            first += count;
+        }
+        list->mesh_count[m] = first - list->mesh_first[m];
+    }
+    parallelFor(list->count, grain, scatterChunk, list);
+}
+
+/**
+ * cull the scene to the frustum of "rect" of list->view, roughly front to
+ * back, and group the visible instances by mesh
+ */
+static void buildRenderList(RenderList* list, const ScreenRect& rect) {
+    list->count = 0;
+    list->cull_rect = rect;
+    list->source = gScene.matrices;
+    if (!rectEmpty(rect)) {
+        // 描き直す範囲の外にあるインスタンスも除く
+        float proj[16];
+        cropProjection(proj, list->view, rect);
+        getFrustumPlanes(list->planes, proj, list->view.view);
+        collectCullTasks(list);
+        parallelFor(list->task_count, 1, cullChunk, list);
+        for (int t = 0; t < list->task_count; t++) {
+            list->tasks[t].offset = list->count;
+            list->count += list->tasks[t].count;
+        }
+        parallelFor(list->task_count, 1, compactChunk, list);
+    }
+    groupByMesh(list);
+}
+
+/**
+ * updateScene() and buildRenderList() for "frame". "crop" culls to the
+ * rectangle the moved instances touch, which is all pass1 redraws if the
+ * camera stays.
+ */
+static void prepareRenderList(RenderList* list, int frame, const SceneView& view, bool crop) {
+    TRACE_SPAN("prepare render list");
+    const double start = nowMs();
+    updateScene(list, frame, view);
+    const ScreenRect full = {0, 0, view.width, view.height};
+    buildRenderList(list, crop ? list->moved : full);
+    list->prepare_ms = nowMs() - start;
+}
+
+/**
+ * the scene thread of --jobs: prepares one render list at a time, given by
+ * kickRenderList()
+ */
+static pthread_mutex_t gSceneLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gSceneCond = PTHREAD_COND_INITIALIZER;
+static bool gSceneThreadStarted = false;
+static RenderList* gSceneJob = NULL; // 準備中のリスト
+static int gSceneJobFrame;
+static SceneView gSceneJobView;
+static bool gSceneJobCrop;
+
+static void* sceneThread(void*) {
+    traceThreadName("scene");
+    pthread_mutex_lock(&gSceneLock);
+    for (;;) {
+        while (gSceneJob == NULL) {
+            pthread_cond_wait(&gSceneCond, &gSceneLock);
+        }
+        RenderList* list = gSceneJob;
+        const int frame = gSceneJobFrame;
+        const SceneView view = gSceneJobView;
+        const bool crop = gSceneJobCrop;
+        pthread_mutex_unlock(&gSceneLock);
+        prepareRenderList(list, frame, view, crop);
+        pthread_mutex_lock(&gSceneLock);
+        gSceneJob = NULL;
+        pthread_cond_broadcast(&gSceneCond);
+    }
+    return NULL;
+}
+
+static void kickRenderList(RenderList* list, int frame, const SceneView& view, bool crop) {
+    if (!gSceneThreadStarted) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, sceneThread, NULL) != 0) {
+            fprintf(stderr, "Could not start the scene thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+        gSceneThreadStarted = true;
+    }
+    pthread_mutex_lock(&gSceneLock);
+    gSceneJob = list;
+    gSceneJobFrame = frame;
+    gSceneJobView = view;
+    gSceneJobCrop = crop;
+    pthread_cond_broadcast(&gSceneCond);
+    pthread_mutex_unlock(&gSceneLock);
+}
+
+/**
+ * wait until the scene thread is idle (it owns gScene and the pool while busy)
+ */
+static void waitRenderList() {
+    TRACE_SPAN("wait render list");
+    pthread_mutex_lock(&gSceneLock);
+    while (gSceneJob != NULL) {
+        pthread_cond_wait(&gSceneCond, &gSceneLock);
+    }
+    pthread_mutex_unlock(&gSceneLock);
+}
+
+/**
+ * the render list of the current frame (gTimerFrame), with the scene moved
+ * and list->moved set. the caller culls it again with buildRenderList() if
+ * pass1 redraws more than list->cull_rect.
+ */
+static RenderList* acquireRenderList() {
+    const SceneView view = currentSceneView();
+    if (!gFrustumCulling) {
+        // 配置は変わらないので1回だけ作る
+        RenderList* list = &gRenderLists[0];
+        if (list->frame < 0) {
+            const double t = nowMs();
+            gRandIndex = 0;
+            for (int i = 0; i < gNumInstances; i++) {
+                getInstanceMat(&gInstanceMatrices[i*16], i);
+                list->objects[i] = i;
+            }
+            list->count = gNumInstances;
+            list->source = gInstanceMatrices;
+            groupByMesh(list);
+            list->frame = 0;
+            timerCpu(TIMER_MATRIX, nowMs() - t);
+        }
+        list->view = view;
+        list->cull_rect = fullRect();
+        list->moved = EMPTY_RECT;
+        return list;
+    }
+
+    RenderList* list = &gRenderLists[gRenderListNext];
+    if (gJobThreads > 0) {
+        const double t = nowMs();
+        waitRenderList();
+        timerCpu(TIMER_WAIT, nowMs() - t);
+    }
+    if (list->frame != gTimerFrame) {
+        // 先に準備したフレームと違う (計測のやり直しなど)。動いた範囲が分からないので全体を描き直す
+        if (gJobThreads > 0 && list->frame >= 0) gGBufferValid = false;
+        const double t = nowMs();
+        updateScene(list, gTimerFrame, view);
+        list->prepare_ms = nowMs() - t;
+    } else if (!sameSceneView(list->view, view)) {
+        // カメラが動いたので全体を描き直し、カリングもやり直す
+        list->view = view;
+        list->cull_rect = EMPTY_RECT;
+    }
+    return list;
+}
+
+/**
+ * min/avg/max number of instances drawn over the last TIMER_HISTORY frames
+ */
+static void reportDrawCounts() {
+    const int n = gTimerFrame < TIMER_HISTORY ? gTimerFrame : TIMER_HISTORY;
+    if (!gFrustumCulling || n == 0) return;
+    int min = gDrawCounts[0];
+    int max = gDrawCounts[0];
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        if (gDrawCounts[i] < min) min = gDrawCounts[i];
+        if (gDrawCounts[i] > max) max = gDrawCounts[i];
+        sum += gDrawCounts[i];
+    }
+    printf("draws: min %d, avg %.1f, max %d of %d instances (BVH rebuilds: %d)\n",
+        min, sum / n, max, gScene.count, gBvhRebuilds);
+}
+
+/**
+ * sin() of |x| <= pi/2 for the kernels built at compile time
+ */
+static constexpr float constSin(float x) {
+    const float x2 = x * x;
+    return x * (1.f - x2 / 6.f * (1.f - x2 / 20.f * (1.f - x2 / 42.f * (1.f - x2 / 72.f * (1.f - x2 / 110.f)))));
+}
+
+static constexpr float constSqrt(float x) {
+    float r = x > 1.f ? x : 1.f;
+    for (int i = 0; i < 16; i++) {
+        r = 0.5f * (r + x / r);
+    }
+    return r;
+}
+
+/**
+ * offset of angle "theta" (0 to pi) at the radius of area fraction "u" of the
+ * 1 to 3 pixel annulus of SAMPLE_POINTS
+ */
+static constexpr void kernelPoint(float* point, float theta, float u) {
+    const float radius = constSqrt(1.f + 8.f * u);
+    const float half_pi = (float)M_PI / 2.f;
+    point[0] = radius * constSin(half_pi - theta);
+    point[1] = radius * constSin(theta < half_pi ? theta : (float)M_PI - theta);
+}
+
+/**
+ * --ao-kernel stratified|poisson kernel of "pairs" offsets on a half circle
+ * (-p is sampled as well). the stratified kernel puts pair i into angular
+ * stratum i and permutes the area strata by the radical inverse; the Poisson
+ * kernel takes the best of AO_KERNEL_CANDIDATES Halton candidates, the one
+ * farthest from the pairs chosen so far and from their mirrors.
+ */
+#define AO_KERNEL_CANDIDATES 16
+
+struct AoKernel {
+    float points[2*MAX_SAMPLE_POINTS];
+};
+
+static constexpr AoKernel makeAoKernel(int type, int pairs) {
+    AoKernel kernel = {};
+    for (int i = 0; i < pairs; i++) {
+        if (type == AO_KERNEL_STRATIFIED) {
+            const float stratum = radicalInverse(2, i) * pairs;
+            kernelPoint(&kernel.points[i*2], (float)M_PI * (i + 0.5f) / pairs,
+                ((int)stratum % pairs + 0.5f) / pairs);
+            continue;
+        }
+        float best = -1.f;
+        for (int c = 0; c < AO_KERNEL_CANDIDATES; c++) {
+            const int index = i * AO_KERNEL_CANDIDATES + c + 1;
+            float candidate[2] = {};
+            kernelPoint(candidate, (float)M_PI * radicalInverse(2, index), radicalInverse(3, index));
+            float nearest = INFINITY;
+            for (int k = 0; k < i; k++) {
+                for (int sign = -1; sign <= 1; sign += 2) {
+                    const float dx = candidate[0] - sign * kernel.points[k*2];
+                    const float dy = candidate[1] - sign * kernel.points[k*2+1];
+                    nearest = (dx*dx + dy*dy < nearest) ? dx*dx + dy*dy : nearest;
+                }
+            }
+            if (nearest > best) {
+                best = nearest;
+                kernel.points[i*2] = candidate[0];
+                kernel.points[i*2+1] = candidate[1];
+            }
+        }
+    }
+    return kernel;
+}
+
+/**
+ * the generated kernels of every quality tier, computed at compile time
+ */
+struct AoKernelTable {
+    AoKernel kernels[NUM_AO_KERNELS][NUM_QUALITY_TIERS];
+};
+
+static constexpr AoKernelTable makeAoKernelTable() {
+    AoKernelTable table = {};
+    for (int type = AO_KERNEL_STRATIFIED; type < NUM_AO_KERNELS; type++) {
+        for (int tier = 0; tier < NUM_QUALITY_TIERS; tier++) {
+            table.kernels[type][tier] = makeAoKernel(type, QUALITY_TIER_SAMPLES[tier]);
+        }
+    }
+    return table;
+}
+
+static constexpr AoKernelTable AO_KERNEL_TABLE = makeAoKernelTable();
+
+/**
+ * append "#define AO_TAPS" with one AO_TAP() per pair of the generated
+ * kernel, scaled by --ao-radius, to "defines"
+ */
+static void appendAoTaps(char* defines, size_t size, int type, int pairs) {
+    int tier = 0;
+    while (tier < NUM_QUALITY_TIERS && QUALITY_TIER_SAMPLES[tier] != pairs) tier++;
+    // 段階にないサンプル数 (--samples) のカーネルだけ実行時に作る
+    const AoKernel kernel = (tier < NUM_QUALITY_TIERS) ? AO_KERNEL_TABLE.kernels[type][tier] : makeAoKernel(type, pairs);
+    size_t length = strlen(defines);
+    length += snprintf(defines + length, size - length, "#define AO_TAPS");
+    for (int i = 0; i < pairs && length < size; i++) {
+        length += snprintf(defines + length, size - length, " AO_TAP(vec2(%.5f, %.5f))",
+            kernel.points[i*2] * gAoRadius, kernel.points[i*2+1] * gAoRadius);
+    }
+    if (length < size) snprintf(defines + length, size - length, "\n");
+}
+
+/**
+ * "count" SSAO kernel offsets (in pixels) from the Halton sequence starting at
+ * "index". only a half circle is needed because -p is sampled as well.
+ */
+static void fillSampleKernel(float* points, int count, int index) {
+    for (int i = 0; i < count; i++) {
+        const float theta = M_PI * halton(0, index + i);
+        const float radius = 1.f + 2.f * halton(1, index + i); // SAMPLE_POINTSと同じ1~3画素
+        points[i*4] = roundf(radius * cos(theta));
+        points[i*4+1] = roundf(radius * sin(theta));
+    }
+}
+
+/**
+ * fill FrameData from the camera, gLights and the SSAO kernel and upload it
+ * with a single buffer write
+ */
+static void updateFrameData() {
+    TRACE_SPAN("frame data");
+    getPerspectiveMatrix(gFrameData.proj, (float)gWidth / (float)gHeight, 60, SCREEN_NEAR, SCREEN_FAR);
+    getModelviewMatrix(gFrameData.view, gFrameData.normal_view, gCamPos[0], gCamPos[1], gCamPos[2], 0,0,0, 0,1,0);
+    memcpy(gFrameData.cam_pos, gCamPos, sizeof(gCamPos));
+    gFrameData.screen[0] = 1.f / gWidth;
+    gFrameData.screen[1] = 1.f / gHeight;
+    gFrameData.screen[2] = gWidth;
+    gFrameData.screen[3] = gHeight;
+    gFrameData.viewport[0] = (float)gRenderWidth / gWidth;
+    gFrameData.viewport[1] = (float)gRenderHeight / gHeight;
+    gFrameData.viewport[2] = gRenderWidth;
+    gFrameData.viewport[3] = gRenderHeight;
+
+    gFrameData.light_count[0] = gNumLights;
+    if (gTiledLights) {
+        // ライトの数がuniformに収まらないのでテクスチャで渡す
+        for (int i = 0; i < gNumLights; i++) {
+            memcpy(&gLightTexels[i*4], &gLights.pos[i*3], sizeof(float) * 3);
+            memcpy(&gLightTexels[(MAX_TILED_LIGHTS + i)*4], &gLights.power[i*3], sizeof(float) * 3);
+            gLightTexels[(2*MAX_TILED_LIGHTS + i)*4] = gLights.dist[i];
+            gLightTexels[(2*MAX_TILED_LIGHTS + i)*4 + 1] = gLights.radius[i];
+        }
+        stateEditTexture(gLightTexture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, MAX_TILED_LIGHTS);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gNumLights, 3, GL_RGBA, GL_FLOAT, gLightTexels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        traceCount(TRACE_UPLOAD_BYTES, sizeof(float) * 4 * 3 * gNumLights);
+    } else {
+        for (int i = 0; i < gNumLights; i++) {
+            memcpy(&gFrameData.light_pos[i*4], &gLights.pos[i*3], sizeof(float) * 3);
+            memcpy(&gFrameData.light_power[i*4], &gLights.power[i*3], sizeof(float) * 3);
+            gFrameData.light_dist[i*4] = gLights.dist[i];
+            gFrameData.light_dist[i*4+1] = gLights.radius[i];
+        }
+    }
+
+    if (gAoTemporal) {
+        // 毎フレーム別のHalton点でカーネルを作り直す
+        fillSampleKernel(gFrameData.sample_points, AO_TEMPORAL_SAMPLES, gAoFrame * AO_TEMPORAL_SAMPLES + 1);
+        gAoFrame++;
+
+        float inv_view[16];
+        invertRigidMatrix(inv_view, gFrameData.view);
+        if (gAoHistoryFrames == 0) {
+            memcpy(gPrevView, gFrameData.view, sizeof(gPrevView));
+        }
+        multiplyMatrix(gFrameData.reproject, inv_view, gPrevView);
+        memcpy(gPrevView, gFrameData.view, sizeof(gPrevView));
+
+        // 履歴が短いうちは単純平均、その後は指数移動平均
+        gAoHistoryFrames++;
+        gFrameData.ao_temporal[0] = fmaxf(1.f / gAoHistoryFrames, AO_TEMPORAL_ALPHA);
+    } else if (gNumSamples == NUM_SAMPLE_POINTS) {
+        for (int i = 0; i < NUM_SAMPLE_POINTS; i++) {
+            gFrameData.sample_points[i*4] = SAMPLE_POINTS[i*2];
+            gFrameData.sample_points[i*4+1] = SAMPLE_POINTS[i*2+1];
+        }
+    } else {
+        fillSampleKernel(gFrameData.sample_points, gNumSamples, 1);
+    }
+    gFrameData.ao_temporal[1] = gAoKernelRotation;
+    // 整数画素に丸めて、どのバックエンドでもテクセルの中心を読むようにする
+    for (int i = 0; i < MAX_SAMPLE_POINTS; i++) {
+        gFrameData.sample_points[i*4] = roundf(gFrameData.sample_points[i*4] * gAoRadius);
+        gFrameData.sample_points[i*4+1] = roundf(gFrameData.sample_points[i*4+1] * gAoRadius);
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameDataBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &gFrameData);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    traceCount(TRACE_UNIFORM_UPLOADS, 1);
+    traceCount(TRACE_UPLOAD_BYTES, sizeof(FrameData));
+}
+
+static void bindOutputFramebuffer() {
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gOutputFrameBuffer);
+    stateDrawBuffer(gOutputFrameBuffer ? GL_COLOR_ATTACHMENT0_EXT : (gDoubleBuffer ? GL_BACK : GL_FRONT));
+}
+
+/**
+ * upload the matrices of "list" and draw them in gDrawMode, every mesh from
+ * its contiguous range of the instance buffer
+ */
+static void submitRenderList(const RenderList* list) {
+    TRACE_SPAN("submit");
+    for (int m = 0; m < gNumMeshes; m++) {
+        gDrawCommands[m].instance_count = list->mesh_count[m];
+        gDrawCommands[m].base_instance = list->mesh_first[m];
+        traceCount(TRACE_TRIANGLES, (double)(gMeshes[m].index_count / 3) * list->mesh_count[m]);
+    }
+    const int instances = list->count;
+
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 16 * instances, list->matrices, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    traceCount(TRACE_UPLOAD_BYTES, sizeof(GLfloat) * 16 * instances);
+
+    stateBindVertexArray(gMeshVao);
+    gDrawCalls = 0;
+    if (gDrawMode == DRAW_INSTANCED && gNumMeshes == 1) {
+        glDrawElementsInstanced(GL_TRIANGLES, gMeshes[0].index_count, gMeshIndexType, 0, instances);
+        gDrawCalls = 1;
+    } else if (gDrawMode == DRAW_INDIRECT) {
+        int count = 0;
+        for (int m = 0; m < gNumMeshes; m++) {
+            if (gDrawCommands[m].instance_count == 0) continue;
+            DrawElementsIndirectCommand& command = gDrawCommands[count++];
+            command = gDrawCommands[m]; // 空のメッシュを詰める (count <= m)
+            command.count = gMeshes[m].index_count;
+            command.first_index = gMeshes[m].first_index;
+            command.base_vertex = gMeshes[m].base_vertex;
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * count, gDrawCommands,
+            GL_STREAM_DRAW);
+        traceCount(TRACE_UPLOAD_BYTES, sizeof(DrawElementsIndirectCommand) * count);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gMeshIndexType, 0, count, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        gDrawCalls = 1;
+    } else {
+        for (int m = 0; m < gNumMeshes; m++) {
+            const DrawElementsIndirectCommand& command = gDrawCommands[m];
+            if (command.instance_count == 0) continue;
+            const GLvoid* first_index = (const GLvoid*)((uintptr_t)gMeshes[m].first_index * gMeshIndexSize);
+            if (gDrawMode == DRAW_INSTANCED) {
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, gMeshes[m].index_count, gMeshIndexType,
+                    first_index, command.instance_count, gMeshes[m].base_vertex, command.base_instance);
+                gDrawCalls++;
+                continue;
+            }
+            for (GLuint i = 0; i < command.instance_count; i++) {
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, gMeshes[m].index_count, gMeshIndexType,
+                    first_index, 1, gMeshes[m].base_vertex, command.base_instance + i);
+            }
+            gDrawCalls += command.instance_count;
+        }
+    }
+    stateBindVertexArray(0);
+    traceCount(TRACE_DRAW_CALLS, gDrawCalls);
+}
+
+/**
+ * scissor the following passes to "rect" (no scissor test for the whole
+ * screen). "scale" divides the rectangle for a lower resolution target.
+ */
+static void setScissor(const ScreenRect& rect, int scale) {
+    if (rectFull(rect)) {
+        stateEnable(GL_SCISSOR_TEST, false);
+        return;
+    }
+    stateEnable(GL_SCISSOR_TEST, true);
+    const int x0 = rect.x0 / scale;
+    const int y0 = rect.y0 / scale;
+    glScissor(x0, y0, (rect.x1 + scale - 1) / scale - x0, (rect.y1 + scale - 1) / scale - y0);
+}
+
+/**
+ * geometory to texture, only inside "rect"
+ */
+static void draw_pass1(const ScreenRect& rect, const RenderList* list) {
+    stateUseProgram(gPass1Program.id);
+
+    glViewport(0,0,gRenderWidth,gRenderHeight);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gFrameBufferObject);
+
+    const GLenum bufs[] = {
+      (GLenum)(gPositionTexture ? GL_COLOR_ATTACHMENT0_EXT : GL_NONE), // COMPACTでは位置を持たない
+      GL_COLOR_ATTACHMENT1_EXT,
+      GL_COLOR_ATTACHMENT2_EXT,
+    };
+    stateDrawBuffers(3, bufs);
+
+    stateEnable(GL_DEPTH_TEST, true);
+    setScissor(rect, 1);
+    stateClearColor(0,0,0,0); // シェーダで背景画像とポリゴンを識別するため、意図的にalpha値を0にしておく
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    stateBindTexture(GL_TEXTURE0, gImg);
+
+    gDrawCounts[gTimerFrame % TIMER_HISTORY] = list->count;
+    gBvhRebuilds = list->rebuilds;
+
+    const double submit_start = nowMs();
+    submitRenderList(list);
+    timerCpu(TIMER_SUBMIT, nowMs() - submit_start);
+
+    glFlush();
+
+    bindOutputFramebuffer();
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in pass1: %d\n", err);
+    }
+}
+
+static void drawFullscreenQuad() {
+    const float vertexPointer[] = {
+            -1.0,  1.0,
+             1.0,  1.0,
+            -1.0, -1.0,
+             1.0, -1.0
+        };
+
+    const float texturePointer[] = {
+            0.0,  1.0,
+            1.0,  1.0,
+            0.0,  0.0,
+            1.0,  0.0
+        };
+
+    // vertex array 0の配列は有効のままにしておく (他の描画はgMeshVaoを使う)
+    stateBindVertexArray(0);
+    stateVertexAttribArray(0, true);
+    stateVertexAttribArray(2, true);
+
+    glVertexAttribPointer(0, 2, GL_FLOAT, 0, sizeof (GLfloat) * 2, vertexPointer);
+    glVertexAttribPointer(2, 2, GL_FLOAT, 0, sizeof (GLfloat) * 2, texturePointer);
+
+    glDrawArrays(GL_TRIANGLE_STRIP,0,4);
+    traceCount(TRACE_DRAW_CALLS, 1);
+    traceCount(TRACE_TRIANGLES, 2);
+}
+
+static void bindGBufferTextures() {
+    stateBindTexture(GL_TEXTURE0, gPositionTexture);
+
+    stateBindTexture(GL_TEXTURE1, gNormalTexture);
+
+    stateBindTexture(GL_TEXTURE2, gAlbedoTexture);
+
+    stateBindTexture(GL_TEXTURE9, gAoNoiseTexture); // SSAOはG-bufferと一緒に読む
+
+    stateBindTexture(GL_TEXTURE3, gDepthTexture);
+}
+
+/**
+ * build the Hi-Z pyramid in gHiZTexture from the G-buffer depth (only with gHiZ)
+ */
+static void draw_hiz_pass() {
+    stateUseProgram(gHiZProgram.id);
+    stateEnable(GL_SCISSOR_TEST, false);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gHiZFrameBuffer);
+    stateDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    stateEnable(GL_DEPTH_TEST, false);
+
+    stateBindTexture(GL_TEXTURE3, gDepthTexture);
+    stateBindTexture(GL_TEXTURE8, gHiZTexture);
+
+    for (int level = 0; level < gHiZLevels; level++) {
+        // 読むのは1つ上のレベルだけにして、書き込み先と重ならないようにする
+        const int src_level = level > 0 ? level - 1 : 0;
+        stateEditTexture(gHiZTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, src_level);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, src_level);
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gHiZTexture, level);
+
+        const int width = gRenderWidth >> level;
+        const int height = gRenderHeight >> level;
+        glViewport(0, 0, width > 0 ? width : 1, height > 0 ? height : 1);
+        glUniform1i(gHiZProgram.uniforms[U_HIZ_LEVEL], level);
+        traceCount(TRACE_UNIFORM_UPLOADS, 1);
+        drawFullscreenQuad();
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, gHiZLevels - 1);
+    glFlush();
+
+    bindOutputFramebuffer();
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in hiz pass: %d\n", err);
+    }
+}
+
+static int tileCountX() {
+    return (gRenderWidth + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static int tileCountY() {
+    return (gRenderHeight + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/**
+ * SSAO into gAoTexture (only when useAoPass()), inside "rect" unless it is
+ * computed in a compute shader
+ */
+static void draw_ao_pass(const ScreenRect& rect) {
+    if (gAoCompute) {
+        stateUseProgram(gAoProgram.id);
+        bindGBufferTextures();
+        glBindImageTexture(1, gAoTexture[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+
+        glDispatchCompute(tileCountX(), tileCountY(), 1);
+        traceCount(TRACE_TEXTURE_BINDS, 1); // イメージユニット
+        traceCount(TRACE_DRAW_CALLS, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+
+        int err = glGetError();
+        if (GL_NO_ERROR != err) {
+            printf("Check GL Error in ao pass (compute): %d\n", err);
+        }
+        return;
+    }
+
+    // temporal AOでは前のフレームの結果を履歴として読み、もう一方に書く
+    const int target = gAoTemporal ? 1 - gAoCurrent : 0;
+
+    stateUseProgram(gAoProgram.id);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gAoFrameBuffer[target]);
+    stateDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    glViewport(0,0,(gRenderWidth+gAoScale-1)/gAoScale,(gRenderHeight+gAoScale-1)/gAoScale);
+    setScissor(rect, gAoScale);
+
+    stateEnable(GL_DEPTH_TEST, false);
+
+    bindGBufferTextures();
+
+    stateBindTexture(GL_TEXTURE5, gAoTemporal ? gAoTexture[gAoCurrent] : 0);
+    stateBindTexture(GL_TEXTURE8, gHiZTexture);
+
+    drawFullscreenQuad();
+    glFlush();
+    gAoCurrent = target;
+
+    bindOutputFramebuffer();
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in ao pass: %d\n", err);
+    }
+}
+
+/**
+ * build the per-tile light lists in gTileLightTexture (only with gTiledLights)
+ */
+static void cull_lights() {
+    stateUseProgram(gCullProgram.id);
+
+    stateBindTexture(GL_TEXTURE3, gDepthTexture);
+    stateBindTexture(GL_TEXTURE6, gLightTexture);
+    glBindImageTexture(0, gTileLightTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32UI);
+
+    glDispatchCompute(tileCountX(), tileCountY(), 1);
+    traceCount(TRACE_TEXTURE_BINDS, 1); // イメージユニット
+    traceCount(TRACE_DRAW_CALLS, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT); // pass2でtexelFetchする前に書き込みを終える
+
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in light culling: %d\n", err);
+    }
+}
+
+/**
+ * extract geometory from texture. and render using it, only inside "rect".
+ */
+static void draw_pass2(const ScreenRect& rect) {
+    stateUseProgram(gPass2Program.id);
+    const bool scaled = gScaledFrameBuffer && (gRenderWidth != gWidth || gRenderHeight != gHeight);
+    if (scaled) {
+        // 内部解像度のまま照らし、最後に出力の大きさへ拡大する
+        stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gScaledFrameBuffer);
+        stateDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+        glViewport(0,0,gRenderWidth,gRenderHeight);
+    } else {
+        glViewport(0,0,gWidth,gHeight);
+    }
+    setScissor(rect, 1);
+
+    stateEnable(GL_DEPTH_TEST, false);
+    stateClearColor(0.0, 0.0, 0.0, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    bindGBufferTextures();
+
+    stateBindTexture(GL_TEXTURE4, gAoTexture[gAoCurrent]);
+    stateBindTexture(GL_TEXTURE8, gHiZTexture);
+
+    if (gTiledLights) {
+        stateBindTexture(GL_TEXTURE6, gLightTexture);
+        stateBindTexture(GL_TEXTURE7, gTileLightTexture);
+    }
+
+    drawFullscreenQuad();
+    if (scaled) {
+        stateBindFramebuffer(GL_READ_FRAMEBUFFER_EXT, gScaledFrameBuffer);
+        stateBindFramebuffer(GL_DRAW_FRAMEBUFFER_EXT, gOutputFrameBuffer);
+        glBlitFramebufferEXT(0, 0, gRenderWidth, gRenderHeight, 0, 0, gWidth, gHeight, GL_COLOR_BUFFER_BIT,
+            GL_LINEAR);
+        traceCount(TRACE_DRAW_CALLS, 1);
+        bindOutputFramebuffer();
+    }
+    glFlush();
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in pass2: %d\n", err);
+    }
+}
+
+static float angle = 0;
+static bool gAnimateLights = true; // false: angleの位置に置いたまま (--batch)
+static void updateLights() {
+    if (gAnimateLights) angle += 0.1f;
+    const float radius = 2;
+    gLights.pos[0] = radius * cos((((int)angle)%360)*M_PI/180.f);
+}
+
+/**
+ * frame pacing. --fps-cap sleeps until the next frame is due instead of
+ * spinning in idle(), and --on-demand only draws and presents the frames in
+ * which the scene or the lights changed (the animation still advances at the
+ * cap, ON_DEMAND_FPS by default). the frame intervals, their jitter and the
+ * CPU time of the process are reported with the pass timings.
+ */
+#define ON_DEMAND_FPS 60
+
+struct Pacer {
+    double next_ms; // 次のフレームを始める時刻
+    double last_ms; // 前のフレームを始めた時刻
+    double intervals[TIMER_HISTORY];
+    int count;
+    int frames;
+    int presented; // 描画したフレームの数
+    double report_ms; // 前のreportPacing()の時刻
+    double report_cpu_ms;
+};
+
+static Pacer gPacer;
+static bool gRedisplayPosted = false; // idle()からの再描画 (false: 隠れていた部分の再描画など)
+
+static double processCpuMs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0
+        + usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static double frameIntervalMs() {
+    const int fps = (gFrameRateCap > 0) ? gFrameRateCap : (gOnDemand ? ON_DEMAND_FPS : 0);
+    return fps > 0 ? 1000.0 / fps : 0.0;
+}
+
+/**
+ * sleep until the next frame is due and record the interval since the last one
+ */
+static void paceFrame() {
+    const double interval = frameIntervalMs();
+    if (interval > 0) {
+        if (gPacer.next_ms > nowMs()) {
+            TRACE_SPAN("sleep");
+            const long long ns = (long long)(gPacer.next_ms * 1e6);
+            struct timespec ts;
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+        // 遅れた分をまとめて取り戻すことはしない
+        gPacer.next_ms += interval;
+        if (gPacer.next_ms < nowMs()) gPacer.next_ms = nowMs() + interval;
+    }
+    const double now = nowMs();
+    if (gPacer.last_ms > 0) {
+        gPacer.intervals[gPacer.count % TIMER_HISTORY] = now - gPacer.last_ms;
+        gPacer.count++;
+    }
+    gPacer.last_ms = now;
+    gPacer.frames++;
+}
+
+/**
+ * interval, jitter (standard deviation) and CPU utilisation over the frames
+ * since the last report
+ */
+static void reportPacing() {
+    const double now = nowMs();
+    const double cpu_ms = processCpuMs();
+    const int n = gPacer.count < TIMER_HISTORY ? gPacer.count : TIMER_HISTORY;
+    if (n > 0 && gPacer.report_ms > 0) {
+        double min, avg, p99;
+        timerStats(gPacer.intervals, n, &min, &avg, &p99);
+        double variance = 0;
+        for (int i = 0; i < n; i++) {
+            variance += (gPacer.intervals[i] - avg) * (gPacer.intervals[i] - avg);
+        }
+        char mode[96];
+        snprintf(mode, sizeof(mode), "%s%s", gHeadless ? "offscreen"
+            : (gDoubleBuffer ? "double buffered" : "single buffered"), gOnDemand ? ", on demand" : "");
+        if (!gHeadless && gDoubleBuffer) {
+            snprintf(mode + strlen(mode), sizeof(mode) - strlen(mode), ", swap interval %d", gSwapInterval);
+        }
+        if (gFrameRateCap > 0) {
+            snprintf(mode + strlen(mode), sizeof(mode) - strlen(mode), ", cap %d fps", gFrameRateCap);
+        }
+        printf("pacing (%s): %d of %d frames drawn, interval avg %.2f ms, jitter %.2f ms, p99 %.2f ms, "
+            "cpu %.0f%%\n", mode, gPacer.presented, gPacer.frames, avg, sqrt(variance / n), p99,
+            100.0 * (cpu_ms - gPacer.report_cpu_ms) / (now - gPacer.report_ms));
+    }
+    gPacer.count = 0;
+    gPacer.frames = 0;
+    gPacer.presented = 0;
+    gPacer.report_ms = now;
+    gPacer.report_cpu_ms = cpu_ms;
+}
+
+/**
+ * dynamic resolution (--frame-budget). pass1, Hi-Z, AO and the light culling
+ * draw into the lower left gRenderWidth x gRenderHeight of the full size
+ * targets, and draw_pass2() upscales it to gWidth x gHeight. the scale follows
+ * the GPU time of the last measured frame: it drops as soon as the smoothed
+ * time exceeds the budget, but only rises after DRS_RAISE_FRAMES frames below
+ * DRS_HEADROOM of the budget, and no decision is taken until the frames drawn
+ * at the new scale have been measured.
+ */
+#define DRS_HEADROOM 0.8f // 予算に対してこれより軽いフレームが続けば解像度を上げる
+#define DRS_RAISE_FRAMES 30
+#define DRS_SETTLE_FRAMES (TIMER_LATENCY + 2) // 変えた後、新しい解像度の時間が届くまで
+#define DRS_SCALE_STEP 0.05f // 解像度の割合はこの刻みで選ぶ
+#define DRS_SMOOTHING 0.3f
+
+struct ResolutionController {
+    double frame_ms; // 平滑化したフレームの時間
+    int settle;
+    int below; // 余裕のあるフレームが続いた数
+    int changes;
+    int over_budget; // 予算を超えたフレームの数
+    int frames;
+    double scale_sum;
+};
+
+static ResolutionController gResolution;
+static FILE* gResolutionLog = NULL;
+
+/**
+ * render gScale of gWidth x gHeight from the next frame on
+ */
+static void setRenderScale(float scale) {
+    const int width = (int)(gWidth * scale + 0.5f);
+    const int height = (int)(gHeight * scale + 0.5f);
+    gRenderScale = scale;
+    if (width == gRenderWidth && height == gRenderHeight) return;
+    gRenderWidth = width > 0 ? width : 1;
+    gRenderHeight = height > 0 ? height : 1;
+    gGBufferValid = false;
+    gLightingValid = false;
+    gAoHistoryFrames = 0; // 前のフレームのAOは別の解像度
+}
+
+/**
+ * GPU time of the most recently measured frame (the wall time between frames
+ * without timer queries)
+ */
+static double lastFrameMs() {
+    if (!gTimerQueries) {
+        return gPacer.count > 0 ? gPacer.intervals[(gPacer.count - 1) % TIMER_HISTORY] : 0.0;
+    }
+    double sum = 0;
+    for (int i = 0; i < NUM_TIMERS; i++) {
+        const PassTimer& t = gTimers[i];
+        if (t.count > 0 && t.gpu_ms[(t.count - 1) % TIMER_HISTORY] > 0) {
+            sum += t.gpu_ms[(t.count - 1) % TIMER_HISTORY];
+        }
+    }
+    return sum;
+}
+
+/**
+ * choose the scale of this frame from the measured frame times
+ */
+static void updateRenderScale() {
+    if (gFrameBudget <= 0) return;
+    ResolutionController& r = gResolution;
+    const double measured = lastFrameMs();
+    r.frames++;
+    r.scale_sum += gRenderScale;
+    if (measured > gFrameBudget) r.over_budget++;
+    if (gResolutionLog) {
+        fprintf(gResolutionLog, "%d,%.2f,%d,%d,%.4f\n", gTimerFrame, gRenderScale, gRenderWidth, gRenderHeight,
+            measured);
+    }
+    if (r.settle > 0) {
+        r.settle--;
+        r.frame_ms = measured;
+        return;
+    }
+    r.frame_ms += DRS_SMOOTHING * (measured - r.frame_ms);
+
+    // 時間は画素数に比例するとみなし、予算と余裕の境界の中ほどを狙う
+    const double target = gFrameBudget * (1.0 + DRS_HEADROOM) / 2.0;
+    float scale = gRenderScale;
+    if (r.frame_ms > gFrameBudget) {
+        scale = floorf(gRenderScale * sqrt(target / r.frame_ms) / DRS_SCALE_STEP) * DRS_SCALE_STEP;
+        r.below = 0;
+    } else if (r.frame_ms < DRS_HEADROOM * gFrameBudget && gRenderScale < 1.f) {
+        if (++r.below < DRS_RAISE_FRAMES) return;
+        scale = floorf(gRenderScale * sqrt(target / r.frame_ms) / DRS_SCALE_STEP) * DRS_SCALE_STEP;
+        if (scale <= gRenderScale) scale = gRenderScale + DRS_SCALE_STEP;
+        r.below = 0;
+    } else {
+        r.below = 0;
+        return;
+    }
+    scale = fminf(1.f, fmaxf(gMinRenderScale, scale));
+    if (fabsf(scale - gRenderScale) < DRS_SCALE_STEP / 2) return;
+
+    printf("resolution: %.2f -> %.2f (%dx%d), frame %.2f ms, budget %.2f ms\n", gRenderScale, scale,
+        (int)(gWidth * scale + 0.5f), (int)(gHeight * scale + 0.5f), r.frame_ms, gFrameBudget);
+    setRenderScale(scale);
+    r.changes++;
+    r.settle = DRS_SETTLE_FRAMES;
+}
+
+/**
+ * scale statistics since the last report
+ */
+static void reportResolution() {
+    if (gFrameBudget <= 0) return;
+    ResolutionController& r = gResolution;
+    if (r.frames > 0) {
+        printf("dynamic resolution: budget %.2f ms, scale avg %.2f (now %.2f, %dx%d), %d changes, "
+            "%d of %d frames over budget\n", gFrameBudget, r.scale_sum / r.frames, gRenderScale, gRenderWidth,
+            gRenderHeight, r.changes, r.over_budget, r.frames);
+    }
+    r.frames = 0;
+    r.scale_sum = 0;
+    r.changes = 0;
+    r.over_budget = 0;
+    if (gResolutionLog) fflush(gResolutionLog);
+}
+
+/**
+ * set the swap interval of the current GLX drawable (0: no vsync, -1: late
+ * swaps tear if GLX_EXT_swap_control_tear is supported)
+ */
+static void setSwapInterval(int interval) {
+    typedef void (*SwapIntervalExtProc)(Display*, GLXDrawable, int);
+    typedef int (*SwapIntervalProc)(int);
+    const SwapIntervalExtProc swap_ext =
+        (SwapIntervalExtProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalEXT");
+    const SwapIntervalProc swap_mesa = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+    const SwapIntervalProc swap_sgi = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+    if (swap_ext && glXGetCurrentDrawable()) {
+        swap_ext(glXGetCurrentDisplay(), glXGetCurrentDrawable(), interval);
+    } else if (swap_mesa && interval >= 0) {
+        swap_mesa(interval);
+    } else if (swap_sgi && interval > 0) {
+        swap_sgi(interval); // SGIは0を受け付けない
+    } else {
+        printf("The swap interval %d is not supported\n", interval);
+        return;
+    }
+    printf("swap interval: %d\n", interval);
+}
+
+static void display(void) {
+    if (!gRedisplayPosted) {
+        gLightingValid = false; // ウィンドウが隠れていたかもしれないので画面全体を描き直す
+    }
+    gRedisplayPosted = false;
+    if (renderFrame()) {
+        TRACE_SPAN("present");
+        if (gDoubleBuffer) {
+            glutSwapBuffers();
+        } else {
+            glFlush();
+        }
+        gPacer.presented++;
+    }
+
+    if (gTimerFrame % TIMER_HISTORY == 0) {
+        timerReport();
+        reportDrawCounts();
+        reportPacing();
+        reportResolution();
+        reportGlState();
+    }
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in display(): %d\n", err);
+    }
+}
+
+static void idle(void) {
+    paceFrame();
+    gRedisplayPosted = true;
+    glutPostRedisplay();
+}
+
+static void reshape(int width, int height) {
+    if (width < 1 || height < 1 || (width == gWidth && height == gHeight)) return;
+    gWidth = width;
+    gHeight = height;
+    allocateRenderTargets();
+}
+
+/**
+ * 1-4: SSAO quality tier, +/-: double / halve the number of lights
+ */
+static void keyboard(unsigned char key, int /*x*/, int /*y*/) {
+    if (key >= '1' && key < '1' + NUM_QUALITY_TIERS) {
+        gNumSamples = QUALITY_TIER_SAMPLES[key - '1'];
+    } else if (key == '+' && gNumLights < (gTiledLights ? MAX_TILED_LIGHTS : MAX_LIGHTS)) {
+        // 倍にした結果が上限を越える場合は上限で止める (--lights 3 など)
+        const int limit = gTiledLights ? MAX_TILED_LIGHTS : MAX_LIGHTS;
+        gNumLights = (gNumLights * 2 < limit) ? gNumLights * 2 : limit;
+        initLights();
+    } else if (key == '-' && gNumLights > 1) {
+        gNumLights /= 2;
+        initLights();
+    } else {
+        return;
+    }
+    selectShaderVariant();
+    printf("samples: %d, lights: %d\n", gNumSamples, gNumLights);
+}
+
+static void printShaderInfoLog(GLuint shader) {
+    GLsizei bufSize;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH , &bufSize);
+    if (bufSize > 1) {
+        GLchar *infoLog;
+        infoLog = (GLchar *)malloc(bufSize);
+        if (infoLog != NULL) {
+            GLsizei length;
+            glGetShaderInfoLog(shader, bufSize, &length, infoLog);
+            fprintf(stderr, "InfoLog:\n%s\n\n", infoLog);
+            free(infoLog);
+        } else {
+            fprintf(stderr, "Could not allocate InfoLog buffer.\n");
+        }
+    }
+}
+
+static void printProgramInfoLog(GLuint program) {
+    GLsizei bufSize;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH , &bufSize);
+    if (bufSize > 1) {
+        GLchar *infoLog = (GLchar *)malloc(bufSize);
+        if (infoLog != NULL) {
+            GLsizei length;
+            glGetProgramInfoLog(program, bufSize, &length, infoLog);
+            fprintf(stderr, "InfoLog:\n%s\n\n", infoLog);
+            free(infoLog);
+        } else {
+            fprintf(stderr, "Could not allocate InfoLog buffer.\n");
+        }
+    }
+}
+
+/**
+ * set "source" to "shader" with "defines" inserted right after the #version line
+ */
+static void setShaderSource(GLuint shader, const GLchar* source, const GLchar* defines) {
+    const GLchar* body = strchr(source, '\n') + 1;
+    const GLchar* sources[] = {source, defines, body};
+    const GLint lengths[] = {(GLint)(body - source), (GLint)strlen(defines), (GLint)strlen(body)};
+    glShaderSource(shader, 3, sources, lengths);
+}
+
+/**
+ * compile and link a program from "count" shaders of the given types
+ */
+static GLuint compileProgram(const GLenum* types, const GLchar* const* sources, int count, int pass,
+        const GLchar* defines) {
+    GLuint program = glCreateProgram();
     GLint compiled, linked;
 
-    glCompileShader(vert);
-    glGetShaderiv(vert, GL_COMPILE_STATUS, &compiled);
-    if (compiled == GL_FALSE) {
-        printShaderInfoLog(vert);
+    for (int i = 0; i < count; i++) {
+        GLuint shader = glCreateShader(types[i]);
+        setShaderSource(shader, sources[i], defines);
+        glCompileShader(shader);
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (compiled == GL_FALSE) {
+            printShaderInfoLog(shader);
+            exit(1);
+        }
+        glAttachShader(program, shader);
+        glDeleteShader(shader);
+    }
+
+    if (pass == 1) {
+        glBindAttribLocation(program, 0, "in_Position");
+        glBindAttribLocation(program, 1, "in_Normal");
+        glBindAttribLocation(program, 2, "in_Texture_coord");
+        glBindAttribLocation(program, 3, "in_Model");
+    } else if (pass == 2) {
+        glBindAttribLocation(program, 0, "in_Position");
+        glBindAttribLocation(program, 2, "in_Texture_coord");
+    }
+
+    if (gShaderCacheDir) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked == GL_FALSE) {
+        printProgramInfoLog(program);
+        exit(1);
+    }
+    return program;
+}
+
+static unsigned long long hashString(unsigned long long hash, const char* str) {
+    // FNV-1a (終端の0も含めて区切りにする)
+    do {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    } while (*str++);
+    return hash;
+}
+
+/**
+ * cache file of a program. the key covers the sources, the defines and the
+ * driver, so a driver update never picks up an old binary.
+ */
+static void getProgramCachePath(char* path, size_t size, const GLchar* const* sources, int count,
+        int pass, const GLchar* defines) {
+    char pass_str[8];
+    snprintf(pass_str, sizeof(pass_str), "%d", pass);
+
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = hashString(hash, (const char*)glGetString(GL_VENDOR));
+    hash = hashString(hash, (const char*)glGetString(GL_RENDERER));
+    hash = hashString(hash, (const char*)glGetString(GL_VERSION));
+    hash = hashString(hash, pass_str);
+    hash = hashString(hash, defines);
+    for (int i = 0; i < count; i++) {
+        hash = hashString(hash, sources[i]);
+    }
+    snprintf(path, size, "%s/%016llx.bin", gShaderCacheDir, hash);
+}
+
+/**
+ * program from a cached binary, or 0 if there is none or the driver rejects it
+ */
+static GLuint loadProgramBinary(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    GLenum format = 0;
+    GLint length = 0;
+    void* binary = NULL;
+    if (fread(&format, sizeof(format), 1, fp) == 1 && fread(&length, sizeof(length), 1, fp) == 1
+            && length > 0) {
+        binary = malloc(length);
+        if (binary && fread(binary, 1, length, fp) != (size_t)length) {
+            free(binary);
+            binary = NULL;
+        }
+    }
+    fclose(fp);
+    if (binary == NULL) return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary, length);
+    free(binary);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked == GL_FALSE) {
+        // ドライバが受け付けなければソースからコンパイルし直す
+        glDeleteProgram(program);
+        while (glGetError() != GL_NO_ERROR) {}
+        return 0;
+    }
+    return program;
+}
+
+static void saveProgramBinary(GLuint program, const char* path) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    void* binary = malloc(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary);
+
+    // 他のプロセスが書きかけのファイルを読まないように、別名で書いてから置き換える
+    // (同時に動くバッチのワーカーと一時ファイルが重ならないようにmkstempで作る)
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    mkdir(gShaderCacheDir, 0755);
+    const int fd = mkstemp(tmp_path);
+    FILE* fp = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "Could not write shader cache %s\n", tmp_path);
+        if (fd >= 0) {
+            close(fd);
+            remove(tmp_path);
+        }
+        free(binary);
+        return;
+    }
+    fchmod(fd, 0644); // mkstempは0600で作る
+    const bool ok = fwrite(&format, sizeof(format), 1, fp) == 1
+        && fwrite(&length, sizeof(length), 1, fp) == 1
+        && fwrite(binary, 1, length, fp) == (size_t)length;
+    fclose(fp);
+    free(binary);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+    }
+}
+
+/**
+ * program from the binary cache in gShaderCacheDir if possible, otherwise
+ * compiled from source (and added to the cache)
+ */
+static Program loadProgram(const GLenum* types, const GLchar* const* sources, int count, int pass,
+        const GLchar* defines) {
+    char cache_path[512];
+    GLuint program = 0;
+    if (gShaderCacheDir) {
+        getProgramCachePath(cache_path, sizeof(cache_path), sources, count, pass, defines);
+        program = loadProgramBinary(cache_path);
+    }
+
+    if (program) {
+        gShaderCacheHits++;
+    } else {
+        program = compileProgram(types, sources, count, pass, defines);
+        if (gShaderCacheDir) {
+            gShaderCacheMisses++;
+            saveProgramBinary(program, cache_path);
+        }
+    }
+
+    // uniformの場所は毎フレーム問い合わせず、ここで一度だけ調べておく
+    Program result;
+    result.id = program;
+    for (int i = 0; i < NUM_UNIFORMS; i++) {
+        result.uniforms[i] = glGetUniformLocation(program, UNIFORM_NAMES[i]);
+    }
+
+    GLuint block = glGetUniformBlockIndex(program, "FrameData");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, FRAME_DATA_BINDING);
+    }
+
+    return result;
+}
+
+static Program loadShader(const GLchar* vertSource, const GLchar* fragSource, int pass,
+        const GLchar* defines) {
+    const GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    const GLchar* sources[] = {vertSource, fragSource};
+    return loadProgram(types, sources, 2, pass, defines);
+}
+
+static Program loadComputeShader(const GLchar* source, const GLchar* defines) {
+    const GLenum types[] = {GL_COMPUTE_SHADER};
+    return loadProgram(types, &source, 1, 0, defines);
+}
+
+/**
+ * reference implementations of the matrix helpers below, used by the
+ * --transform-bench self-check and by builds without SSE
+ */
+static void multiplyMatrixScalar(float* out, const float* src1, const float* src2) {
+    for (int i=0; i<16; i++) {
+        out[i] = 0;
+        const int src1_base = (i/4)*4; // 0->4->8->12
+        const int src2_base = i%4;
+        for (int j=0; j<4; j++) {
+            const int src1_index = src1_base + j;
+            const int src2_index = src2_base + j*4;
+            out[i] += (src1[src1_index]*src2[src2_index]);
+        }
+    }
+}
+
+/**
+ * normal matrix (inverse transpose of the upper 3x3) of "mat" as three vec4
+ * columns, the std140 layout of a mat3
+ */
+static void normalMatrixScalar(float* out, const float* mat) {
+    const float* c0 = &mat[0];
+    const float* c1 = &mat[4];
+    const float* c2 = &mat[8];
+    // 逆行列の行は列ベクトルどうしの外積を行列式で割ったもの
+    const float n[3][3] = {
+        {c1[1]*c2[2] - c1[2]*c2[1], c1[2]*c2[0] - c1[0]*c2[2], c1[0]*c2[1] - c1[1]*c2[0]},
+        {c2[1]*c0[2] - c2[2]*c0[1], c2[2]*c0[0] - c2[0]*c0[2], c2[0]*c0[1] - c2[1]*c0[0]},
+        {c0[1]*c1[2] - c0[2]*c1[1], c0[2]*c1[0] - c0[0]*c1[2], c0[0]*c1[1] - c0[1]*c1[0]},
+    };
+    const float inv_det = 1.f / (c0[0]*n[0][0] + c0[1]*n[0][1] + c0[2]*n[0][2]);
+    for (int c = 0; c < 3; c++) {
+        out[c*4] = n[c][0] * inv_det;
+        out[c*4+1] = n[c][1] * inv_det;
+        out[c*4+2] = n[c][2] * inv_det;
+        out[c*4+3] = 0.f;
+    }
+}
+
+/**
+ * 4x4 matrices (column major like GL) on SSE, and on AVX when built with it.
+ * multiplyMatrix(out, a, b) = b * a; "out" may alias either input.
+ */
+static void multiplyMatrix(float* out, const float* src1, const float* src2) {
+#if defined(__SSE2__)
+    const __m128 b0 = _mm_loadu_ps(&src2[0]);
+    const __m128 b1 = _mm_loadu_ps(&src2[4]);
+    const __m128 b2 = _mm_loadu_ps(&src2[8]);
+    const __m128 b3 = _mm_loadu_ps(&src2[12]);
+    for (int c = 0; c < 4; c++) {
+        // outの列c = src2 * (src1の列c)
+        __m128 r = _mm_mul_ps(b0, _mm_set1_ps(src1[c*4]));
+        r = _mm_add_ps(r, _mm_mul_ps(b1, _mm_set1_ps(src1[c*4+1])));
+        r = _mm_add_ps(r, _mm_mul_ps(b2, _mm_set1_ps(src1[c*4+2])));
+        r = _mm_add_ps(r, _mm_mul_ps(b3, _mm_set1_ps(src1[c*4+3])));
+        _mm_storeu_ps(&out[c*4], r);
+    }
+#else
+    float tmp[16];
+    multiplyMatrixScalar(tmp, src1, src2);
+    memcpy(out, tmp, sizeof(tmp));
+#endif
+}
+
+/**
+ * out[i] = mat * mats[i] for "count" matrices, e.g. the model-view-projection
+ * matrices of an array of model matrices. "out" must not overlap "mats".
+ */
+static void multiplyMatrixBatch(float* out, const float* mats, int count, const float* mat) {
+#if defined(__AVX__)
+    // 2列ずつ256bitで計算する
+    const __m256 b0 = _mm256_broadcast_ps((const __m128*)&mat[0]);
+    const __m256 b1 = _mm256_broadcast_ps((const __m128*)&mat[4]);
+    const __m256 b2 = _mm256_broadcast_ps((const __m128*)&mat[8]);
+    const __m256 b3 = _mm256_broadcast_ps((const __m128*)&mat[12]);
+    for (size_t i = 0; i < (size_t)count * 16; i += 8) {
+        const float* a = &mats[i];
+        __m256 r = _mm256_mul_ps(b0, _mm256_set_m128(_mm_set1_ps(a[4]), _mm_set1_ps(a[0])));
+        r = _mm256_add_ps(r, _mm256_mul_ps(b1, _mm256_set_m128(_mm_set1_ps(a[5]), _mm_set1_ps(a[1]))));
+        r = _mm256_add_ps(r, _mm256_mul_ps(b2, _mm256_set_m128(_mm_set1_ps(a[6]), _mm_set1_ps(a[2]))));
+        r = _mm256_add_ps(r, _mm256_mul_ps(b3, _mm256_set_m128(_mm_set1_ps(a[7]), _mm_set1_ps(a[3]))));
+        _mm256_storeu_ps(&out[i], r);
+    }
+#elif defined(__SSE2__)
+    const __m128 b0 = _mm_loadu_ps(&mat[0]);
+    const __m128 b1 = _mm_loadu_ps(&mat[4]);
+    const __m128 b2 = _mm_loadu_ps(&mat[8]);
+    const __m128 b3 = _mm_loadu_ps(&mat[12]);
+    for (size_t i = 0; i < (size_t)count * 16; i += 4) {
+        const float* a = &mats[i];
+        __m128 r = _mm_mul_ps(b0, _mm_set1_ps(a[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(b1, _mm_set1_ps(a[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(b2, _mm_set1_ps(a[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(b3, _mm_set1_ps(a[3])));
+        _mm_storeu_ps(&out[i], r);
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        multiplyMatrixScalar(&out[i*16], &mats[i*16], mat);
+    }
+#endif
+}
+
+#if defined(__SSE2__)
+static inline __m128 cross4(__m128 ay, __m128 az, __m128 by, __m128 bz) {
+    return _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+}
+#endif
+
+/**
+ * normalMatrixScalar() of "count" matrices into 12 floats each. four
+ * matrices at a time are transposed so that every SSE lane holds one matrix.
+ */
+static void normalMatrixBatch(float* out, const float* mats, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        const float* m = &mats[i*16];
+        __m128 col[3][4]; // col[c][k]: 列cのk成分 (レーンごとに別の行列)
+        for (int c = 0; c < 3; c++) {
+            col[c][0] = _mm_loadu_ps(&m[c*4]);
+            col[c][1] = _mm_loadu_ps(&m[16 + c*4]);
+            col[c][2] = _mm_loadu_ps(&m[32 + c*4]);
+            col[c][3] = _mm_loadu_ps(&m[48 + c*4]);
+            _MM_TRANSPOSE4_PS(col[c][0], col[c][1], col[c][2], col[c][3]);
+        }
+        __m128 n[3][4];
+        for (int c = 0; c < 3; c++) {
+            const __m128* a = col[(c + 1) % 3];
+            const __m128* b = col[(c + 2) % 3];
+            n[c][0] = cross4(a[1], a[2], b[1], b[2]);
+            n[c][1] = cross4(a[2], a[0], b[2], b[0]);
+            n[c][2] = cross4(a[0], a[1], b[0], b[1]);
+        }
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(col[0][0], n[0][0]), _mm_mul_ps(col[0][1], n[0][1])),
+            _mm_mul_ps(col[0][2], n[0][2]));
+        const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+        for (int c = 0; c < 3; c++) {
+            n[c][0] = _mm_mul_ps(n[c][0], inv_det);
+            n[c][1] = _mm_mul_ps(n[c][1], inv_det);
+            n[c][2] = _mm_mul_ps(n[c][2], inv_det);
+            n[c][3] = _mm_setzero_ps();
+            _MM_TRANSPOSE4_PS(n[c][0], n[c][1], n[c][2], n[c][3]);
+            for (int k = 0; k < 4; k++) {
+                _mm_storeu_ps(&out[(i + k) * 12 + c*4], n[c][k]);
+            }
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        normalMatrixScalar(&out[(size_t)i * 12], &mats[(size_t)i * 16]);
+    }
+}
+
+static void getPerspectiveMatrix(float* proj, float aspect,
+        int fovy, float near, float far) {
+    const float f = 1.0f / (float) tan(fovy * (M_PI / 360.0f));
+    const float rangeReciprocal = 1.0f / (near - far);
+
+    proj[0] = f / aspect;
+    proj[1] = 0.0f;
+    proj[2] = 0.0f;
+    proj[3] = 0.0f;
+
+    proj[4] = 0.0f;
+    proj[5] = f;
+    proj[6] = 0.0f;
+    proj[7] = 0.0f;
+
+    proj[8] = 0.0f;
+    proj[9] = 0.0f;
+    proj[10] = (far + near) * rangeReciprocal;
+    proj[11] = -1.0f;
+
+    proj[12] = 0.0f;
+    proj[13] = 0.0f;
+    proj[14] = 2.0f * far * near * rangeReciprocal;
+    proj[15] = 0.0f;
+}
+
+static void getModelviewMatrix(float* modelview, float* normalview,
+        float ex, float ey, float ez,
+        float ax, float ay, float az,
+        float ux, float uy, float uz) {
+    float fx = ax - ex;
+    float fy = ay - ey;
+    float fz = az - ez;
+
+    // Normalize f
+    float rlf = 1.0f / sqrtf(fx * fx + fy * fy + fz * fz);
+    fx *= rlf;
+    fy *= rlf;
+    fz *= rlf;
+
+    // compute s = f x_ up (x_ means "cross product")
+    float sx = fy * uz - fz * uy;
+    float sy = fz * ux - fx * uz;
+    float sz = fx * uy - fy * ux;
+
+    // and normalize s
+    float rls = 1.0f / sqrtf(sx * sx + sy * sy + sz * sz);
+    sx *= rls;
+    sy *= rls;
+    sz *= rls;
+
+    // compute u = s x_ f
+    float upx = sy * fz - sz * fy;
+    float upy = sz * fx - sx * fz;
+    float upz = sx * fy - sy * fx;
+
+    const float rote[16] = {
+            sx, upx, -fx, 0,
+            sy, upy, -fy, 0,
+            sz, upz, -fz, 0,
+             0,   0,   0, 1
+        };
+    if (normalview) memcpy(normalview, rote, sizeof(rote));
+
+    const float move[16] = {
+             1,   0,   0, 0,
+             0,   1,   0, 0,
+             0,   0,   1, 0,
+           -ex, -ey, -ez, 1
+        };
+
+    multiplyMatrix(modelview, rote, move);
+}
+
+/**
+ * inverse of a rotation + translation matrix (e.g. a modelview matrix)
+ */
+static void invertRigidMatrix(float* out, const float* src) {
+    // 回転部分は転置、平行移動は -R^T * t
+    for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < 3; r++) {
+            out[c*4 + r] = src[r*4 + c];
+        }
+        out[c*4 + 3] = 0;
+    }
+    for (int r = 0; r < 3; r++) {
+        out[12 + r] = -(out[r] * src[12] + out[4 + r] * src[13] + out[8 + r] * src[14]);
+    }
+    out[15] = 1;
+}
+
+/**
+ * check the GL version needed by gDrawMode (every mode with --draw-sweep)
+ * and create the indirect command buffer
+ */
+static void initDrawMode() {
+    const bool base_instance = gDrawSweep || gDrawMode == DRAW_LOOP || gNumMeshes > 1;
+    if (base_instance && !(GLEW_VERSION_4_2 || GLEW_ARB_base_instance)) {
+        fprintf(stderr, "--box-variants, several --mesh files and --draw-mode loop need GL 4.2 base instance\n");
+        exit(1);
+    }
+    if ((gDrawSweep || gDrawMode == DRAW_INDIRECT) && !(GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect)) {
+        fprintf(stderr, "--draw-mode indirect needs GL 4.3 multi draw indirect\n");
+        exit(1);
+    }
+    glGenBuffers(1, &gIndirectBuffer);
+}
+
+/**
+ * place gNumLights lights (in view space). light 0 is the original light
+ * behind the camera (moved by updateLights()), the others are small fill
+ * lights of radius FILL_LIGHT_RADIUS scattered in front of the boxes.
+ */
+static void initLights() {
+    const int count = (gNumLights < MAX_TILED_LIGHTS) ? gNumLights : MAX_TILED_LIGHTS; // gLightsの大きさ
+    for (int i = 0; i < count; i++) {
+        if (i == 0) {
+            gLights.pos[0] = 0.0;
+            gLights.pos[1] = 0.0;
+            gLights.pos[2] = 1.0;
+        } else {
+            gLights.pos[i*3] = 6.f * (halton(5, i) - 0.5f);
+            gLights.pos[i*3+1] = 6.f * (halton(6, i) - 0.5f);
+            gLights.pos[i*3+2] = -4.f + 3.f * halton(7, i);
+        }
+
+        gLights.dist[i] = (i == 0) ? 3.5 : FILL_LIGHT_RADIUS / 4;
+        // 補助光は影響範囲がFILL_LIGHT_RADIUSになる出力にする
+        const float power = (i == 0) ? 1.f : LIGHT_CUTOFF * 16;
+        gLights.power[i*3] = power;
+        gLights.power[i*3+1] = power;
+        gLights.power[i*3+2] = power;
+
+        // power * (dist / r)^2 = LIGHT_CUTOFF となる距離
+        gLights.radius[i] = gLights.dist[i] * sqrtf(power / LIGHT_CUTOFF);
+    }
+}
+
+static void initPass1Shader() {
+    stateUseProgram(gPass1Program.id);
+    glUniform1i(gPass1Program.uniforms[U_IMG], 0);
+
+    // Positionテクスチャの用意 (COMPACTではデプスから復元するので作らない)
+    if (gGBufferLayout != GBUFFER_COMPACT) {
+        glGenTextures(1, &gPositionTexture);
+        stateEditTexture(gPositionTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        stateEditTexture(0);
+    }
+
+    // Normalテクスチャの用意
+    glGenTextures(1, &gNormalTexture);
+    stateEditTexture(gNormalTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    stateEditTexture(0);
+
+    // Albedoテクスチャの用意
+    glGenTextures(1, &gAlbedoTexture);
+    stateEditTexture(gAlbedoTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    stateEditTexture(0);
+
+    // テクスチャマッピングのテクスチャを用意(単純画像のため1画素のみ)
+    const uint8_t img[] = {255, 255, 255, 255};
+    glGenTextures(1, &gImg);
+    stateEditTexture(gImg);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    stateEditTexture(0);
+
+    // テクスチャをフレームバッファに関連付ける
+    glGenFramebuffersEXT(1, &gFrameBufferObject);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gFrameBufferObject);
+
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gPositionTexture, 0);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT1_EXT, GL_TEXTURE_2D, gNormalTexture, 0);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT2_EXT, GL_TEXTURE_2D, gAlbedoTexture, 0);
+
+    // デプスバッファの用意 (COMPACTで位置を復元するためテクスチャとして持つ)
+    glGenTextures(1, &gDepthTexture);
+    stateEditTexture(gDepthTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+    stateEditTexture(0);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, gDepthTexture, 0);
+
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, 0);
+
+    initGeometry();
+    initDrawMode();
+    initRenderList(&gRenderLists[0]);
+    if (gFrustumCulling) {
+        initScene();
+        initRenderList(&gRenderLists[1]);
+    }
+    initLights();
+
+    glGenBuffers(1, &gFrameDataBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameDataBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, gFrameDataBuffer);
+}
+
+/**
+ * target textures and FBOs of draw_ao_pass(). their storage is specified by
+ * allocateRenderTargets().
+ */
+static void initAoPass() {
+    for (int i = 0; i < (gAoTemporal ? 2 : 1); i++) {
+        glGenTextures(1, &gAoTexture[i]);
+        stateEditTexture(gAoTexture[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        stateEditTexture(0);
+
+        glGenFramebuffersEXT(1, &gAoFrameBuffer[i]);
+        stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gAoFrameBuffer[i]);
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gAoTexture[i], 0);
+    }
+
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, 0);
+}
+
+static void requireComputeShaders(const char* feature) {
+    if (!(GLEW_VERSION_4_3 || GLEW_ARB_compute_shader)) {
+        fprintf(stderr, "%s needs compute shader support\n", feature);
+        exit(1);
+    }
+}
+
+/**
+ * program and textures of cull_lights(). needs compute shaders (GL 4.3).
+ */
+static void initLightCulling() {
+    requireComputeShaders("Tiled light culling");
+
+    gCullProgram = loadComputeShader(TILE_CULL_COMP_SHADER, gShaderDefines);
+    stateUseProgram(gCullProgram.id);
+    glUniform1i(gCullProgram.uniforms[U_DEPTH_IMG], 3);
+    glUniform1i(gCullProgram.uniforms[U_LIGHT_IMG], 6);
+    glUniform1i(gCullProgram.uniforms[U_TILE_LIGHTS_OUT], 0);
+    stateUseProgram(0);
+
+    glGenTextures(1, &gLightTexture);
+    stateEditTexture(gLightTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT32_ATI, MAX_TILED_LIGHTS, 3, 0, GL_RGBA, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &gTileLightTexture);
+    stateEditTexture(gTileLightTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    stateEditTexture(0);
+}
+
+/**
+ * program, texture and FBO of draw_hiz_pass()
+ */
+static void initHiZPass() {
+    gHiZProgram = loadShader(PASS2_VERT_SHADER, HIZ_FRAG_SHADER, 2, gShaderDefines);
+    stateUseProgram(gHiZProgram.id);
+    glUniform1i(gHiZProgram.uniforms[U_DEPTH_IMG], 3);
+    glUniform1i(gHiZProgram.uniforms[U_HIZ_IMG], 8);
+    stateUseProgram(0);
+
+    glGenTextures(1, &gHiZTexture);
+    stateEditTexture(gHiZTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    stateEditTexture(0);
+
+    glGenFramebuffersEXT(1, &gHiZFrameBuffer);
+}
+
+/**
+ * --ao-noise tiled: a 4x4 Bayer matrix of kernel rotations, repeated over the
+ * screen
+ */
+static void initAoNoise() {
+    static const int BAYER[AO_NOISE_SIZE * AO_NOISE_SIZE] = {
+        0, 8, 2, 10,
+        12, 4, 14, 6,
+        3, 11, 1, 9,
+        15, 7, 13, 5,
+    };
+    float texels[AO_NOISE_SIZE * AO_NOISE_SIZE];
+    for (int i = 0; i < AO_NOISE_SIZE * AO_NOISE_SIZE; i++) {
+        texels[i] = (BAYER[i] + 0.5f) / (AO_NOISE_SIZE * AO_NOISE_SIZE);
+    }
+
+    glGenTextures(1, &gAoNoiseTexture);
+    stateEditTexture(gAoNoiseTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, AO_NOISE_SIZE, AO_NOISE_SIZE, 0, GL_RED, GL_FLOAT, texels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    stateEditTexture(0);
+}
+
+static void checkFramebuffer(GLuint fbo, const char* name) {
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, fbo);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Failed to initialize %s\n", name);
+        exit(1);
+    }
+}
+
+/**
+ * (re)specify the storage of every render target for gWidth x gHeight.
+ * the texture names stay the same, so the FBO attachments stay valid.
+ */
+static void allocateRenderTargets() {
+    gGBufferValid = false; // 中身は未定義になる
+    if (gPositionTexture) {
+        stateEditTexture(gPositionTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT32_ATI, gWidth, gHeight, 0, GL_RGBA, GL_FLOAT, 0);
+    }
+
+    stateEditTexture(gNormalTexture);
+    if (gGBufferLayout == GBUFFER_COMPACT) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, gWidth, gHeight, 0, GL_RG, GL_FLOAT, 0);
+    } else {
+        const GLint format = (gGBufferLayout == GBUFFER_HALF) ? RGBA_FLOAT16_ATI : RGBA_FLOAT32_ATI;
+        glTexImage2D(GL_TEXTURE_2D, 0, format, gWidth, gHeight, 0, GL_RGBA, GL_FLOAT, 0);
+    }
+
+    stateEditTexture(gAlbedoTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gWidth, gHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+    stateEditTexture(gDepthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, gWidth, gHeight, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    checkFramebuffer(gFrameBufferObject, "FBO");
+
+    for (int i = 0; i < 2; i++) {
+        if (gAoTexture[i] == 0) continue;
+        stateEditTexture(gAoTexture[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT16_ATI,
+            (gWidth+gAoScale-1)/gAoScale, (gHeight+gAoScale-1)/gAoScale, 0, GL_RGBA, GL_FLOAT, 0);
+        checkFramebuffer(gAoFrameBuffer[i], "AO FBO");
+    }
+
+    if (gHiZTexture) {
+        stateEditTexture(gHiZTexture);
+        gHiZLevels = 0;
+        for (int size = gWidth > gHeight ? gWidth : gHeight; size > 0; size >>= 1) {
+            const int width = gWidth >> gHiZLevels;
+            const int height = gHeight >> gHiZLevels;
+            glTexImage2D(GL_TEXTURE_2D, gHiZLevels, GL_R32F, width > 0 ? width : 1, height > 0 ? height : 1, 0,
+                GL_RED, GL_FLOAT, 0);
+            gHiZLevels++;
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, gHiZLevels - 1);
+        stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gHiZFrameBuffer);
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gHiZTexture, 0);
+        checkFramebuffer(gHiZFrameBuffer, "Hi-Z FBO");
+    }
+
+    if (gTileLightTexture) {
+        stateEditTexture(gTileLightTexture);
+        const int tiles_x = (gWidth + TILE_SIZE - 1) / TILE_SIZE;
+        const int tiles_y = (gHeight + TILE_SIZE - 1) / TILE_SIZE;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, tiles_x * TILE_SIZE, tiles_y * TILE_SIZE, 0,
+            GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+    }
+
+    if (gOutputTexture) {
+        stateEditTexture(gOutputTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT32_ATI, gWidth, gHeight, 0, GL_RGBA, GL_FLOAT, 0);
+        checkFramebuffer(gOutputFrameBuffer, "output FBO");
+    }
+
+    if (gScaledTexture) {
+        stateEditTexture(gScaledTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT16_ATI, gWidth, gHeight, 0, GL_RGBA, GL_FLOAT, 0);
+        checkFramebuffer(gScaledFrameBuffer, "scaled FBO");
+    }
+
+    stateEditTexture(0);
+    bindOutputFramebuffer();
+
+    // 解像度が変わると履歴は使えない
+    gAoHistoryFrames = 0;
+    setRenderScale(gRenderScale);
+}
+
+/**
+ * compile the pass2 and (if used) AO programs of "variant" on top of gShaderDefines
+ */
+static void compileShaderVariant(ShaderVariant* variant) {
+    const bool ao_pass = gAoScale > 1 || gAoTemporal || variant->ao_compute;
+    char defines[2048];
+    snprintf(defines, sizeof(defines),
+        "%s"
+        "#define AO_PASS %d\n"
+        "#define AO_SAMPLES %d\n"
+        "#define AO_KERNEL %d\n"
+        "#define AO_NOISE %d\n"
+        "#define NUM_LIGHTS %d\n"
+        "#define TILED_LIGHTS %d\n",
+        gShaderDefines, ao_pass ? 1 : 0, variant->samples, variant->kernel, variant->noise, variant->lights,
+        variant->tiled ? 1 : 0);
+    if (variant->kernel != AO_KERNEL_FIXED) {
+        appendAoTaps(defines, sizeof(defines), variant->kernel, variant->samples);
+    }
+
+    variant->pass2 = loadShader(PASS2_VERT_SHADER, PASS2_FRAG_SHADER, 2, defines);
+    stateUseProgram(variant->pass2.id);
+    glUniform1i(variant->pass2.uniforms[U_POSITION_IMG], 0);
+    glUniform1i(variant->pass2.uniforms[U_NORMAL_IMG], 1);
+    glUniform1i(variant->pass2.uniforms[U_ALBEDO_IMG], 2);
+    glUniform1i(variant->pass2.uniforms[U_DEPTH_IMG], 3);
+    glUniform1i(variant->pass2.uniforms[U_AO_IMG], 4);
+    glUniform1i(variant->pass2.uniforms[U_LIGHT_IMG], 6);
+    glUniform1i(variant->pass2.uniforms[U_TILE_LIGHTS_IMG], 7);
+    glUniform1i(variant->pass2.uniforms[U_HIZ_IMG], 8);
+    glUniform1i(variant->pass2.uniforms[U_AO_NOISE_IMG], 9);
+
+    memset(&variant->ao, 0, sizeof(variant->ao));
+    if (variant->ao_compute) {
+        const size_t length = strlen(defines);
+        snprintf(defines + length, sizeof(defines) - length, "#define AO_APRON %d\n", aoApron());
+        variant->ao = loadComputeShader(AO_COMP_SHADER, defines);
+        stateUseProgram(variant->ao.id);
+        glUniform1i(variant->ao.uniforms[U_POSITION_IMG], 0);
+        glUniform1i(variant->ao.uniforms[U_NORMAL_IMG], 1);
+        glUniform1i(variant->ao.uniforms[U_DEPTH_IMG], 3);
+        glUniform1i(variant->ao.uniforms[U_AO_OUT], 1);
+        glUniform1i(variant->ao.uniforms[U_AO_NOISE_IMG], 9);
+    } else if (ao_pass) {
+        variant->ao = loadShader(PASS2_VERT_SHADER, AO_FRAG_SHADER, 2, defines);
+        stateUseProgram(variant->ao.id);
+        glUniform1i(variant->ao.uniforms[U_POSITION_IMG], 0);
+        glUniform1i(variant->ao.uniforms[U_NORMAL_IMG], 1);
+        glUniform1i(variant->ao.uniforms[U_DEPTH_IMG], 3);
+        glUniform1i(variant->ao.uniforms[U_AO_HISTORY_IMG], 5);
+        glUniform1i(variant->ao.uniforms[U_HIZ_IMG], 8);
+        glUniform1i(variant->ao.uniforms[U_AO_NOISE_IMG], 9);
+    }
+    stateUseProgram(0);
+}
+
+/**
+ * the variant for (samples, lights, tiled, gAoCompute, gAoKernel, gAoNoise, gHiZ). it is compiled on the
+ * first request and taken from gShaderVariants afterwards. tiled variants read
+ * the light count from FrameData, so they are shared by all light counts.
+ */
+static ShaderVariant* getShaderVariant(int samples, int lights, bool tiled) {
+    if (tiled) lights = 0;
+    for (int i = 0; i < gNumShaderVariants; i++) {
+        const ShaderVariant& v = gShaderVariants[i];
+        if (v.samples == samples && v.lights == lights && v.tiled == tiled && v.ao_compute == gAoCompute
+                && v.kernel == gAoKernel && v.noise == gAoNoise && v.hiz == gHiZ) {
+            return &gShaderVariants[i];
+        }
+    }
+
+    if (gNumShaderVariants == MAX_SHADER_VARIANTS) {
+        fprintf(stderr, "Too many shader variants\n");
+        exit(1);
+    }
+
+    ShaderVariant* variant = &gShaderVariants[gNumShaderVariants++];
+    variant->samples = samples;
+    variant->lights = lights;
+    variant->tiled = tiled;
+    variant->ao_compute = gAoCompute;
+    variant->kernel = gAoKernel;
+    variant->noise = gAoNoise;
+    variant->hiz = gHiZ;
+
+    const double t = nowMs();
+    compileShaderVariant(variant);
+    char backend[96];
+    snprintf(backend, sizeof(backend), "%s", gAoCompute ? ", compute AO" : "");
+    if (gAoKernel != AO_KERNEL_FIXED) {
+        snprintf(backend + strlen(backend), sizeof(backend) - strlen(backend), ", %s kernel, %s rotation",
+            AO_KERNEL_NAMES[gAoKernel], AO_NOISE_NAMES[gAoNoise]);
+    }
+    if (tiled) {
+        printf("shader variant (samples: %d, tiled lights%s) compiled in %.1f ms\n", samples, backend, nowMs() - t);
+    } else {
+        printf("shader variant (samples: %d, lights: %d%s) compiled in %.1f ms\n", samples, lights, backend,
+            nowMs() - t);
+    }
+    return variant;
+}
+
+/**
+ * use the variant of gNumSamples / gNumLights / gTiledLights / gAoCompute / gAoKernel / gAoNoise in
+ * draw_ao_pass() and draw_pass2()
+ */
+static void selectShaderVariant() {
+    const ShaderVariant* variant =
+        getShaderVariant(gAoTemporal ? AO_TEMPORAL_SAMPLES : gNumSamples, gNumLights, gTiledLights);
+    gPass2Program = variant->pass2;
+    gAoProgram = variant->ao;
+    gLightingValid = false; // SSAOのサンプル数やライトの数が変わった
+}
+
+static void buildShaderDefines() {
+    snprintf(gShaderDefines, sizeof(gShaderDefines),
+        GBUFFER_DEFINES
+        "#define GBUFFER_LAYOUT %d\n"
+        "#define AO_SCALE %d\n"
+        "#define AO_TEMPORAL %d\n"
+        "#define HIZ %d\n",
+        gGBufferLayout, gAoScale, gAoTemporal ? 1 : 0, gHiZ ? 1 : 0);
+}
+
+/**
+ * G-buffer memory per pixel including depth
+ */
+static int gbufferBytesPerPixel() {
+    switch (gGBufferLayout) {
+    case GBUFFER_HALF: return 16 + 8 + 4 + 4;
+    case GBUFFER_COMPACT: return 4 + 4 + 4;
+    default: return 16 + 16 + 4 + 4;
+    }
+}
+
+/**
+ * bytes draw_pass2() fetches per pixel: the position (or depth) of the pixel and
+ * of the 2*gNumSamples SSAO samples, plus one normal and one albedo.
+ * with a separate AO pass the SSAO samples are replaced by 4 RGBA16F AO taps.
+ */
+static int pass2BytesPerPixel() {
+    const int samples = useAoPass() ? 1 : (1 + 2*gNumSamples);
+    const int ao = useAoPass() ? ((gAoScale > 1) ? 4 : 1) * 8 : 0;
+    switch (gGBufferLayout) {
+    case GBUFFER_HALF: return 16 * samples + 8 + 4 + ao;
+    case GBUFFER_COMPACT: return 4 * samples + 4 + 4 + ao;
+    default: return 16 * samples + 16 + 4 + ao;
+    }
+}
+
+/**
+ * ヘッドレス実行時にdraw_pass2()の描画先となるFBO
+ */
+static void initOutputFramebuffer() {
+    glGenTextures(1, &gOutputTexture);
+    stateEditTexture(gOutputTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    stateEditTexture(0);
+
+    glGenFramebuffersEXT(1, &gOutputFrameBuffer);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gOutputFrameBuffer);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gOutputTexture, 0);
+    stateDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+}
+
+/**
+ * target of draw_pass2() below the full resolution (only with --frame-budget)
+ */
+static void initScaledFramebuffer() {
+    glGenTextures(1, &gScaledTexture);
+    stateEditTexture(gScaledTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    stateEditTexture(0);
+
+    glGenFramebuffersEXT(1, &gScaledFrameBuffer);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gScaledFrameBuffer);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gScaledTexture, 0);
+    stateDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+}
+
+/**
+ * write RGBA float pixels (bottom-up rows, as returned by glReadPixels).
+ * "*.pfm" is written as a little-endian PFM, anything else as binary PPM.
+ */
+static bool writeImage(const char* path, int width, int height, const float* rgba) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    const size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".pfm") == 0) {
+        // PFMは下の行から格納するのでglReadPixelsの並びのまま書き出す
+        fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+        for (int i = 0; i < width*height; i++) {
+            fwrite(&rgba[i*4], sizeof(float), 3, fp);
+        }
+    } else {
+        fprintf(fp, "P6\n%d %d\n255\n", width, height);
+        for (int y = height-1; y >= 0; y--) {
+            for (int x = 0; x < width; x++) {
+                const float* px = &rgba[(y*width + x)*4];
+                for (int c = 0; c < 3; c++) {
+                    float v = px[c] < 0.f ? 0.f : (px[c] > 1.f ? 1.f : px[c]);
+                    fputc((int)(v * 255.f + 0.5f), fp);
+                }
+            }
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+/**
+ * create a surfaceless EGL context (no window system required, e.g. Mesa llvmpipe)
+ */
+static void initHeadlessContext() {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        fprintf(stderr, "Failed to initialize EGL: 0x%x\n", eglGetError());
+        exit(1);
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "Failed to bind OpenGL API: 0x%x\n", eglGetError());
+        exit(1);
+    }
+
+    // 描画先は全てFBOなのでconfigもsurfaceも不要
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Failed to create EGL context: 0x%x\n", eglGetError());
+        exit(1);
+    }
+
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        fprintf(stderr, "Failed to make EGL context current: 0x%x\n", eglGetError());
+        exit(1);
+    }
+
+    // glewInit()はGLXのdisplayを要求するため、GL関数の取得のみ行う
+    glewExperimental = GL_TRUE;
+    int err = glewContextInit();
+    if (err != GLEW_OK) {
+        fprintf(stderr, "Failed to initialize glew: %d\n", err);
+        exit(1);
+    }
+
+    printf("GL_RENDERER: %s\n", glGetString(GL_RENDERER));
+    printf("GL_VERSION: %s\n", glGetString(GL_VERSION));
+}
+
+/**
+ * the rectangles that pass1 ("gbuffer") and the SSAO / lighting passes
+ * ("lighting") have to redraw this frame after the instances touched "moved",
+ * and remember what they will show
+ */
+static void findDirtyRects(const ScreenRect& moved, ScreenRect* gbuffer, ScreenRect* lighting) {
+    if (!gIncremental) {
+        *gbuffer = fullRect();
+        *lighting = fullRect();
+        return;
+    }
+
+    if (!gGBufferValid || memcmp(gRenderedView, gFrameData.view, sizeof(gRenderedView)) != 0
+            || memcmp(gRenderedProj, gFrameData.proj, sizeof(gRenderedProj)) != 0) {
+        memcpy(gRenderedView, gFrameData.view, sizeof(gRenderedView));
+        memcpy(gRenderedProj, gFrameData.proj, sizeof(gRenderedProj));
+        gGBufferValid = true;
+        gLightingValid = false;
+        *gbuffer = fullRect();
+    } else {
+        *gbuffer = moved;
+    }
+
+    // temporal AOは毎フレーム変わり、Hi-Zの粗いレベルは遠くの変化も拾う
+    if (!gLightingValid || gNumLights != gLitNumLights || gAoTemporal || (gHiZ && !rectEmpty(*gbuffer))) {
+        memcpy(&gLitLights, &gLights, sizeof(gLitLights));
+        gLitNumLights = gNumLights;
+        gLightingValid = true;
+        *lighting = fullRect();
+        return;
+    }
+    // 周囲のSSAOが読む範囲と、低解像度のAOを補間する範囲を含める
+    *lighting = rectGrow(*gbuffer, (aoApron() + 2) * gAoScale);
+    for (int i = 0; i < gNumLights; i++) {
+        if (memcmp(&gLitLights.pos[i*3], &gLights.pos[i*3], sizeof(float) * 3) == 0
+                && memcmp(&gLitLights.power[i*3], &gLights.power[i*3], sizeof(float) * 3) == 0
+                && gLitLights.dist[i] == gLights.dist[i] && gLitLights.radius[i] == gLights.radius[i]) {
+            continue;
+        }
+        rectUnion(lighting, projectLight(gLitLights, i));
+        rectUnion(lighting, projectLight(gLights, i));
+        memcpy(&gLitLights.pos[i*3], &gLights.pos[i*3], sizeof(float) * 3);
+        memcpy(&gLitLights.power[i*3], &gLights.power[i*3], sizeof(float) * 3);
+        gLitLights.dist[i] = gLights.dist[i];
+        gLitLights.radius[i] = gLights.radius[i];
+    }
+    if (gOutputFrameBuffer == 0 && gDoubleBuffer && !rectEmpty(*lighting)) {
+        // スワップした後のバックバッファの内容は不定なので、表示するなら全体を照らす
+        *lighting = fullRect();
+    }
+}
+
+/**
+ * one timed frame. with gIncremental only the dirty rectangles are redrawn,
+ * and a frame in which nothing changed draws nothing (returns false).
+ */
+static bool renderFrame() {
+    TRACE_SPAN("frame");
+    updateRenderScale();
+    updateLights();
+    updateFrameData();
+
+    RenderList* list = acquireRenderList();
+    ScreenRect gbuffer, lighting;
+    findDirtyRects(list->moved, &gbuffer, &lighting);
+    if (gFrustumCulling) {
+        const double t = nowMs();
+        if (!rectContains(list->cull_rect, gbuffer)) {
+            buildRenderList(list, gbuffer);
+        }
+        timerCpu(TIMER_FRUSTUM, list->prepare_ms + nowMs() - t);
+        if (gJobThreads > 0) {
+            // 次のフレームも同じカメラなら、pass1は動いた範囲だけを描き直す
+            gRenderListNext = 1 - gRenderListNext;
+            kickRenderList(&gRenderLists[gRenderListNext], gTimerFrame + 1, currentSceneView(),
+                gIncremental && gGBufferValid);
+        }
+    }
+
+    if (!rectEmpty(gbuffer)) {
+        timerBegin(TIMER_PASS1);
+        draw_pass1(gbuffer, list);
+        timerEnd(TIMER_PASS1);
+        gPass1Frames++;
+        gPass1Coverage += rectCoverage(gbuffer);
+
+        if (gHiZ) {
+            timerBegin(TIMER_HIZ);
+            draw_hiz_pass();
+            timerEnd(TIMER_HIZ);
+        }
+    }
+
+    // AOはG-bufferが変わった範囲だけ (compute shaderでは全体を) 計算し直す
+    const ScreenRect ao = (gAoTemporal || rectFull(lighting)) ? lighting
+        : rectGrow(gbuffer, (aoApron() + 1) * gAoScale);
+    if (useAoPass() && !rectEmpty(ao)) {
+        timerBegin(TIMER_AO);
+        draw_ao_pass(ao);
+        timerEnd(TIMER_AO);
+    }
+
+    if (!rectEmpty(lighting)) {
+        if (gTiledLights) {
+            timerBegin(TIMER_CULL);
+            cull_lights();
+            timerEnd(TIMER_CULL);
+        }
+
+        timerBegin(TIMER_PASS2);
+        draw_pass2(lighting);
+        timerEnd(TIMER_PASS2);
+        gPass2Frames++;
+        gPass2Coverage += rectCoverage(lighting);
+    }
+    stateEnable(GL_SCISSOR_TEST, false);
+
+    timerFrameEnd();
+    return !rectEmpty(gbuffer) || !rectEmpty(lighting);
+}
+
+/**
+ * average and maximum length of the tile light lists written by the last
+ * cull_lights()
+ */
+static double averageTileLights(int* max_lights) {
+    const int stride = (gWidth + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE; // 確保した大きさ
+    const int width = tileCountX() * TILE_SIZE;
+    const int height = tileCountY() * TILE_SIZE;
+    GLuint* lists = (GLuint*)malloc(sizeof(GLuint) * stride * ((gHeight + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE));
+    stateEditTexture(gTileLightTexture);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, lists);
+    stateEditTexture(0);
+
+    double sum = 0;
+    *max_lights = 0;
+    for (int y = 0; y < height; y += TILE_SIZE) {
+        for (int x = 0; x < width; x += TILE_SIZE) {
+            const int count = lists[y * stride + x];
+            sum += count;
+            if (count > *max_lights) *max_lights = count;
+        }
+    }
+    free(lists);
+    return sum / (tileCountX() * tileCountY());
+}
+
+/**
+ * render gBenchFrames frames for the sweeps, after one frame that is not
+ * timed. the timers then hold the averages of the configuration.
+ */
+static void benchFrames() {
+    renderFrame(); // シェーダのJITを計測から除外する
+    glFinish();
+    timerFlush();
+    timerReset();
+    for (int i = 0; i < gBenchFrames; i++) {
+        renderFrame();
+    }
+    glFinish();
+    timerFlush();
+}
+
+/**
+ * lighting cost from 1 to MAX_TILED_LIGHTS lights, tiled and (up to
+ * MAX_LIGHTS) with the plain per-pixel loop over all lights. the cost is
+ * cull + pass2, since llvmpipe charges the deferred pass2 work partly to
+ * the query of the compute dispatch.
+ */
+static void runLightSweep() {
+    printf("%8s %-7s %14s %16s\n", "lights", "culling", "lighting(ms)", "lights/tile avg/max");
+    for (int n = 1; n <= MAX_TILED_LIGHTS; n *= 4) {
+        for (int tiled = 0; tiled < 2; tiled++) {
+            if (!tiled && n > MAX_LIGHTS) continue;
+            gNumLights = n;
+            gTiledLights = tiled;
+            initLights();
+            selectShaderVariant();
+
+            benchFrames();
+
+            if (tiled) {
+                int max_lights;
+                const double avg_lights = averageTileLights(&max_lights);
+                printf("%8d %-7s %14.3f %12.1f/%d\n", n, "tiled",
+                    timerAverage(TIMER_CULL) + timerAverage(TIMER_PASS2), avg_lights, max_lights);
+            } else {
+                printf("%8d %-7s %14.3f %12d/%d\n", n, "none", timerAverage(TIMER_PASS2), n, n);
+            }
+        }
+    }
+}
+
+/**
+ * RGBA float pixels of the last headless frame (bottom-up rows, free() them)
+ */
+static float* readOutputPixels() {
+    float* pixels = (float*)malloc(sizeof(float) * 4 * gWidth * gHeight);
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gOutputFrameBuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    glReadPixels(0, 0, gWidth, gHeight, GL_RGBA, GL_FLOAT, pixels);
+    return pixels;
+}
+
+/**
+ * frame recorder (--record). every headless frame is read back as RGBA8 into
+ * a ring of gReadbackBuffers pixel buffer objects, each with a fence. frame
+ * N is only mapped when its buffer comes round again, i.e. while the next
+ * frames render, and a writer thread streams it to disk as PPM files (a
+ * pattern with one %[0][width]d such as out%04d.ppm) or as one Y4M video
+ * (*.y4m, 4:4:4). with no buffers glReadPixels reads straight into memory
+ * and waits for the frame to finish.
+ */
+#define MAX_READBACK_BUFFERS 4
+#define RECORD_QUEUE_SIZE 8 // 書き出しを待てるフレームの数
+#define RECORD_PATH_SIZE 1024
+
+/**
+ * a PPM file name pattern split around its frame number
+ */
+struct RecordPattern {
+    char prefix[RECORD_PATH_SIZE]; // 番号の前 ("%%"は"%"にしてある)
+    char suffix[RECORD_PATH_SIZE]; // 番号の後
+    int width; // 番号の最小の桁数
+    bool zero_pad;
+};
+
+static RecordPattern gRecordPattern;
+
+/**
+ * split a --record pattern at its one %[0][width]d conversion ("%%" is a
+ * literal %). false for any other conversion or more than one number.
+ */
+static bool parseRecordPattern(const char* pattern, RecordPattern* out) {
+    memset(out, 0, sizeof(*out));
+    char* dst = out->prefix;
+    size_t len = 0;
+    bool found = false;
+    for (const char* p = pattern; *p; p++) {
+        char c = *p;
+        if (c == '%') {
+            p++;
+            if (*p == '%') {
+                c = '%';
+            } else {
+                if (found) return false;
+                found = true;
+                if (*p == '0') {
+                    out->zero_pad = true;
+                    p++;
+                }
+                while (*p >= '0' && *p <= '9') {
+                    out->width = out->width * 10 + (*p++ - '0');
+                    if (out->width > 64) return false;
+                }
+                if (*p != 'd') return false;
+                dst = out->suffix;
+                len = 0;
+                continue;
+            }
+        }
+        if (len + 1 >= RECORD_PATH_SIZE) return false;
+        dst[len++] = c;
+    }
+    return found;
+}
+
+struct Recorder {
+    const char* path;
+    RecordPattern pattern; // PPMの連番のファイル名
+    FILE* video; // Y4Mの出力 (NULL: PPMの連番)
+    int width;
+    int height;
+    int ring; // PBOの数
+    GLuint buffers[MAX_READBACK_BUFFERS];
+    GLsync fences[MAX_READBACK_BUFFERS];
+    int buffer_frames[MAX_READBACK_BUFFERS]; // 読み出し中のフレーム (-1: 空)
+    int frames; // 読み出しを始めたフレームの数
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char* queue[RECORD_QUEUE_SIZE]; // 書き出しを待つフレーム (RGBA8, 下の行から)
+    int queue_frames[RECORD_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    unsigned char* spare[RECORD_QUEUE_SIZE]; // 空いている画素のバッファ
+    int spare_count;
+    unsigned char* planes; // 書き出す1フレーム分のRGB / YUV
+    bool closing;
+    bool failed;
+    int written;
+};
+
+static Recorder gRecorder;
+
+static bool recordWrite(Recorder* rec, const unsigned char* rgba, int frame) {
+    TRACE_SPAN("write frame");
+    const int width = rec->width;
+    const int height = rec->height;
+    if (rec->video == NULL) {
+        // ファイル名の書式に--recordの文字列をそのまま使わない
+        const RecordPattern* pat = &rec->pattern;
+        char path[RECORD_PATH_SIZE * 2 + 80];
+        snprintf(path, sizeof(path), pat->zero_pad ? "%s%0*d%s" : "%s%*d%s",
+            pat->prefix, pat->width, frame, pat->suffix);
+        FILE* fp = fopen(path, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open %s\n", path);
+            return false;
+        }
+        // PPMは上の行から並べる
+        fprintf(fp, "P6\n%d %d\n255\n", width, height);
+        unsigned char* out = rec->planes;
+        for (int y = height-1; y >= 0; y--) {
+            const unsigned char* px = &rgba[(size_t)y * width * 4];
+            for (int x = 0; x < width; x++, px += 4) {
+                *out++ = px[0];
+                *out++ = px[1];
+                *out++ = px[2];
+            }
+        }
+        const bool ok = fwrite(rec->planes, 3, (size_t)width * height, fp) == (size_t)width * height;
+        return fclose(fp) == 0 && ok;
+    }
+
+    // BT.601 (limited range) のY, Cb, Crの平面
+    const size_t size = (size_t)width * height;
+    unsigned char* plane_y = rec->planes;
+    unsigned char* plane_u = plane_y + size;
+    unsigned char* plane_v = plane_u + size;
+    for (int y = height-1; y >= 0; y--) {
+        const unsigned char* px = &rgba[(size_t)y * width * 4];
+        for (int x = 0; x < width; x++, px += 4) {
+            const int r = px[0];
+            const int g = px[1];
+            const int b = px[2];
+            *plane_y++ = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            *plane_u++ = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            *plane_v++ = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+    fputs("FRAME\n", rec->video);
+    return fwrite(rec->planes, 3, size, rec->video) == size;
+}
+
+static void* recordThread(void* arg) {
+    Recorder* rec = (Recorder*)arg;
+    traceThreadName("record");
+    pthread_mutex_lock(&rec->lock);
+    for (;;) {
+        while (rec->queue_count == 0 && !rec->closing) {
+            pthread_cond_wait(&rec->cond, &rec->lock);
+        }
+        if (rec->queue_count == 0) break;
+        unsigned char* pixels = rec->queue[rec->queue_head];
+        const int frame = rec->queue_frames[rec->queue_head];
+        pthread_mutex_unlock(&rec->lock);
+
+        const bool ok = recordWrite(rec, pixels, frame);
+
+        pthread_mutex_lock(&rec->lock);
+        rec->queue_head = (rec->queue_head + 1) % RECORD_QUEUE_SIZE;
+        rec->queue_count--;
+        rec->spare[rec->spare_count++] = pixels;
+        rec->failed = rec->failed || !ok;
+        rec->written++;
+        pthread_cond_broadcast(&rec->cond);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+
+/**
+ * a free pixel buffer, once the writer has caught up far enough
+ */
+static unsigned char* recordTakeSpare(Recorder* rec) {
+    pthread_mutex_lock(&rec->lock);
+    while (rec->spare_count == 0) {
+        pthread_cond_wait(&rec->cond, &rec->lock);
+    }
+    unsigned char* pixels = rec->spare[--rec->spare_count];
+    pthread_mutex_unlock(&rec->lock);
+    return pixels;
+}
+
+static void recordQueue(Recorder* rec, unsigned char* pixels, int frame) {
+    pthread_mutex_lock(&rec->lock);
+    const int tail = (rec->queue_head + rec->queue_count) % RECORD_QUEUE_SIZE;
+    rec->queue[tail] = pixels;
+    rec->queue_frames[tail] = frame;
+    rec->queue_count++;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+/**
+ * start recording the output framebuffer to gRecordPath through "ring"
+ * pixel buffer objects (0: synchronous glReadPixels)
+ */
+static void recordOpen(int ring) {
+    Recorder* rec = &gRecorder;
+    memset(rec, 0, sizeof(*rec));
+    rec->path = gRecordPath;
+    rec->pattern = gRecordPattern;
+    rec->width = gWidth;
+    rec->height = gHeight;
+    rec->ring = ring;
+    if (ring > 0 && !(GLEW_VERSION_3_2 || GLEW_ARB_sync)) {
+        printf("sync objects are not supported, reading the frames back synchronously\n");
+        rec->ring = 0;
+    }
+
+    const size_t len = strlen(gRecordPath);
+    if (len > 4 && strcmp(gRecordPath + len - 4, ".y4m") == 0) {
+        rec->video = fopen(gRecordPath, "wb");
+        if (rec->video == NULL) {
+            fprintf(stderr, "Could not open %s\n", gRecordPath);
+            exit(1);
+        }
+        fprintf(rec->video, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", rec->width, rec->height);
+    }
+
+    const size_t frame_bytes = (size_t)4 * rec->width * rec->height;
+    rec->planes = (unsigned char*)malloc(frame_bytes);
+    for (int i = 0; i < RECORD_QUEUE_SIZE; i++) {
+        rec->spare[i] = (unsigned char*)malloc(frame_bytes);
+        if (rec->spare[i] == NULL) break;
+        rec->spare_count++;
+    }
+    if (rec->planes == NULL || rec->spare_count < RECORD_QUEUE_SIZE) {
+        fprintf(stderr, "Could not allocate the recording buffers.\n");
+        exit(1);
+    }
+
+    if (rec->ring > 0) {
+        glGenBuffers(rec->ring, rec->buffers);
+        for (int i = 0; i < rec->ring; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, rec->buffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes, NULL, GL_STREAM_READ);
+            rec->buffer_frames[i] = -1;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    if (pthread_create(&rec->thread, NULL, recordThread, rec) != 0) {
+        fprintf(stderr, "Could not start the writer thread\n");
         exit(1);
     }
+}
+
+/**
+ * wait for the fence of PBO "slot", copy its frame out and queue it
+ */
+static void recordCollect(Recorder* rec, int slot) {
+    glClientWaitSync(rec->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(rec->fences[slot]);
+
+    unsigned char* pixels = recordTakeSpare(rec);
+    const size_t frame_bytes = (size_t)4 * rec->width * rec->height;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rec->buffers[slot]);
+    const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_bytes, GL_MAP_READ_BIT);
+    if (mapped) {
+        memcpy(pixels, mapped, frame_bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        printf("Check GL Error in recordCollect(): %d\n", glGetError());
+        memset(pixels, 0, frame_bytes);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    recordQueue(rec, pixels, rec->buffer_frames[slot]);
+    rec->buffer_frames[slot] = -1;
+}
+
+/**
+ * read back the frame just rendered
+ */
+static void recordFrame() {
+    TRACE_SPAN("readback");
+    Recorder* rec = &gRecorder;
+    const double start = nowMs();
+    stateBindFramebuffer(GL_FRAMEBUFFER_EXT, gOutputFrameBuffer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    if (rec->ring == 0) {
+        unsigned char* pixels = recordTakeSpare(rec);
+        glReadPixels(0, 0, rec->width, rec->height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        recordQueue(rec, pixels, rec->frames++);
+    } else {
+        // 1周前のフレームはもう描き終わっているはずなので、待たずに取り出せる
+        const int slot = rec->frames % rec->ring;
+        if (rec->buffer_frames[slot] >= 0) recordCollect(rec, slot);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, rec->buffers[slot]);
+        glReadPixels(0, 0, rec->width, rec->height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        rec->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        rec->buffer_frames[slot] = rec->frames++;
+    }
+    timerCpu(TIMER_READBACK, nowMs() - start);
+
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in recordFrame(): %d\n", err);
+    }
+}
+
+/**
+ * collect the frames still in flight, wait for the writer and close the
+ * output. returns false if a frame could not be written.
+ */
+static bool recordClose() {
+    Recorder* rec = &gRecorder;
+    for (int k = 0; k < rec->ring; k++) {
+        const int slot = (rec->frames + k) % rec->ring;
+        if (rec->buffer_frames[slot] >= 0) recordCollect(rec, slot);
+    }
+    pthread_mutex_lock(&rec->lock);
+    rec->closing = true;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+
+    if (rec->ring > 0) glDeleteBuffers(rec->ring, rec->buffers);
+    bool ok = !rec->failed;
+    if (rec->video && fclose(rec->video) != 0) ok = false;
+    for (int i = 0; i < rec->spare_count; i++) {
+        free(rec->spare[i]);
+    }
+    free(rec->planes);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    if (!ok) fprintf(stderr, "Could not write the frames to %s\n", rec->path);
+    return ok;
+}
+
+/**
+ * record --frames frames with synchronous readback and with 2 to
+ * MAX_READBACK_BUFFERS PBOs, and print the frames written per second
+ */
+static void runReadbackSweep() {
+    printf("resolution: %dx%d, frames: %d, output: %s\n", gWidth, gHeight, gBenchFrames, gRecordPath);
+    printf("%-10s %14s %14s\n", "readback", "written fps", "readback(ms)");
+    for (int ring = 0; ring <= MAX_READBACK_BUFFERS; ring++) {
+        if (ring == 1) continue; // 1つでは次のフレームの前に待つので同期と変わらない
+        timerReset();
+        recordOpen(ring);
+        const double start = nowMs();
+        for (int i = 0; i < gBenchFrames; i++) {
+            renderFrame();
+            recordFrame();
+        }
+        recordClose();
+        const double total_ms = nowMs() - start;
+        char name[16];
+        snprintf(name, sizeof(name), ring ? "pbo x%d" : "sync", ring);
+        printf("%-10s %14.2f %14.3f\n", name, gBenchFrames * 1000.0 / total_ms, timerAverage(TIMER_READBACK));
+    }
+}
+
+/**
+ * full resolution SSAO with the fragment backend (inside pass2) and the
+ * compute backend (ao + pass2) at 1x1 to 4x4 the --size resolution. both
+ * render the same frame, and the largest difference between the two images
+ * is printed next to the compute timing.
+ */
+static void runAoSweep() {
+    const int base_width = gWidth;
+    const int base_height = gHeight;
+    printf("%11s %-9s %10s %12s %10s\n", "resolution", "backend", "ao(ms)", "ao+pass2(ms)", "max diff");
+    for (int scale = 1; scale <= 4; scale++) {
+        gWidth = base_width * scale;
+        gHeight = base_height * scale;
+        allocateRenderTargets();
+
+        float* pixels[2];
+        for (int compute = 0; compute < 2; compute++) {
+            gAoCompute = compute;
+            selectShaderVariant();
+
+            angle = 0; // 同じフレームを描画する
+            benchFrames();
+            pixels[compute] = readOutputPixels();
+
+            char resolution[32];
+            snprintf(resolution, sizeof(resolution), "%dx%d", gWidth, gHeight);
+            if (compute) {
+                float max_diff = 0.f;
+                for (int i = 0; i < 4 * gWidth * gHeight; i++) {
+                    max_diff = fmaxf(max_diff, fabsf(pixels[0][i] - pixels[1][i]));
+                }
+                printf("%11s %-9s %10.3f %12.3f %10.2e\n", resolution, "compute",
+                    timerAverage(TIMER_AO), timerAverage(TIMER_AO) + timerAverage(TIMER_PASS2), max_diff);
+            } else {
+                printf("%11s %-9s %10s %12.3f\n", resolution, "fragment", "-", timerAverage(TIMER_PASS2));
+            }
+        }
+        free(pixels[0]);
+        free(pixels[1]);
+    }
+}
+
+/**
+ * render the same frame with and without --hiz and compare the images. Hi-Z
+ * reads the wide SSAO samples from a coarser depth, so the images are close
+ * but not equal; a broken pyramid (e.g. levels read as background) shows up
+ * as a large error. returns non-zero above HIZ_CHECK_RMSE.
+ */
+#define HIZ_CHECK_RADIUS 8.f // 2^(HIZ_LOG_OFFSET+2)画素より遠いサンプルが出る拡大率
+#define HIZ_CHECK_RMSE 1e-2
+
+static int runHiZCheck() {
+    gAnimateLights = false; // 同じフレームを描画する
+    gIncremental = false;
+    float* pixels[2];
+    for (int hiz = 0; hiz < 2; hiz++) {
+        gHiZ = hiz;
+        buildShaderDefines();
+        selectShaderVariant();
+        renderFrame();
+        glFinish();
+        pixels[hiz] = readOutputPixels();
+    }
+
+    double sum = 0;
+    float max_diff = 0.f;
+    const size_t count = (size_t)4 * gWidth * gHeight;
+    for (size_t i = 0; i < count; i++) {
+        const float diff = fabsf(pixels[0][i] - pixels[1][i]);
+        sum += (double)diff * diff;
+        max_diff = fmaxf(max_diff, diff);
+    }
+    free(pixels[0]);
+    free(pixels[1]);
+    const double rmse = sqrt(sum / count);
+    printf("hiz check: ao radius x%g, rmse %.2e, max diff %.2e (limit %.0e rmse): %s\n", gAoRadius, rmse, max_diff,
+        HIZ_CHECK_RMSE, rmse <= HIZ_CHECK_RMSE ? "ok" : "FAILED");
+    return rmse <= HIZ_CHECK_RMSE ? 0 : 1;
+}
+
+/**
+ * render the same frame with every --ao-kernel, --ao-noise and quality tier,
+ * and print the time of the SSAO and lighting passes next to the error of the
+ * image. the reference is the largest Poisson kernel averaged over
+ * AO_REFERENCE_ROTATIONS rotations, i.e. that many times the pairs.
+ */
+#define AO_REFERENCE_ROTATIONS 16
+
+static void runAoTierSweep() {
+    gAnimateLights = false; // 同じフレームを描画する
+    gIncremental = false;
+    angle = 0;
+    const int pixel_count = 4 * gWidth * gHeight;
+
+    gAoKernel = AO_KERNEL_POISSON;
+    gAoNoise = AO_NOISE_NONE;
+    gNumSamples = QUALITY_TIER_SAMPLES[NUM_QUALITY_TIERS - 1];
+    selectShaderVariant();
+    double* reference = (double*)calloc(pixel_count, sizeof(double));
+    for (int r = 0; r < AO_REFERENCE_ROTATIONS; r++) {
+        gAoKernelRotation = M_PI * (r + 0.5f) / AO_REFERENCE_ROTATIONS;
+        renderFrame();
+        float* pixels = readOutputPixels();
+        for (int i = 0; i < pixel_count; i++) {
+            reference[i] += pixels[i] / AO_REFERENCE_ROTATIONS;
+        }
+        free(pixels);
+    }
+    gAoKernelRotation = 0.f;
+
+    printf("reference: %s kernel, %d pairs x %d rotations\n", AO_KERNEL_NAMES[gAoKernel], gNumSamples,
+        AO_REFERENCE_ROTATIONS);
+    printf("%-10s %-8s %6s %12s %10s %10s\n", "kernel", "rotation", "pairs", "ao+pass2(ms)", "rmse", "max diff");
+    for (int kernel = 0; kernel < NUM_AO_KERNELS; kernel++) {
+        for (int noise = 0; noise < NUM_AO_NOISES; noise++) {
+            if (kernel == AO_KERNEL_FIXED && noise != AO_NOISE_NONE) continue; // 固定のカーネルは回さない
+            for (int tier = 0; tier < NUM_QUALITY_TIERS; tier++) {
+                gAoKernel = kernel;
+                gAoNoise = noise;
+                gNumSamples = QUALITY_TIER_SAMPLES[tier];
+                selectShaderVariant();
+
+                benchFrames();
+
+                float* pixels = readOutputPixels();
+                double sum = 0;
+                float max_diff = 0.f;
+                for (int i = 0; i < pixel_count; i++) {
+                    if (i % 4 == 3) continue; // アルファは常に1
+                    const float diff = fabsf(pixels[i] - (float)reference[i]);
+                    sum += (double)diff * diff;
+                    max_diff = fmaxf(max_diff, diff);
+                }
+                free(pixels);
+                // 描画されなかったパスの平均は-1なので足さない
+                const TimerId passes[] = { TIMER_AO, TIMER_PASS2 };
+                double ms = 0;
+                for (int p = 0; p < 2; p++) {
+                    const double avg = timerAverage(passes[p]);
+                    if (avg >= 0) ms += avg;
+                }
+                printf("%-10s %-8s %6d %12.3f %10.2e %10.2e\n", AO_KERNEL_NAMES[kernel], AO_NOISE_NAMES[noise],
+                    gNumSamples, ms, sqrt(sum / (pixel_count / 4 * 3)), max_diff);
+            }
+        }
+    }
+    free(reference);
+}
 
-    glCompileShader(frag);
-    glGetShaderiv(frag, GL_COMPILE_STATUS, &compiled);
-    if (compiled == GL_FALSE) {
-        printShaderInfoLog(frag);
-        exit(1);
+/**
+ * render the same frames with every --draw-mode and print the draw calls per
+ * frame, the CPU time spent submitting them and the time of pass1
+ */
+static void runDrawSweep() {
+    printf("meshes: %d, instances: %d\n", gNumMeshes, gNumInstances);
+    printf("%-10s %10s %10s %10s %10s\n", "mode", "draws", "submit(ms)", "pass1(ms)", "max diff");
+    float* reference = NULL;
+    for (int mode = 0; mode < NUM_DRAW_MODES; mode++) {
+        gDrawMode = mode;
+        angle = 0; // 同じフレームを描画する
+        benchFrames();
+
+        float* pixels = readOutputPixels();
+        float max_diff = 0.f;
+        if (reference) {
+            for (int i = 0; i < 4 * gWidth * gHeight; i++) {
+                max_diff = fmaxf(max_diff, fabsf(reference[i] - pixels[i]));
+            }
+            free(pixels);
+        } else {
+            reference = pixels;
+        }
+        printf("%-10s %10d %10.3f %10.3f %10.2e\n", DRAW_MODE_NAMES[mode], gDrawCalls,
+            timerAverage(TIMER_SUBMIT), timerAverage(TIMER_PASS1), max_diff);
     }
+    free(reference);
+}
 
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vert);
-    glAttachShader(program, frag);
+/**
+ * move and cull the --frames frames of the scene with 1 to MAX_JOB_THREADS
+ * threads, starting from the same scene every time, and compare the render
+ * lists with the single threaded one
+ */
+static void runJobSweep() {
+    const int moving = (gMovingInstances < gScene.count) ? gMovingInstances : gScene.count;
+    printf("instances: %d (%d moving), frames: %d, cores: %ld\n", gScene.count, moving, gBenchFrames,
+        sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %12s %12s %12s %8s %6s\n", "threads", "update(ms)", "cull(ms)", "total(ms)", "speedup", "same");
+    const SceneView view = currentSceneView();
+    RenderList* reference = &gRenderLists[0];
+    double base_ms = 0;
+    for (int threads = 1; threads <= MAX_JOB_THREADS; threads *= 2) {
+        RenderList* list = (threads == 1) ? reference : &gRenderLists[1];
+        setJobThreads(threads);
+        // 同じ配置とBVHから始める
+        memcpy(gScene.matrices, gScene.base_matrices, sizeof(float) * 16 * gScene.count);
+        for (int i = 0; i < gScene.count; i++) {
+            transformBounds(&gScene.bounds[i * 6], &gScene.matrices[i * 16], gMeshes[i % gNumMeshes]);
+        }
+        bvhRebuild();
+
+        double update_ms = 0;
+        double cull_ms = 0;
+        for (int frame = 1; frame <= gBenchFrames; frame++) {
+            const double start = nowMs();
+            updateScene(list, frame, view);
+            const double cull_start = nowMs();
+            buildRenderList(list, fullRect());
+            update_ms += cull_start - start;
+            cull_ms += nowMs() - cull_start;
+        }
+        const double total_ms = (update_ms + cull_ms) / gBenchFrames;
+        if (threads == 1) base_ms = total_ms;
+        const bool same = list->count == reference->count
+            && memcmp(&list->moved, &reference->moved, sizeof(ScreenRect)) == 0
+            && memcmp(list->objects, reference->objects, sizeof(int) * list->count) == 0
+            && memcmp(list->matrices, reference->matrices, sizeof(float) * 16 * list->count) == 0;
+        printf("%8d %12.3f %12.3f %12.3f %7.2fx %6s\n", threads, update_ms / gBenchFrames, cull_ms / gBenchFrames,
+            total_ms, base_ms / total_ms, same ? "yes" : "NO");
+    }
+}
 
-    glDeleteShader(vert);
-    glDeleteShader(frag);
+#define TRANSFORM_BENCH_COUNT 1000000
+#define TRANSFORM_BENCH_TOLERANCE 1e-5f
 
-    if (pass == 1) {
-        glBindAttribLocation(program, 0, "in_Position");
-        glBindAttribLocation(program, 1, "in_Normal");
-        glBindAttribLocation(program, 2, "in_Texture_coord");
-    } else if (pass == 2) {
-        glBindAttribLocation(program, 0, "in_Position");
-        glBindAttribLocation(program, 2, "in_Texture_coord");
+static float maxRelativeError(const float* a, const float* b, size_t count) {
+    float max_error = 0.f;
+    for (size_t i = 0; i < count; i++) {
+        max_error = fmaxf(max_error, fabsf(a[i] - b[i]) / fmaxf(1.f, fabsf(a[i])));
     }
+    return max_error;
+}
 
-    glLinkProgram(program);
-    glGetProgramiv(program, GL_LINK_STATUS, &linked);
-    if (linked == GL_FALSE) {
-        printProgramInfoLog(program);
-        exit(1);
+/**
+ * --transform-bench: check the SIMD matrix helpers and the Halton table
+ * against their scalar references on TRANSFORM_BENCH_COUNT instance matrices
+ * and time both (best of gBenchFrames runs). no GL context is needed.
+ * returns non-zero if a result is off by more than TRANSFORM_BENCH_TOLERANCE.
+ */
+static int runTransformBench() {
+    const int count = TRANSFORM_BENCH_COUNT;
+    float* models = (float*)malloc(sizeof(float) * 16 * count);
+    float* expected = (float*)malloc(sizeof(float) * 16 * count);
+    float* result = (float*)malloc(sizeof(float) * 16 * count);
+    if (models == NULL || expected == NULL || result == NULL) {
+        fprintf(stderr, "Could not allocate the benchmark matrices.\n");
+        return 1;
     }
 
-    return program;
-}
+    // 1辺2.5の箱と同じメッシュとして、draw_pass1()が毎フレーム計算していた配置を作る
+    gNumInstances = count;
+    gNumMeshes = 1;
+    gMeshes[0].scale = 1.f;
+    gRandIndex = 0;
+    const double model_start = nowMs();
+    for (int i = 0; i < count; i++) {
+        getInstanceMat(&models[i*16], i);
+    }
+    const double model_ms = nowMs() - model_start;
 
-static void multiplyMatrix(float* out, const float* src1, const float* src2) {
-    for (int i=0; i<16; i++) {
-        out[i] = 0;
-        const int src1_base = (i/4)*4; // 0->4->8->12
-        const int src2_base = i%4;
-        for (int j=0; j<4; j++) {
-            const int src1_index = src1_base + j;
-            const int src2_index = src2_base + j*4;
-            out[i] += (src1[src1_index]*src2[src2_index]);
+    float proj[16], view[16], view_proj[16];
+    getPerspectiveMatrix(proj, 1.f, 60, SCREEN_NEAR, SCREEN_FAR);
+    getModelviewMatrix(view, NULL, CAM_POSX, CAM_POSY, CAM_POSZ, 0,0,0, 0,1,0);
+    multiplyMatrixScalar(view_proj, view, proj);
+
+    printf("transform bench: %d matrices, best of %d runs, %s\n", count, gBenchFrames,
+#if defined(__AVX__)
+        "AVX"
+#elif defined(__SSE2__)
+        "SSE2"
+#else
+        "no SIMD"
+#endif
+        );
+    printf("instance matrices (getInstanceMat): %.3f ms\n", model_ms);
+    printf("%-14s %10s %10s %8s %10s\n", "op", "scalar(ms)", "simd(ms)", "speedup", "max error");
+
+    bool passed = true;
+    for (int op = 0; op < 4; op++) {
+        double best[2] = {INFINITY, INFINITY};
+        for (int run = 0; run < gBenchFrames; run++) {
+            for (int simd = 0; simd < 2; simd++) {
+                float* out = simd ? result : expected;
+                const double start = nowMs();
+                if (op == 0) {
+                    for (int i = 0; i < count; i++) {
+                        if (simd) {
+                            multiplyMatrix(&out[i*16], &models[i*16], view_proj);
+                        } else {
+                            multiplyMatrixScalar(&out[i*16], &models[i*16], view_proj);
+                        }
+                    }
+                } else if (op == 1) {
+                    if (simd) {
+                        multiplyMatrixBatch(out, models, count, view_proj);
+                    } else {
+                        for (int i = 0; i < count; i++) {
+                            multiplyMatrixScalar(&out[i*16], &models[i*16], view_proj);
+                        }
+                    }
+                } else if (op == 2) {
+                    if (simd) {
+                        normalMatrixBatch(out, models, count);
+                    } else {
+                        for (int i = 0; i < count; i++) {
+                            normalMatrixScalar(&out[i*12], &models[i*16]);
+                        }
+                    }
+                } else {
+                    // 表の範囲を繰り返してcount点を引く
+                    for (int i = 0; i < count; i++) {
+                        const int base = i % HALTON_TABLE_BASES;
+                        const int index = (i / HALTON_TABLE_BASES) % HALTON_TABLE_SIZE;
+                        out[i] = simd ? halton(base, index) : radicalInverse(PRIMES[base], index);
+                    }
+                }
+                best[simd] = fmin(best[simd], nowMs() - start);
+            }
         }
+
+        static const char* OP_NAMES[] = {"multiply", "multiply batch", "normal batch", "halton table"};
+        static const int OP_FLOATS[] = {16, 16, 12, 1};
+        const float error = maxRelativeError(expected, result, (size_t)OP_FLOATS[op] * count);
+        // Haltonの表は同じ計算をコンパイル時にしたものなので一致しなければならない
+        const bool ok = (op == 3) ? error == 0.f : error <= TRANSFORM_BENCH_TOLERANCE;
+        printf("%-14s %10.3f %10.3f %7.2fx %10.2e%s\n", OP_NAMES[op], best[0], best[1], best[0] / best[1], error,
+            ok ? "" : " FAILED");
+        passed = passed && ok;
     }
+
+    free(models);
+    free(expected);
+    free(result);
+    return passed ? 0 : 1;
 }
 
-static void getPerspectiveMatrix(float* proj, float aspect,
-        int fovy, float near, float far) {
-    const float f = 1.0f / (float) tan(fovy * (M_PI / 360.0f));
-    const float rangeReciprocal = 1.0f / (near - far);
+/**
+ * render gBenchFrames frames offscreen and report the throughput
+ */
+static int runHeadless() {
+    // 1フレーム目はシェーダのJITなどを含むため計測から除外する
+    // (llvmpipeでは最初の描画を含むタイマークエリの値も不正になる)
+    const double first_start = nowMs();
+    updateFrameData();
+    RenderList* list = acquireRenderList();
+    if (gFrustumCulling) buildRenderList(list, fullRect());
+    list->moved = EMPTY_RECT; // 動いた物体はここで描画する
+    draw_pass1(fullRect(), list);
+    if (gHiZ) draw_hiz_pass();
+    if (useAoPass()) draw_ao_pass(fullRect());
+    if (gTiledLights) cull_lights();
+    draw_pass2(fullRect());
+    glFinish();
+    printf("first frame: %.1f ms\n", nowMs() - first_start);
+    timerInit();
+
+    if (gLightSweep) {
+        runLightSweep();
+        return 0;
+    }
+    if (gAoSweep) {
+        runAoSweep();
+        return 0;
+    }
+    if (gAoTierSweep) {
+        runAoTierSweep();
+        return 0;
+    }
+    if (gHiZCheck) {
+        return runHiZCheck();
+    }
+    if (gDrawSweep) {
+        runDrawSweep();
+        return 0;
+    }
+    if (gJobSweep) {
+        runJobSweep();
+        return 0;
+    }
+    if (gReadbackSweep) {
+        runReadbackSweep();
+        return 0;
+    }
 
-    proj[0] = f / aspect;
-    proj[1] = 0.0f;
-    proj[2] = 0.0f;
-    proj[3] = 0.0f;
+    int result = 0;
+    if (gRecordPath) recordOpen(gReadbackBuffers);
+    glFinish();
+    const double start = nowMs();
+    reportPacing(); // 計測の始まり
+    for (int i = 0; i < gBenchFrames; i++) {
+        paceFrame();
+        if (renderFrame()) gPacer.presented++;
+        if (gRecordPath) recordFrame();
+    }
+    // 書き出しが終わるまでを含める
+    if (gRecordPath && !recordClose()) result = 1;
+    glFinish();
+    const double total_ms = nowMs() - start;
+    timerFlush();
+
+    printf("frames: %d\n", gBenchFrames);
+    printf("resolution: %dx%d\n", gWidth, gHeight);
+    if (gFrameBudget > 0) {
+        printf("render scale: %.2f-1 for a %.2f ms frame budget\n", gMinRenderScale, gFrameBudget);
+    }
+    printf("instances: %d\n", gNumInstances);
+    printf("meshes: %d, draw mode: %s (%d draw calls/frame)\n", gNumMeshes, DRAW_MODE_NAMES[gDrawMode], gDrawCalls);
+    printf("lights: %d (%s)\n", gNumLights, gTiledLights ? "tiled culling" : "no culling");
+    printf("gbuffer: %s (%d bytes/pixel)\n", GBUFFER_LAYOUT_NAMES[gGBufferLayout], gbufferBytesPerPixel());
+    if (gAoTemporal) {
+        printf("ao: 1/%d resolution, temporal (" STR(AO_TEMPORAL_SAMPLES) " samples/frame)\n", gAoScale);
+    } else if (gAoCompute) {
+        printf("ao: compute shader, %d samples, %dx%d tiles + %d pixel apron\n",
+            gNumSamples, TILE_SIZE, TILE_SIZE, aoApron());
+    } else {
+        printf("ao: 1/%d resolution, %d samples\n", gAoScale, gNumSamples);
+    }
+    printf("ao radius: x%g%s\n", gAoRadius, gHiZ ? " (Hi-Z)" : "");
+    if (gAoKernel != AO_KERNEL_FIXED) {
+        printf("ao kernel: %s (%s rotation)\n", AO_KERNEL_NAMES[gAoKernel], AO_NOISE_NAMES[gAoNoise]);
+    }
+    printf("total: %.3f ms\n", total_ms);
+    printf("fps: %.2f\n", gBenchFrames * 1000.0 / total_ms);
+    if (gRecordPath) {
+        char readback[32];
+        snprintf(readback, sizeof(readback), gRecorder.ring ? "%d PBOs" : "synchronous", gRecorder.ring);
+        printf("record: %d frames to %s (%s readback, %.3f ms/frame on the GL thread)\n", gRecorder.written,
+            gRecordPath, readback, timerAverage(TIMER_READBACK));
+    }
+    timerReport();
+    reportDrawCounts();
+    reportPacing();
+    reportResolution();
+    reportGlState();
+    if (gJobThreads > 0 && gFrustumCulling) {
+        printf("jobs: %d threads, the next frame is moved and culled while this one is drawn\n", gJobThreads);
+    }
+    if (gIncremental) {
+        printf("incremental: G-buffer redrawn in %d frames (%.1f%% of the screen on average), "
+            "relit in %d frames (%.1f%%)\n", gPass1Frames, 100.0 * gPass1Coverage / gBenchFrames,
+            gPass2Frames, 100.0 * gPass2Coverage / gBenchFrames);
+    }
 
-    proj[4] = 0.0f;
-    proj[5] = f;
-    proj[6] = 0.0f;
-    proj[7] = 0.0f;
+    // pass2の読み込み量と実測時間から求めた実効帯域
+    const double pass2_bytes = (double)pass2BytesPerPixel() * gWidth * gHeight;
+    printf("pass2 reads: %d bytes/pixel, %.2f MB/frame, %.2f GB/s\n",
+        pass2BytesPerPixel(), pass2_bytes / 1e6, pass2_bytes / (timerAverage(TIMER_PASS2) * 1e6));
 
-    proj[8] = 0.0f;
-    proj[9] = 0.0f;
-    proj[10] = (far + near) * rangeReciprocal;
-    proj[11] = -1.0f;
+    if (gOutputPath) {
+        float* pixels = readOutputPixels();
+        if (!writeImage(gOutputPath, gWidth, gHeight, pixels)) {
+            result = 1;
+        }
+        free(pixels);
+    }
 
-    proj[12] = 0.0f;
-    proj[13] = 0.0f;
-    proj[14] = 2.0f * far * near * rangeReciprocal;
-    proj[15] = 0.0f;
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in runHeadless(): %d\n", err);
+        result = 1;
+    }
+    return result;
 }
 
-static void getModelviewMatrix(float* modelview, float* normalview,
-        float ex, float ey, float ez,
-        float ax, float ay, float az,
-        float ux, float uy, float uz) {
-    float fx = ax - ex;
-    float fy = ay - ey;
-    float fz = az - ez;
-
-    // Normalize f
-    float rlf = 1.0f / sqrtf(fx * fx + fy * fy + fz * fz);
-    fx *= rlf;
-    fy *= rlf;
-    fz *= rlf;
-
-    // compute s = f x_ up (x_ means "cross product")
-    float sx = fy * uz - fz * uy;
-    float sy = fz * ux - fx * uz;
-    float sz = fx * uy - fy * ux;
+/**
+ * batch mode (--batch FILE): render one image per line of a job list
+ *   X,Y,Z ANGLE OUTPUT   camera position, angle (degrees) of the main light,
+ *                        and the *.ppm / *.pfm file to write
+ * with --batch-workers N the list is shared by N worker processes, each with
+ * its own headless context. the render state of this program is global, so
+ * the workers are processes rather than threads; they share the linked
+ * programs through the binary cache, the *.mesh files through the page cache
+ * and take the next job from a counter in shared memory.
+ */
+#define MAX_BATCH_WORKERS 64
 
-    // and normalize s
-    float rls = 1.0f / sqrtf(sx * sx + sy * sy + sz * sz);
-    sx *= rls;
-    sy *= rls;
-    sz *= rls;
+struct BatchJob {
+    float cam_pos[3];
+    float light_angle;
+    char output[1024];
+};
 
-    // compute u = s x_ f
-    float upx = sy * fz - sz * fy;
-    float upy = sz * fx - sx * fz;
-    float upz = sx * fy - sy * fx;
+struct BatchShared {
+    int next; // 次のジョブ (__atomicで増やす)
+    int failed;
+    double start_ms;
+    int images[MAX_BATCH_WORKERS];
+    double render_ms[MAX_BATCH_WORKERS]; // 初期化の後、最後のジョブまで
+};
 
-    const float rote[16] = {
-            sx, upx, -fx, 0,
-            sy, upy, -fy, 0,
-            sz, upz, -fz, 0,
-             0,   0,   0, 1
-        };
-    if (normalview) memcpy(normalview, rote, sizeof(rote));
+static BatchJob* gBatchJobs = NULL;
+static int gBatchJobCount = 0;
+static BatchShared* gBatchShared = NULL;
 
-    const float move[16] = {
-             1,   0,   0, 0,
-             0,   1,   0, 0,
-             0,   0,   1, 0,
-           -ex, -ey, -ez, 1
-        };
+static void loadBatchJobs() {
+    FILE* fp = fopen(gBatchPath, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", gBatchPath);
+        exit(1);
+    }
+    int capacity = 0;
+    char line[1200];
+    for (int line_number = 1; fgets(line, sizeof(line), fp); line_number++) {
+        const char* p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+        if (gBatchJobCount == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            gBatchJobs = (BatchJob*)realloc(gBatchJobs, sizeof(BatchJob) * capacity);
+            if (gBatchJobs == NULL) {
+                fprintf(stderr, "Could not allocate the batch jobs.\n");
+                exit(1);
+            }
+        }
+        BatchJob* job = &gBatchJobs[gBatchJobCount];
+        if (sscanf(p, "%f,%f,%f %f %1023s", &job->cam_pos[0], &job->cam_pos[1], &job->cam_pos[2],
+                &job->light_angle, job->output) != 5) {
+            fprintf(stderr, "%s:%d: expected \"X,Y,Z ANGLE OUTPUT\"\n", gBatchPath, line_number);
+            exit(1);
+        }
+        gBatchJobCount++;
+    }
+    fclose(fp);
 
-    multiplyMatrix(modelview, rote, move);
+    // fork()した全てのワーカーから見える
+    gBatchShared = (BatchShared*)mmap(NULL, sizeof(BatchShared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (gBatchShared == MAP_FAILED) {
+        fprintf(stderr, "Could not map the batch state\n");
+        exit(1);
+    }
+    memset(gBatchShared, 0, sizeof(BatchShared));
+    gBatchShared->start_ms = nowMs();
 }
 
-static void initPass1Shader() {
-    glUseProgram(gPass1Program);
+/**
+ * fork the --batch-workers processes. returns true in a worker and false in
+ * the parent once all of them have exited.
+ */
+static bool forkBatchWorkers() {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < gBatchWorkers; i++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Could not start batch worker %d\n", i);
+            exit(1);
+        }
+        if (pid == 0) {
+            gBatchWorker = i;
+            return true;
+        }
+    }
+    gTraceEnabled = false; // 親はイベントを持たない (ワーカーがFILE.PIDに書く)
+    for (int i = 0; i < gBatchWorkers; i++) {
+        int status = 0;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            __atomic_add_fetch(&gBatchShared->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return false;
+}
 
-    // Positionテクスチャの用意
-    glGenTextures(1, &gPositionTexture);
-    glBindTexture(GL_TEXTURE_2D, gPositionTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT32_ATI, FBO_WIDTH, FBO_HEIGHT, 0, GL_RGBA, GL_FLOAT, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+/**
+ * render the jobs of the list until none is left
+ */
+static int runBatch() {
+    gAnimateLights = false;
+    const double start = nowMs();
+    int images = 0;
+    int failed = 0;
+    for (;;) {
+        const int index = __atomic_fetch_add(&gBatchShared->next, 1, __ATOMIC_RELAXED);
+        if (index >= gBatchJobCount) break;
+        const BatchJob* job = &gBatchJobs[index];
+        memcpy(gCamPos, job->cam_pos, sizeof(gCamPos));
+        angle = job->light_angle;
+        gAoHistoryFrames = 0; // 前のジョブの視点の履歴は使えない
+
+        renderFrame();
+        float* pixels = readOutputPixels();
+        if (!writeImage(job->output, gWidth, gHeight, pixels)) failed++;
+        free(pixels);
+        images++;
+    }
+    gBatchShared->images[gBatchWorker] = images;
+    gBatchShared->render_ms[gBatchWorker] = nowMs() - start;
+    if (failed) __atomic_add_fetch(&gBatchShared->failed, failed, __ATOMIC_RELAXED);
 
-    // Normalテクスチャの用意
-    glGenTextures(1, &gNormalTexture);
-    glBindTexture(GL_TEXTURE_2D, gNormalTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, RGBA_FLOAT32_ATI, FBO_WIDTH, FBO_HEIGHT, 0, GL_RGBA, GL_FLOAT, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    int err = glGetError();
+    if (GL_NO_ERROR != err) {
+        printf("Check GL Error in runBatch(): %d\n", err);
+    }
+    return failed ? 1 : 0;
+}
 
-    // Albedoテクスチャの用意
-    glGenTextures(1, &gAlbedoTexture);
-    glBindTexture(GL_TEXTURE_2D, gAlbedoTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, FBO_WIDTH, FBO_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+/**
+ * images per second of the whole batch, including the startup of the workers
+ */
+static int reportBatch() {
+    const double total_ms = nowMs() - gBatchShared->start_ms;
+    int images = 0;
+    for (int i = 0; i < gBatchWorkers; i++) {
+        printf("batch worker %d: %d images, %.1f ms after startup\n", i, gBatchShared->images[i],
+            gBatchShared->render_ms[i]);
+        images += gBatchShared->images[i];
+    }
+    printf("batch: %d of %d images at %dx%d with %d workers in %.1f ms, %.2f images/s\n", images,
+        gBatchJobCount, gWidth, gHeight, gBatchWorkers, total_ms, images * 1000.0 / total_ms);
+    if (gBatchShared->failed) {
+        fprintf(stderr, "%d batch jobs or workers failed\n", gBatchShared->failed);
+        return 1;
+    }
+    return 0;
+}
 
-    // テクスチャマッピングのテクスチャを用意(単純画像のため1画素のみ)
-    const uint8_t img[] = {255, 255, 255, 255};
-    glGenTextures(1, &gImg);
-    glBindTexture(GL_TEXTURE_2D, gImg);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+static void printUsage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [--headless] [--frames N] [--output FILE.ppm|FILE.pfm] [--timing-csv FILE]\n"
+        "          [--instances N] [--gbuffer full|half|compact] [--ao full|half|quarter]\n"
+        "          [--ao-temporal] [--size WxH] [--samples N] [--lights N] [--camera X,Y,Z]\n"
+        "          [--shader-cache DIR] [--no-shader-cache] [--tiled-lights] [--light-sweep]\n"
+        "          [--ao-radius R] [--hiz] [--ao-compute] [--ao-sweep] [--mesh FILE]\n"
+        "          [--convert-obj FILE.obj FILE.mesh] [--frustum-cull] [--moving-instances N]\n"
+        "          [--box-variants N] [--draw-mode loop|instanced|indirect] [--draw-sweep]\n"
+        "          [--incremental] [--transform-bench] [--jobs N] [--job-sweep]\n"
+        "          [--record FILE.y4m|PATTERN.ppm] [--readback-buffers N] [--readback-sweep]\n"
+        "          [--batch FILE] [--batch-workers N] [--single-buffer] [--swap-interval N]\n"
+        "          [--fps-cap N] [--on-demand] [--ao-kernel fixed|stratified|poisson]\n"
+        "          [--ao-noise none|tiled|ign] [--ao-tier-sweep] [--frame-budget MS]\n"
+        "          [--min-scale S] [--resolution-log FILE] [--trace FILE] [--hiz-check]\n"
+        "  --headless   render offscreen through EGL instead of opening a window\n"
+        "  --frames N   number of frames rendered in headless mode (default %d)\n"
+        "  --output F   write the last headless frame to F\n"
+        "  --record F   headless: write every frame to the Y4M video F (*.y4m) or to PPM files\n"
+        "               named by the printf pattern F (e.g. frame%%04d.ppm) on a writer thread\n"
+        "  --readback-buffers N  read the recorded frames back through a ring of N pixel buffer\n"
+        "               objects, 0-%d (default %d, 0: synchronous glReadPixels)\n"
+        "  --readback-sweep  headless: record --frames frames with every readback and compare\n"
+        "               the frames written per second\n"
+        "  --batch F    render one image per line \"X,Y,Z ANGLE OUTPUT\" of F (camera position,\n"
+        "               main light angle in degrees, *.ppm or *.pfm file) offscreen and exit\n"
+        "  --batch-workers N  split the --batch jobs over N worker processes, 1-%d (default 1)\n"
+        "  --single-buffer  draw the window into the front buffer instead of swapping buffers\n"
+        "  --swap-interval N  vertical blanks per buffer swap (default 1, 0: no vsync)\n"
+        "  --fps-cap N  sleep between frames to draw at most N frames per second\n"
+        "  --on-demand  only draw the frames in which instances or lights changed (the\n"
+        "               animation runs at --fps-cap, default %d fps)\n"
+        "  --timing-csv F  write per-frame CPU/GPU pass timings to F\n"
+        "  --trace F       record CPU spans, pass timings and per-frame GL counters and write\n"
+        "                  them to F as Chrome trace JSON at exit, on SIGUSR1 or SIGINT/SIGTERM\n"
+        "                  (--batch-workers write F.PID)\n"
+        "  --instances N   number of boxes (or meshes) drawn in the G-buffer pass (default %d)\n"
+        "  --mesh F        draw F instead of the box: a *.mesh file (memory mapped) or a *.obj\n"
+        "                  (parsed at load time), scaled to the size of the box. repeat it to draw\n"
+        "                  up to %d meshes, instance i uses mesh i modulo their count\n"
+        "  --box-variants N  without --mesh: draw N boxes of different proportions\n"
+        "  --draw-mode M   submit the instances of pass1 with one draw per instance (loop), one\n"
+        "                  instanced draw per mesh (instanced, default) or one multi draw indirect\n"
+        "  --draw-sweep    headless: time pass1 with every --draw-mode\n"
+        "  --incremental   headless: redraw only what moved instances and changed lights touch\n"
+        "                  (always on in the window)\n"
+        "  --jobs N        with --frustum-cull: move and cull the instances on N threads (1-%d),\n"
+        "                  one frame ahead of the GL thread\n"
+        "  --job-sweep     headless: time moving and culling the instances (all of them unless\n"
+        "                  --moving-instances) on 1 to %d threads, implies --frustum-cull\n"
+        "  --transform-bench  check the SIMD matrix helpers against the scalar ones on %d\n"
+        "                  matrices, time both (best of --frames runs) and exit\n"
+        "  --convert-obj IN OUT  convert the OBJ file IN to the binary mesh OUT and exit\n"
+        "  --frustum-cull  keep the instances in a BVH and draw only those inside the view frustum\n"
+        "  --moving-instances N  move the first N instances every frame (refits the BVH)\n"
+        "  --gbuffer L     G-buffer layout: full (RGBA32F), half (RGBA16F normal) or\n"
+        "                  compact (depth + octahedral RG16F normal)\n"
+        "  --ao R          SSAO resolution: full (inside the lighting pass), or half/quarter\n"
+        "                  (separate pass + depth/normal aware upsampling)\n"
+        "  --ao-temporal   jitter the SSAO kernel every frame (" STR(AO_TEMPORAL_SAMPLES) " samples) and\n"
+        "                  accumulate it with the reprojected previous frame\n"
+        "  --size WxH      render resolution (default %dx%d, the window can also be resized)\n"
+        "  --frame-budget MS  lower the internal resolution of the G-buffer and SSAO passes while\n"
+        "                  their GPU time exceeds MS, and raise it again once there is headroom\n"
+        "                  (no --incremental redraw)\n"
+        "  --min-scale S   lowest internal resolution of --frame-budget (default 0.5)\n"
+        "  --resolution-log F  write the scale and the measured frame time of every frame to F\n"
+        "  --samples N     SSAO kernel size, 1-%d (default %d; 1-4 keys in the window)\n"
+        "  --ao-kernel K   SSAO kernel: fixed (default, uploaded every frame), stratified or\n"
+        "                  poisson (generated at build time and compiled into the shaders)\n"
+        "  --ao-noise N    rotate a stratified|poisson kernel per pixel: none (default), tiled\n"
+        "                  (4x4 texture) or ign (interleaved gradient noise)\n"
+        "  --ao-tier-sweep headless: time every kernel, rotation and quality tier and compare\n"
+        "                  the images with a many times supersampled reference\n"
+        "  --lights N      number of point lights, 1-%d (default %d; +/- keys in the window)\n"
+        "                  more than %d lights need --tiled-lights\n"
+        "  --tiled-lights  cull the lights per %dx%d tile in a compute shader (up to %d lights)\n"
+        "  --light-sweep   headless: time the lighting with 1 to %d lights, with and without culling\n"
+        "  --ao-radius R   scale the SSAO kernel (default 1: 1-3 pixels)\n"
+        "  --hiz           read SSAO samples from a linear depth pyramid, coarser for wider offsets\n"
+        "  --hiz-check     headless: render the frame with and without --hiz (--ao-radius at least\n"
+        "                  %g) and exit with an error if the images differ by more than %g RMSE\n"
+        "  --ao-compute    full resolution SSAO in a compute shader that caches each %dx%d tile\n"
+        "                  in shared memory (--ao-radius up to %g)\n"
+        "  --ao-sweep      headless: time full resolution SSAO with the fragment and compute\n"
+        "                  backends at 1x1 to 4x4 the --size resolution\n"
+        "  --camera X,Y,Z  camera position (default %g,%g,%g)\n"
+        "  --shader-cache DIR  directory of the linked program binaries (default %s)\n"
+        "  --no-shader-cache   always compile the shaders from source\n",
+        name, gBenchFrames, MAX_READBACK_BUFFERS, gReadbackBuffers, MAX_BATCH_WORKERS, ON_DEMAND_FPS, gNumInstances, MAX_MESHES, MAX_JOB_THREADS, MAX_JOB_THREADS, TRANSFORM_BENCH_COUNT, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+        MAX_SAMPLE_POINTS, NUM_SAMPLE_POINTS, MAX_LIGHTS, DEFAULT_LIGHTS,
+        MAX_LIGHTS, TILE_SIZE, TILE_SIZE, MAX_TILED_LIGHTS, MAX_TILED_LIGHTS, HIZ_CHECK_RADIUS, HIZ_CHECK_RMSE,
+        TILE_SIZE, TILE_SIZE, AO_MAX_APRON / 3.0, CAM_POSX, CAM_POSY, CAM_POSZ,
+        DEFAULT_SHADER_CACHE_DIR);
+}
 
-    // テクスチャをフレームバッファに関連付ける
-    glGenFramebuffersEXT(1, &gFrameBufferObject);
-    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, gFrameBufferObject);
+static void parseArgs(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            gHeadless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc) {
+            gBenchFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i+1 < argc) {
+            gOutputPath = argv[++i];
+        } else if (strcmp(argv[i], "--timing-csv") == 0 && i+1 < argc) {
+            gTimingCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            gTracePath = argv[++i];
+        } else if (strcmp(argv[i], "--instances") == 0 && i+1 < argc) {
+            gNumInstances = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frustum-cull") == 0) {
+            gFrustumCulling = true;
+        } else if (strcmp(argv[i], "--moving-instances") == 0 && i+1 < argc) {
+            gMovingInstances = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mesh") == 0 && i+1 < argc) {
+            if (gNumMeshPaths == MAX_MESHES) {
+                fprintf(stderr, "At most %d meshes can be drawn\n", MAX_MESHES);
+                exit(1);
+            }
+            gMeshPaths[gNumMeshPaths++] = argv[++i];
+        } else if (strcmp(argv[i], "--box-variants") == 0 && i+1 < argc) {
+            gBoxVariants = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--draw-mode") == 0 && i+1 < argc) {
+            const char* name = argv[++i];
+            gDrawMode = -1;
+            for (int m = 0; m < NUM_DRAW_MODES; m++) {
+                if (strcmp(name, DRAW_MODE_NAMES[m]) == 0) gDrawMode = m;
+            }
+            if (gDrawMode < 0) {
+                fprintf(stderr, "Unknown draw mode: %s\n", name);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--draw-sweep") == 0) {
+            gDrawSweep = true;
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            gIncremental = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i+1 < argc) {
+            gRecordPath = argv[++i];
+            const size_t len = strlen(gRecordPath);
+            const bool video = len > 4 && strcmp(gRecordPath + len - 4, ".y4m") == 0;
+            if (!video && !parseRecordPattern(gRecordPath, &gRecordPattern)) {
+                fprintf(stderr, "--record needs a *.y4m file or a pattern with one %%d such as frame%%04d.ppm: %s\n",
+                    gRecordPath);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--readback-buffers") == 0 && i+1 < argc) {
+            gReadbackBuffers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--readback-sweep") == 0) {
+            gReadbackSweep = true;
+        } else if (strcmp(argv[i], "--single-buffer") == 0) {
+            gDoubleBuffer = false;
+        } else if (strcmp(argv[i], "--swap-interval") == 0 && i+1 < argc) {
+            gSwapInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fps-cap") == 0 && i+1 < argc) {
+            gFrameRateCap = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--on-demand") == 0) {
+            gOnDemand = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc) {
+            gBatchPath = argv[++i];
+        } else if (strcmp(argv[i], "--batch-workers") == 0 && i+1 < argc) {
+            gBatchWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i+1 < argc) {
+            gJobThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--job-sweep") == 0) {
+            gJobSweep = true;
+        } else if (strcmp(argv[i], "--transform-bench") == 0) {
+            gTransformBench = true;
+        } else if (strcmp(argv[i], "--convert-obj") == 0 && i+2 < argc) {
+            gConvertObjPath = argv[++i];
+            gConvertMeshPath = argv[++i];
+        } else if (strcmp(argv[i], "--ao") == 0 && i+1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "full") == 0) {
+                gAoScale = 1;
+            } else if (strcmp(name, "half") == 0) {
+                gAoScale = 2;
+            } else if (strcmp(name, "quarter") == 0) {
+                gAoScale = 4;
+            } else {
+                fprintf(stderr, "Unknown AO resolution: %s\n", name);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--ao-temporal") == 0) {
+            gAoTemporal = true;
+        } else if (strcmp(argv[i], "--size") == 0 && i+1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &gWidth, &gHeight) != 2 || gWidth < 1 || gHeight < 1) {
+                fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--shader-cache") == 0 && i+1 < argc) {
+            gShaderCacheDir = argv[++i];
+        } else if (strcmp(argv[i], "--no-shader-cache") == 0) {
+            gShaderCacheDir = NULL;
+        } else if (strcmp(argv[i], "--samples") == 0 && i+1 < argc) {
+            gNumSamples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lights") == 0 && i+1 < argc) {
+            gNumLights = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ao-radius") == 0 && i+1 < argc) {
+            gAoRadius = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--hiz") == 0) {
+            gHiZ = true;
+        } else if (strcmp(argv[i], "--ao-compute") == 0) {
+            gAoCompute = true;
+        } else if (strcmp(argv[i], "--ao-sweep") == 0) {
+            gAoSweep = true;
+        } else if (strcmp(argv[i], "--ao-kernel") == 0 && i+1 < argc) {
+            i++;
+            gAoKernel = -1;
+            for (int k = 0; k < NUM_AO_KERNELS; k++) {
+                if (strcmp(argv[i], AO_KERNEL_NAMES[k]) == 0) gAoKernel = k;
+            }
+            if (gAoKernel < 0) {
+                fprintf(stderr, "Unknown SSAO kernel: %s\n", argv[i]);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--ao-noise") == 0 && i+1 < argc) {
+            i++;
+            gAoNoise = -1;
+            for (int k = 0; k < NUM_AO_NOISES; k++) {
+                if (strcmp(argv[i], AO_NOISE_NAMES[k]) == 0) gAoNoise = k;
+            }
+            if (gAoNoise < 0) {
+                fprintf(stderr, "Unknown SSAO rotation: %s\n", argv[i]);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--ao-tier-sweep") == 0) {
+            gAoTierSweep = true;
+        } else if (strcmp(argv[i], "--hiz-check") == 0) {
+            gHiZCheck = true;
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i+1 < argc) {
+            gFrameBudget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--min-scale") == 0 && i+1 < argc) {
+            gMinRenderScale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--resolution-log") == 0 && i+1 < argc) {
+            gResolutionLogPath = argv[++i];
+        } else if (strcmp(argv[i], "--tiled-lights") == 0) {
+            gTiledLights = true;
+        } else if (strcmp(argv[i], "--light-sweep") == 0) {
+            gLightSweep = true;
+        } else if (strcmp(argv[i], "--camera") == 0 && i+1 < argc) {
+            if (sscanf(argv[++i], "%f,%f,%f", &gCamPos[0], &gCamPos[1], &gCamPos[2]) != 3) {
+                fprintf(stderr, "Invalid camera position: %s\n", argv[i]);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--gbuffer") == 0 && i+1 < argc) {
+            const char* name = argv[++i];
+            gGBufferLayout = -1;
+            for (int l = 0; l < 3; l++) {
+                if (strcmp(name, GBUFFER_LAYOUT_NAMES[l]) == 0) gGBufferLayout = l;
+            }
+            if (gGBufferLayout < 0) {
+                fprintf(stderr, "Unknown G-buffer layout: %s\n", name);
+                printUsage(argv[0]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--help") == 0) {
+            printUsage(argv[0]);
+            exit(0);
+        }
+    }
+    if (gBenchFrames < 1) {
+        gBenchFrames = 1;
+    }
+    if (gNumInstances < 1) {
+        gNumInstances = 1;
+    } else if (gNumInstances > MAX_INSTANCES) {
+        gNumInstances = MAX_INSTANCES;
+    }
+    if (gAoRadius <= 0.f) {
+        gAoRadius = 1.f;
+    }
+    if (gHeadless && gHiZCheck) {
+        gAoRadius = fmaxf(gAoRadius, HIZ_CHECK_RADIUS);
+    }
+    if (!gHeadless || gOnDemand) {
+        // G-bufferは前のフレームのものを使い回す (シングルバッファでは画面も)
+        gIncremental = true;
+    }
+    if (gFrameRateCap < 0) {
+        gFrameRateCap = 0;
+    }
+    if (gFrameBudget > 0) {
+        if (gOnDemand) {
+            fprintf(stderr, "--frame-budget redraws every frame, it does not support --on-demand\n");
+            exit(1);
+        }
+        // 解像度が変わるたびに全体を描き直すので、前のフレームの範囲は使わない
+        gIncremental = false;
+        gMinRenderScale = fminf(1.f, fmaxf(DRS_SCALE_STEP, gMinRenderScale));
+    }
+    if (gBatchPath) {
+        gHeadless = true;
+    }
+    if (gBatchWorkers < 1) {
+        gBatchWorkers = 1;
+    } else if (gBatchWorkers > MAX_BATCH_WORKERS) {
+        gBatchWorkers = MAX_BATCH_WORKERS;
+    }
+    if (gReadbackBuffers < 0) {
+        gReadbackBuffers = 0;
+    } else if (gReadbackBuffers > MAX_READBACK_BUFFERS) {
+        gReadbackBuffers = MAX_READBACK_BUFFERS;
+    }
+    if (gHeadless && gReadbackSweep && gRecordPath == NULL) {
+        fprintf(stderr, "--readback-sweep needs --record\n");
+        exit(1);
+    }
+    if (gJobThreads < 0) {
+        gJobThreads = 0;
+    } else if (gJobThreads > MAX_JOB_THREADS) {
+        gJobThreads = MAX_JOB_THREADS;
+    }
+    if (gHeadless && gJobSweep) {
+        gFrustumCulling = true;
+        if (gMovingInstances == 0) gMovingInstances = gNumInstances;
+    }
+    if (gBoxVariants < 1) {
+        gBoxVariants = 1;
+    } else if (gBoxVariants > MAX_MESHES) {
+        gBoxVariants = MAX_MESHES;
+    }
+    if (gAoCompute || (gHeadless && gAoSweep)) {
+        // タイルと周囲だけを共有メモリに置くので、フル解像度で1回の計算に限る
+        if (gAoScale > 1 || gAoTemporal || gHiZ || (gHeadless && gHiZCheck)) {
+            fprintf(stderr, "The compute SSAO backend does not support --ao half|quarter, --ao-temporal or --hiz\n");
+            exit(1);
+        }
+        if (aoApron() > AO_MAX_APRON) {
+            fprintf(stderr, "The compute SSAO backend supports --ao-radius up to %g\n", AO_MAX_APRON / 3.0);
+            exit(1);
+        }
+    }
+    if ((gAoKernel != AO_KERNEL_FIXED || (gHeadless && gAoTierSweep)) && gAoTemporal) {
+        fprintf(stderr, "--ao-temporal jitters the fixed kernel, it does not support --ao-kernel\n");
+        exit(1);
+    }
+    if (gAoNoise != AO_NOISE_NONE && gAoKernel == AO_KERNEL_FIXED) {
+        // 固定のカーネルの角の点は回すと--ao-computeの周囲の幅を越える
+        fprintf(stderr, "--ao-noise rotates the --ao-kernel stratified|poisson kernels\n");
+        exit(1);
+    }
+    if (gNumSamples < 1) {
+        gNumSamples = 1;
+    } else if (gNumSamples > MAX_SAMPLE_POINTS) {
+        gNumSamples = MAX_SAMPLE_POINTS;
+    }
+    if (gNumLights < 1) {
+        gNumLights = 1;
+    } else if (gNumLights > MAX_LIGHTS && !gTiledLights) {
+        fprintf(stderr, "More than %d lights need --tiled-lights\n", MAX_LIGHTS);
+        exit(1);
+    } else if (gNumLights > MAX_TILED_LIGHTS) {
+        gNumLights = MAX_TILED_LIGHTS;
+    }
+}
 
-    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, gPositionTexture, 0);
-    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT1_EXT, GL_TEXTURE_2D, gNormalTexture, 0);
-    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT2_EXT, GL_TEXTURE_2D, gAlbedoTexture, 0);
+int main(int argc, char *argv[]) {
+    parseArgs(argc, argv);
+    if (gTracePath) {
+        traceInit();
+    }
 
-    // デプスバッファの用意
-    GLuint depthrenderbuffer;
-    glGenRenderbuffersEXT(1, &depthrenderbuffer);
-    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depthrenderbuffer);
-    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT, FBO_WIDTH, FBO_HEIGHT);
-    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, depthrenderbuffer);
+    if (gConvertObjPath) {
+        return convertObj(gConvertObjPath, gConvertMeshPath) ? 0 : 1;
+    }
+    if (gTransformBench) {
+        return runTransformBench();
+    }
 
-    if(glCheckFramebufferStatus(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "Failed to initialize FBO\n");
-        exit(1);
+    if (gBatchPath) {
+        loadBatchJobs();
+        // 親はワーカーを待つだけでGLを使わない
+        if (gBatchWorkers > 1 && !forkBatchWorkers()) {
+            return reportBatch();
+        }
+    }
+    if (gJobThreads > 0) {
+        setJobThreads(gJobThreads);
+    }
+    if (gResolutionLogPath) {
+        gResolutionLog = fopen(gResolutionLogPath, "w");
+        if (gResolutionLog == NULL) {
+            fprintf(stderr, "Could not open %s\n", gResolutionLogPath);
+        } else {
+            fprintf(gResolutionLog, "frame,scale,width,height,frame_ms\n");
+        }
     }
 
-    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    if (gHeadless) {
+        initHeadlessContext();
+        stateReset();
+    } else {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | (gDoubleBuffer ? GLUT_DOUBLE : GLUT_SINGLE));
+        glutInitWindowSize(gWidth, gHeight);
+        glutCreateWindow(argv[0]);
+        glutDisplayFunc(display);
+        glutReshapeFunc(reshape);
+        glutKeyboardFunc(keyboard);
+        glutIdleFunc(idle);
+
+        int err = glewInit();
+        if (err != GLEW_OK) {
+            fprintf(stderr, "Failed to initialize glew: %d\n", err);
+            exit(1);
+        }
+        if (gDoubleBuffer) {
+            setSwapInterval(gSwapInterval);
+        }
+        stateReset();
+    }
 
-    // TODO ライトの初期化
-    gLights.pos[0] = 0.0;
-    gLights.pos[1] = 0.0;
-    gLights.pos[2] = 1.0;
+    if (gShaderCacheDir) {
+        GLint formats = 0;
+        if (GLEW_ARB_get_program_binary) {
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        }
+        if (formats == 0) {
+            gShaderCacheDir = NULL; // ドライバがプログラムバイナリを扱えない
+        }
+    }
 
-    gLights.power[0] = 1.f;
-    gLights.power[1] = 1.f;
-    gLights.power[2] = 1.f;
+    buildShaderDefines();
 
-    gLights.dist[0] = 3.5;
-}
+    const double shader_start = nowMs();
+    gPass1Program = loadShader(PASS1_VERT_SHADER, PASS1_FRAG_SHADER, 1, gShaderDefines);
+    initPass1Shader();
 
-int main(int argc, char *argv[]) {
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH);
-    glutInitWindowSize(WINDOW_WIDTH, WINDOW_HEIGHT);
-    glutCreateWindow(argv[0]);
-    glutDisplayFunc(display);
-    glutIdleFunc(idle);
-
-    int err = glewInit();
-    if (err != GLEW_OK) {
-        fprintf(stderr, "Failed to initialize glew: %d\n", err);
-        exit(1);
+    if (gAoCompute || (gHeadless && gAoSweep)) {
+        requireComputeShaders("The compute SSAO backend");
+    }
+    if (useAoPass() || (gHeadless && gAoSweep)) {
+        initAoPass();
+    }
+    if (gTiledLights || (gHeadless && gLightSweep)) {
+        initLightCulling();
+    }
+    if (gHiZ || (gHeadless && gHiZCheck)) {
+        initHiZPass();
+    }
+    if (gAoNoise == AO_NOISE_TILED || (gHeadless && gAoTierSweep)) {
+        initAoNoise();
     }
+    if (gHeadless) {
+        initOutputFramebuffer();
+    }
+    if (gFrameBudget > 0) {
+        initScaledFramebuffer();
+    }
+    allocateRenderTargets();
 
-    gPass1Program = loadShader(PASS1_VERT_SHADER, PASS1_FRAG_SHADER, 1);
-    initPass1Shader();
+    // 品質の段階は全て先にコンパイルしておき、切り替え時に止まらないようにする
+    if (!gAoTemporal) {
+        for (int i = 0; i < NUM_QUALITY_TIERS; i++) {
+            getShaderVariant(QUALITY_TIER_SAMPLES[i], gNumLights, gTiledLights);
+        }
+    }
+    selectShaderVariant();
+    if (gShaderCacheDir) {
+        printf("shader startup: %.1f ms (binary cache %s: %d hits, %d misses)\n",
+            nowMs() - shader_start, gShaderCacheDir, gShaderCacheHits, gShaderCacheMisses);
+    } else {
+        printf("shader startup: %.1f ms (no binary cache)\n", nowMs() - shader_start);
+    }
 
-    gPass2Program = loadShader(PASS2_VERT_SHADER, PASS2_FRAG_SHADER, 2);
+    if (gBatchPath) {
+        traceFrameLoop(true);
+        int result = runBatch();
+        traceFrameLoop(false);
+        if (gBatchWorkers == 1 && reportBatch() != 0) result = 1;
+        if (gTimingCsv) fclose(gTimingCsv);
+        return result;
+    }
+    if (gHeadless) {
+        traceFrameLoop(true);
+        const int result = runHeadless();
+        traceFrameLoop(false);
+        if (gTimingCsv) fclose(gTimingCsv);
+        return result;
+    }
 
+    timerInit();
+    traceFrameLoop(true);
     glutMainLoop();
     return 0;
 }